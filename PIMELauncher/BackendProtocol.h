@@ -0,0 +1,124 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_BACKEND_PROTOCOL_H_
+#define _PIME_BACKEND_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Wire format used between PIMELauncher and the backend processes.
+//
+// Text mode (the default, supported by every backend):
+//   launcher => backend: <client_id>|<json>\n
+//   backend => launcher: PIME_MSG|<client_id>|<json>\n
+//   Any other line printed by the backend is treated as debug output.
+//
+// Log channel:
+//   The launcher always reads the stderr of the backend as debug output, and
+//   sets the environment variable PIME_LOG=stderr. A backend which writes all
+//   of its debug output to stderr prints backendLogAck as a text line before
+//   it becomes ready, and the launcher then treats its stdout as replies only.
+//
+// Binary mode (optional):
+//   If enabled in backends.json, the launcher offers it to the backend by
+//   setting the environment variable PIME_FRAMING=binary. A backend which
+//   supports it prints backendFramingAck as a text line and then only writes
+//   binary frames to its stdout. The launcher keeps using text mode until it
+//   receives the ack, so the backend must accept both formats on its stdin.
+//   The first byte of a binary frame is 'P', which never starts a text line.
+//
+//   Every binary frame starts with a 16-byte header (all fields little-endian)
+//   followed by <length> bytes of payload:
+//     uint16 magic         frameMagic
+//     uint16 type          one of the FrameType values
+//     uint32 length        payload length
+//     uint32 clientHandle  handle of the client, 0 if not bound to a client
+//     uint32 seqNum        assigned by the launcher, echoed in the reply
+
+namespace PIME {
+
+static const char backendFramingEnv[] = "PIME_FRAMING=binary";
+static const char backendFramingAck[] = "PIME_FRAMING|binary";
+
+static const char backendLogEnv[] = "PIME_LOG=stderr";
+static const char backendLogAck[] = "PIME_LOG|stderr";
+
+static const uint16_t frameMagic = 0x4d50; // "PM" in little-endian
+static const size_t frameHeaderSize = 16;
+static const uint32_t maxFramePayloadSize = 16 * 1024 * 1024;
+
+enum FrameType : uint16_t {
+	FRAME_REQUEST = 1,  // json message from a client, launcher => backend
+	FRAME_REPLY = 2,  // json reply to a client, backend => launcher
+	FRAME_LOG = 3  // debug output of the backend
+};
+
+struct FrameHeader {
+	uint16_t type;
+	uint32_t length;
+	uint32_t clientHandle;
+	uint32_t seqNum;
+};
+
+inline void encodeFrameHeader(const FrameHeader& header, char* buf) {
+	auto p = reinterpret_cast<unsigned char*>(buf);
+	auto put16 = [&p](uint16_t v) {
+		*p++ = v & 0xff;
+		*p++ = (v >> 8) & 0xff;
+	};
+	auto put32 = [&p](uint32_t v) {
+		*p++ = v & 0xff;
+		*p++ = (v >> 8) & 0xff;
+		*p++ = (v >> 16) & 0xff;
+		*p++ = (v >> 24) & 0xff;
+	};
+	put16(frameMagic);
+	put16(header.type);
+	put32(header.length);
+	put32(header.clientHandle);
+	put32(header.seqNum);
+}
+
+// buf should contain at least frameHeaderSize bytes.
+// returns false if the data is not a valid frame header.
+inline bool decodeFrameHeader(const char* buf, FrameHeader& header) {
+	auto p = reinterpret_cast<const unsigned char*>(buf);
+	auto get16 = [&p]() {
+		uint16_t v = uint16_t(p[0] | (p[1] << 8));
+		p += 2;
+		return v;
+	};
+	auto get32 = [&p]() {
+		uint32_t v = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+		p += 4;
+		return v;
+	};
+	if (get16() != frameMagic)
+		return false;
+	header.type = get16();
+	header.length = get32();
+	header.clientHandle = get32();
+	header.seqNum = get32();
+	return header.length <= maxFramePayloadSize;
+}
+
+} // namespace PIME
+
+#endif // _PIME_BACKEND_PROTOCOL_H_
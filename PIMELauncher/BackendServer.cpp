@@ -17,14 +17,20 @@
 //	Boston, MA  02110-1301, USA.
 //
 
+#ifdef _WIN32
 #include <Windows.h>
 #include <ShlObj.h>
 #include <Shellapi.h>
 #include <Lmcons.h> // for UNLEN
 #include <Wincrypt.h>  // for CryptBinaryToString (used for base64 encoding)
+#else
+#include <csignal>
+extern char** environ;
+#endif
 #include <cstring>
 #include <cassert>
 #include <chrono>  // C++ 11 clock functions
+#include <thread>
 #include <string>
 #include <vector>
 #include <map>
@@ -36,7 +42,10 @@
 #include <json/json.h>
 
 #include "BackendServer.h"
+#include "JsonFieldScanner.h"
 #include "PipeServer.h"
+#include "TraceRecorder.h"
+#include "Utils.h"
 
 using namespace std;
 
@@ -44,96 +53,848 @@ static wstring_convert<codecvt_utf8<wchar_t>> utf8Codec;
 
 namespace PIME {
 
+// number of virtual nodes of each worker on the consistent hash ring
+static const int hashRingReplicas = 64;
+
+// max number of client messages queued in a worker while the backend process is starting or busy
+static const size_t maxPendingMessages = 256;
+
+// by default, keep at most 2 requests in the stdin pipe of a backend process, so the
+// process always has the next one to handle while key events can still overtake the others.
+static const size_t defaultMaxInFlight = 2;
+
+// starvation bound of the background lane: send one of its messages after this many key events
+static const unsigned int maxInteractiveBurst = 8;
+
+// if the backend process does not become ready in time, stop waiting for it (in ms)
+static const uint64_t backendReadyTimeout = 10000;
+
+// printed by the backend process as a text line when it's ready
+static const char backendReadyMessage[] = "PIME_READY";
+
+// the log output of a backend process is passed to the pipe server in batches after
+// this delay (in ms), or once it reaches the max size, so it does not compete with the replies.
+static const uint64_t logFlushDelay = 50;
+static const size_t maxPendingLogSize = 16 * 1024;
+
+// default max time to wait for the reply of a request (in ms)
+// NOTE: requests sent while the backend is starting get backendReadyTimeout more.
+static const uint64_t defaultRequestTimeout = 5000;
+
+// default timeout of the key events (in ms). the app is frozen while it waits for them, so give up early.
+static const uint64_t defaultKeyHandlerTimeout = 500;
+// filterKeyDown and filterKeyUp are sent for every key stroke, so a backend which always
+// filters keys quickly can ask for a shorter timeout with "shortFilterKeyTimeout": true.
+static const uint64_t shortFilterKeyTimeout = 50;
+
+// default max number of requests of a worker which time out in a row, without any
+// reply in between, before restarting it. a slow but working backend is not restarted.
+static const unsigned int defaultMaxRequestTimeouts = 5;
+
+// stop a backend which has no clients for 30 minutes by default (in ms)
+static const uint64_t defaultIdleTimeout = 30 * 60 * 1000;
+
+// max number of different methods with their own latency histograms
+static const size_t maxLatencyMethods = 64;
+
+// default size of the message queues between the client loop and the loop of a threaded backend
+static const size_t defaultLoopQueueSize = 1024;
+
+// 32-bit FNV-1a hash
+static uint32_t fnv1aHash(const void* data, size_t len, uint32_t hash = 2166136261u) {
+	auto p = reinterpret_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 BackendServer::BackendServer(PipeServer* pipeServer, const Json::Value& info) :
 	pipeServer_{pipeServer},
+	info_(info),
+	name_(info["name"].asString()),
+	command_(info["command"].asString()),
+	params_(info["params"].asString()),
+	workingDir_(info["workingDir"].asString()),
+	offerBinaryFraming_{info.get("framing", "text").asString() == "binary"},
+	// the binary framing ack also tells us that the backend is ready
+	waitForReady_{info.get("readySignal", offerBinaryFraming_).asBool()},
+	maxInFlight_{info.get("maxInFlight", Json::UInt(defaultMaxInFlight)).asUInt()},
+	eagerStart_{info.get("eagerStart", false).asBool()},
+	idleTimeout_{info.get("idleTimeout", defaultIdleTimeout).asUInt64()},
+	clientCount_{0},
+	lastActiveTime_{uv_now(uv_default_loop())},
+	suspended_{false},
+	defaultRequestTimeout_{defaultRequestTimeout},
+	maxRequestTimeouts_{info.get("maxRequestTimeouts", defaultMaxRequestTimeouts).asUInt()},
+	totalTimeouts_{0},
+	totalRestarts_{0},
+	loop_{uv_default_loop()},
+	threadStarted_{false},
+	wakeUpBackendLoop_{nullptr},
+	hasControlMessages_{false},
+	hasPendingClientLoopMessages_{false},
+	stopping_{false} {
+
+	// timeouts of each method, for example: "requestTimeouts": {"filterKeyDown": 50, "onMenu": 3000, "default": 1000}
+	uint64_t filterKeyTimeout = info.get("shortFilterKeyTimeout", false).asBool() ? shortFilterKeyTimeout : defaultKeyHandlerTimeout;
+	requestTimeouts_["filterKeyDown"] = filterKeyTimeout;
+	requestTimeouts_["filterKeyUp"] = filterKeyTimeout;
+	requestTimeouts_["onKeyDown"] = defaultKeyHandlerTimeout;
+	requestTimeouts_["onKeyUp"] = defaultKeyHandlerTimeout;
+	requestTimeouts_["onPreservedKey"] = defaultKeyHandlerTimeout;
+	const Json::Value& timeouts = info["requestTimeouts"];
+	if (timeouts.isObject()) {
+		for (auto it = timeouts.begin(); it != timeouts.end(); ++it) {
+			if (it->isUInt()) {
+				if (it.name() == "default")
+					defaultRequestTimeout_ = it->asUInt();
+				else
+					requestTimeouts_[it.name()] = it->asUInt();
+			}
+		}
+	}
+
+	if (info.get("threaded", false).asBool()) {
+		// run the worker processes in a dedicated event loop.
+		// the thread running it is started later by startLoopThread().
+		loop_ = new uv_loop_t{};
+		uv_loop_init(loop_);
+		// a small queue can be set in backends.json to test how the loops handle a full queue
+		size_t queueSize = info.get("loopQueueSize", Json::UInt(defaultLoopQueueSize)).asUInt();
+		if (queueSize < 2 || (queueSize & (queueSize - 1)) != 0)  // it must be a power of 2
+			queueSize = defaultLoopQueueSize;
+		toBackendLoop_.reset(new SpscQueue<BackendLoopMessage>(queueSize));
+		toClientLoop_.reset(new SpscQueue<BackendLoopMessage>(queueSize));
+		// the buffer pools are not thread-safe, so every loop has its own
+		readBufferPool_.reset(new ReadBufferPool());
+		writeRequestPool_.reset(new WriteRequestPool());
+		wakeUpBackendLoop_ = new uv_async_t{};
+		uv_async_init(loop_, wakeUpBackendLoop_, [](uv_async_t* async) {
+			reinterpret_cast<BackendServer*>(async->data)->dispatchBackendLoopMessages();
+		});
+		wakeUpBackendLoop_->data = this;
+	}
+
+	// number of worker processes of the backend
+	int workerCount = info.get("workers", 1).asInt();
+	if (workerCount < 1)
+		workerCount = 1;
+	for (int i = 0; i < workerCount; ++i) {
+		workers_.push_back(new BackendWorker(this, i));
+	}
+	buildHashRing();
+}
+
+BackendServer::~BackendServer() {
+	if (isThreaded()) {
+		if (threadStarted_) {
+			// ask the backend loop to close all of its handles, and wait for the thread to exit.
+			// the backend loop stops passing messages to us since we're not reading them any more.
+			stopping_ = true;
+			postToBackendLoop(BackendLoopMessage::STOP_LOOP, -1);
+			while (!flushControlMessages()) {
+				uv_async_send(wakeUpBackendLoop_);
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+			uv_thread_join(&thread_);
+		}
+		else {
+			closeLoopHandles();
+			uv_run(loop_, UV_RUN_DEFAULT);
+		}
+		uv_loop_close(loop_);
+		delete loop_;
+	}
+	for (auto worker : workers_) {
+		delete worker;
+	}
+}
+
+void BackendServer::startLoopThread() {
+	if (!isThreaded() || threadStarted_)
+		return;
+	threadStarted_ = (uv_thread_create(&thread_, [](void* arg) {
+		auto backend = reinterpret_cast<BackendServer*>(arg);
+		TraceRecorder::setThreadName("backend " + backend->name_);
+		uv_run(backend->loop_, UV_RUN_DEFAULT);
+	}, this) == 0);
+}
+
+void BackendServer::closeLoopHandles() {
+	// called in the backend loop. the loop exits once all handles are closed.
+	for (auto worker : workers_) {
+		worker->shutdown();
+	}
+	uv_close(reinterpret_cast<uv_handle_t*>(wakeUpBackendLoop_), [](uv_handle_t* handle) {
+		delete reinterpret_cast<uv_async_t*>(handle);
+	});
+	wakeUpBackendLoop_ = nullptr;
+}
+
+ReadBufferPool& BackendServer::readBufferPool() {
+	return readBufferPool_ ? *readBufferPool_ : pipeServer_->readBufferPool();
+}
+
+WriteRequestPool& BackendServer::writeRequestPool() {
+	return writeRequestPool_ ? *writeRequestPool_ : pipeServer_->writeRequestPool();
+}
+
+bool BackendServer::postToBackendLoop(BackendLoopMessage::Type type, int worker, ClientTable::Handle clientHandle, const char* data, size_t len, MessageLane lane) {
+	// the control messages kept earlier go first, so the backend loop gets all messages in order
+	BackendLoopMessage* msg = flushControlMessages() ? toBackendLoop_->back() : nullptr;
+	if (msg == nullptr) {  // the queue is full
+		bool dropped = (type == BackendLoopMessage::CLIENT_REQUEST);
+		if (!dropped) {
+			// the other messages are never dropped. keep them until the backend loop catches up.
+			controlMessages_.push_back(BackendLoopMessage{ type, worker, clientHandle, lane, string(data != nullptr ? data : "", len) });
+			hasControlMessages_ = true;
+		}
+		uv_async_send(wakeUpBackendLoop_);
+		// the caller fails a dropped request so the client is not blocked
+		return !dropped;
+	}
+	msg->type = type;
+	msg->worker = worker;
+	msg->clientHandle = clientHandle;
+	msg->lane = lane;
+	msg->data.assign(data != nullptr ? data : "", len);
+	toBackendLoop_->push();
+	uv_async_send(wakeUpBackendLoop_);
+	return true;
+}
+
+bool BackendServer::flushControlMessages() {
+	while (!controlMessages_.empty()) {
+		BackendLoopMessage* msg = toBackendLoop_->back();
+		if (msg == nullptr)
+			return false;
+		*msg = std::move(controlMessages_.front());
+		toBackendLoop_->push();
+		controlMessages_.pop_front();
+	}
+	if (hasControlMessages_) {
+		hasControlMessages_ = false;
+		uv_async_send(wakeUpBackendLoop_);
+	}
+	return true;
+}
+
+void BackendServer::postToClientLoop(BackendLoopMessage::Type type, int worker, ClientTable::Handle clientHandle, const char* data, size_t len) {
+	// the messages kept earlier go first, so the client loop gets all messages in order
+	BackendLoopMessage* msg = flushPendingClientLoopMessages() ? toClientLoop_->back() : nullptr;
+	if (msg == nullptr) {  // the queue is full
+		// the client loop is busy. keep the message until it catches up rather than
+		// dropping a reply or blocking the backend loop.
+		if (!stopping_) {  // otherwise the client loop is waiting for us to exit
+			pendingClientLoopMessages_.push_back(BackendLoopMessage{ type, worker, clientHandle, BACKGROUND_LANE, string(data != nullptr ? data : "", len) });
+			hasPendingClientLoopMessages_ = true;
+		}
+		pipeServer_->wakeUpClientLoop();
+		return;
+	}
+	msg->type = type;
+	msg->worker = worker;
+	msg->clientHandle = clientHandle;
+	msg->data.assign(data != nullptr ? data : "", len);
+	toClientLoop_->push();
+	pipeServer_->wakeUpClientLoop();
+}
+
+bool BackendServer::flushPendingClientLoopMessages() {
+	while (!pendingClientLoopMessages_.empty()) {
+		BackendLoopMessage* msg = toClientLoop_->back();
+		if (msg == nullptr)
+			return false;
+		*msg = std::move(pendingClientLoopMessages_.front());
+		toClientLoop_->push();
+		pendingClientLoopMessages_.pop_front();
+	}
+	if (hasPendingClientLoopMessages_) {
+		hasPendingClientLoopMessages_ = false;
+		pipeServer_->wakeUpClientLoop();
+	}
+	return true;
+}
+
+void BackendServer::dispatchBackendLoopMessages() {
+	// called in the backend loop
+	while (BackendLoopMessage* msg = toBackendLoop_->front()) {
+		BackendWorker* worker = (msg->worker >= 0 && size_t(msg->worker) < workers_.size()) ? workers_[msg->worker] : nullptr;
+		switch (msg->type) {
+		case BackendLoopMessage::CLIENT_REQUEST:
+			worker->handleClientMessage(msg->clientHandle, msg->data.c_str(), msg->data.length(), true, msg->lane);
+			break;
+		case BackendLoopMessage::CLIENT_NOTIFY:
+			if (worker->isProcessRunning()) {
+				worker->handleClientMessage(msg->clientHandle, msg->data.c_str(), msg->data.length(), false, msg->lane);
+			}
+			break;
+		case BackendLoopMessage::REQUEST_TIMEOUT:
+			worker->onRequestTimeout(msg->clientHandle);
+			break;
+		case BackendLoopMessage::START_PROCESS:
+			startWorkers();
+			break;
+		case BackendLoopMessage::RESTART_PROCESS:
+			restartWorkers();
+			break;
+		case BackendLoopMessage::TERMINATE_PROCESS:
+			terminateWorkers();
+			break;
+		case BackendLoopMessage::STOP_LOOP:
+			toBackendLoop_->pop();
+			closeLoopHandles();
+			return;
+		default:
+			break;
+		}
+		toBackendLoop_->pop();
+	}
+	if (hasControlMessages_ && !stopping_) {
+		// there's room in the queue now, ask the client loop for the messages it kept
+		pipeServer_->wakeUpClientLoop();
+	}
+	flushPendingClientLoopMessages();
+}
+
+void BackendServer::dispatchClientLoopMessages() {
+	// called in the client loop
+	if (!toClientLoop_)
+		return;
+	flushControlMessages();
+	while (BackendLoopMessage* msg = toClientLoop_->front()) {
+		switch (msg->type) {
+		case BackendLoopMessage::REPLY:
+			pipeServer_->handleBackendReply(msg->clientHandle, msg->data.c_str(), msg->data.length());
+			break;
+		case BackendLoopMessage::OUTPUT:
+			pipeServer_->handleBackendOutput(msg->data.c_str(), msg->data.length());
+			break;
+		case BackendLoopMessage::WORKER_CLOSED:
+			pipeServer_->onBackendClosed(workers_[msg->worker]);
+			break;
+		default:
+			break;
+		}
+		toClientLoop_->pop();
+	}
+	if (hasPendingClientLoopMessages_ && !stopping_) {
+		// there's room in the queue now, ask the backend loop for the messages it kept
+		uv_async_send(wakeUpBackendLoop_);
+	}
+}
+
+void BackendServer::deliverReply(ClientTable::Handle clientHandle, const char* msg, size_t len) {
+	if (isThreaded())
+		postToClientLoop(BackendLoopMessage::REPLY, -1, clientHandle, msg, len);
+	else
+		pipeServer_->handleBackendReply(clientHandle, msg, len);
+}
+
+void BackendServer::deliverOutput(const char* data, size_t len) {
+	if (isThreaded())
+		postToClientLoop(BackendLoopMessage::OUTPUT, -1, ClientTable::invalidHandle, data, len);
+	else
+		pipeServer_->handleBackendOutput(data, len);
+}
+
+void BackendServer::deliverWorkerClosed(BackendWorker* worker) {
+	if (isThreaded())
+		postToClientLoop(BackendLoopMessage::WORKER_CLOSED, worker->id_, ClientTable::invalidHandle, nullptr, 0);
+	else
+		pipeServer_->onBackendClosed(worker);
+}
+
+void BackendServer::buildHashRing() {
+	// Every worker is mapped to many points on the ring, and a client is served by
+	// the worker owning the first point after the hash of the client.
+	// If the number of workers is changed, only the clients on the affected
+	// part of the ring are moved to another worker.
+	hashRing_.clear();
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		for (int replica = 0; replica < hashRingReplicas; ++replica) {
+			string key = name_ + "#" + to_string(i) + "#" + to_string(replica);
+			hashRing_.emplace_back(fnv1aHash(key.c_str(), key.length()), i);
+		}
+	}
+	sort(hashRing_.begin(), hashRing_.end());
+}
+
+uint64_t BackendServer::methodTimeout(const std::string& method) const {
+	auto it = requestTimeouts_.find(method);
+	return it != requestTimeouts_.end() ? it->second : defaultRequestTimeout_;
+}
+
+uint64_t BackendServer::requestTimeout(const std::string& method, ClientInfo* client) {
+	uint64_t timeout = methodTimeout(method);
+	// with fused key events, the backend also handles the key after filtering it
+	if (client->fusedKeyEvents_) {
+		if (method == "filterKeyDown")
+			timeout += methodTimeout("onKeyDown");
+		else if (method == "filterKeyUp")
+			timeout += methodTimeout("onKeyUp");
+	}
+	// the request might need to wait for the process to start
+	auto worker = client->worker_ != nullptr ? client->worker_ : workerForClient(client);
+	if (!worker->isReady()) {
+		timeout += backendReadyTimeout;
+	}
+	return timeout;
+}
+
+LatencyHistogram* BackendServer::methodLatency(const std::string& method) {
+	auto it = methodLatency_.find(method);
+	if (it != methodLatency_.end())
+		return it->second.get();
+	// the method names come from the clients, don't let them make us allocate without limit.
+	if (methodLatency_.size() >= maxLatencyMethods)
+		return nullptr;
+	auto& histogram = methodLatency_[method];
+	histogram.reset(new LatencyHistogram());
+	return histogram.get();
+}
+
+BackendWorker* BackendServer::workerForClient(ClientInfo* client) {
+	if (workers_.size() == 1)
+		return workers_[0];
+	uint32_t hash = fnv1aHash(&client->handle_, sizeof(client->handle_));
+	auto it = lower_bound(hashRing_.begin(), hashRing_.end(), make_pair(hash, size_t(0)));
+	if (it == hashRing_.end())  // wrap around
+		it = hashRing_.begin();
+	return workers_[it->second];
+}
+
+MessageLane BackendServer::laneForMethod(const std::string& method) {
+	// the user is waiting for the key events while typing
+	if (method == "filterKeyDown" || method == "onKeyDown" || method == "filterKeyUp" || method == "onKeyUp")
+		return INTERACTIVE_LANE;
+	return BACKGROUND_LANE;
+}
+
+void BackendServer::handleClientMessage(ClientInfo * client, const char * readBuf, size_t len, MessageLane lane) {
+	lastActiveTime_ = uv_now(uv_default_loop());
+	suspended_ = false;  // the message starts the processes again
+	if (client->worker_ == nullptr) {
+		// pin the client to one of the workers when it's initialized
+		client->worker_ = workerForClient(client);
+	}
+	if (!isThreaded()) {
+		client->worker_->handleClientMessage(client->handle_, readBuf, len, true, lane);
+	}
+	else if (!postToBackendLoop(BackendLoopMessage::CLIENT_REQUEST, client->worker_->id(), client->handle_, readBuf, len, lane)) {
+		// the backend loop cannot catch up. fail the request so the client is not blocked.
+		char reply[64];
+		int replyLen = snprintf(reply, sizeof(reply), "{\"success\":false,\"seqNum\":%u}", client->pendingSeqNum_);
+		pipeServer_->handleBackendReply(client->handle_, reply, replyLen);
+	}
+}
+
+void BackendServer::removeClient(ClientInfo* client) {
+	if (client->worker_ != nullptr && client->worker_->isProcessRunning()) {
+		// notify the backend server to remove the client
+		const char msg[] = "{\"method\":\"close\"}";
+		if (isThreaded())
+			postToBackendLoop(BackendLoopMessage::CLIENT_NOTIFY, client->worker_->id(), client->handle_, msg, strlen(msg));
+		else
+			client->worker_->handleClientMessage(client->handle_, msg, strlen(msg), false);
+	}
+}
+
+void BackendServer::onRequestTimeout(BackendWorker* worker, ClientTable::Handle clientHandle) {
+	if (isThreaded())
+		postToBackendLoop(BackendLoopMessage::REQUEST_TIMEOUT, worker->id(), clientHandle);
+	else
+		worker->onRequestTimeout(clientHandle);
+}
+
+void BackendServer::terminateProcess() {
+	if (isThreaded())
+		postToBackendLoop(BackendLoopMessage::TERMINATE_PROCESS, -1);
+	else
+		terminateWorkers();
+}
+
+void BackendServer::startProcess() {
+	if (isThreaded())
+		postToBackendLoop(BackendLoopMessage::START_PROCESS, -1);
+	else
+		startWorkers();
+}
+
+void BackendServer::restartProcess() {
+	if (isThreaded())
+		postToBackendLoop(BackendLoopMessage::RESTART_PROCESS, -1);
+	else
+		restartWorkers();
+}
+
+void BackendServer::terminateWorkers() {
+	for (auto worker : workers_) {
+		worker->terminateProcess();
+	}
+}
+
+bool BackendServer::isProcessRunning() {
+	for (auto worker : workers_) {
+		if (worker->isProcessRunning())
+			return true;
+	}
+	return false;
+}
+
+void BackendServer::startWorkers() {
+	for (auto worker : workers_) {
+		if (!worker->isProcessRunning())
+			worker->startProcess();
+	}
+}
+
+void BackendServer::restartWorkers() {
+	for (auto worker : workers_) {
+		if (worker->isProcessRunning())
+			worker->restartProcess();
+	}
+}
+
+
+BackendWorker::BackendWorker(BackendServer* backend, int id) :
+	backend_{backend},
+	id_{id},
+	loop_{backend->loop_},
 	process_{ nullptr },
+	running_{false},
 	stdinPipe_{nullptr},
 	stdoutPipe_{nullptr},
+	stderrPipe_{nullptr},
+	logFlushTimer_{new uv_timer_t{}},
+	logOnStderr_{false},
 	ready_{false},
-	name_(info["name"].asString()),
 	needRestart_{false},
-	command_(info["command"].asString()),
-	workingDir_(info["workingDir"].asString()),
-	params_(info["params"].asString()) {
+	nextSeqNum_{0},
+	startCount_{0},
+	queueDepth_{0},
+	queuedMessages_{},
+	interactiveBurst_{0},
+	readyTimer_{new uv_timer_t{}},
+	timeoutCount_{0} {
+	uv_timer_init(loop_, readyTimer_);
+	readyTimer_->data = this;
+	uv_timer_init(loop_, logFlushTimer_);
+	logFlushTimer_->data = this;
 }
 
-BackendServer::~BackendServer() {
-	terminateProcess();
+BackendWorker::~BackendWorker() {
+	// the backend might be removed when reloading the config,
+	// so close everything which might call us back later.
+	shutdown();
 }
 
-void BackendServer::handleClientMessage(ClientInfo * client, const char * readBuf, size_t len) {
+void BackendWorker::shutdown() {
+	needRestart_ = false;
+	if (process_ != nullptr) {
+		closeStdioPipes();
+		uv_process_kill(process_, SIGTERM);
+		// don't wait for the process to exit
+		uv_close(reinterpret_cast<uv_handle_t*>(process_), [](uv_handle_t* handle) {
+			delete reinterpret_cast<uv_process_t*>(handle);
+		});
+		process_ = nullptr;
+		running_ = false;
+	}
+	closeStderrPipes();
+	if (readyTimer_ != nullptr) {
+		uv_close(reinterpret_cast<uv_handle_t*>(readyTimer_), [](uv_handle_t* handle) {
+			delete reinterpret_cast<uv_timer_t*>(handle);
+		});
+		readyTimer_ = nullptr;
+	}
+	if (logFlushTimer_ != nullptr) {
+		uv_close(reinterpret_cast<uv_handle_t*>(logFlushTimer_), [](uv_handle_t* handle) {
+			delete reinterpret_cast<uv_timer_t*>(handle);
+		});
+		logFlushTimer_ = nullptr;
+	}
+}
+
+void BackendWorker::handleClientMessage(ClientTable::Handle clientHandle, const char * readBuf, size_t len, bool expectReply, MessageLane lane) {
 	if (!isProcessRunning()) {
 		startProcess();
+		if (!isProcessRunning()) {  // fail to launch the backend
+			if (expectReply) {
+				failRequest(clientHandle, readBuf, len);
+			}
+			return;
+		}
 	}
 
-	// message format: <client_id>|<json string>\n
-	string msg = string{ client->clientId_ };
-	msg += "|";
-	msg.append(readBuf, len);
-	msg += "\n";
+	if (lane == INTERACTIVE_LANE && backgroundClients_.count(clientHandle) != 0) {
+		// the client has earlier messages in the background lane, don't overtake them
+		lane = BACKGROUND_LANE;
+	}
+	if (ready_ && lanes_[INTERACTIVE_LANE].empty() && lanes_[BACKGROUND_LANE].empty() &&
+		(!expectReply || backend_->maxInFlight_ == 0 || queueDepth() < backend_->maxInFlight_)) {
+		// the process can take the message now, send it without copying
+		backend_->laneWaitTime_[lane].record(0);
+		uint32_t seqNum = writeMessage(clientHandle, readBuf, len);
+		if (expectReply) {
+			addInFlightRequest(clientHandle, seqNum);
+		}
+		return;
+	}
 
-	// write the message to the backend server
-	uv_buf_t buf = {msg.length(), (char*)msg.c_str()};
-	uv_write_t* req = new uv_write_t{};
-	uv_write(req, stdinStream(), &buf, 1, [](uv_write_t* req, int status) {
-		delete req;
+	// the process is still starting up or busy, keep the message until it's ready
+	if (lanes_[INTERACTIVE_LANE].size() + lanes_[BACKGROUND_LANE].size() >= maxPendingMessages) {
+		// the backend is not responding at all. fail the request so the client is not blocked.
+		if (expectReply) {
+			failRequest(clientHandle, readBuf, len);
+		}
+		return;
+	}
+	lanes_[lane].push_back(QueuedMessage{ clientHandle, expectReply, uv_hrtime(), string{readBuf, len} });
+	TraceRecorder::record(lane == INTERACTIVE_LANE ? "queued (interactive)" : "queued (background)", TraceRecorder::INSTANT, clientHandle);
+	queuedMessages_[lane].store(lanes_[lane].size(), std::memory_order_relaxed);
+	if (lane == BACKGROUND_LANE) {
+		++backgroundClients_[clientHandle];
+	}
+}
+
+void BackendWorker::failRequest(ClientTable::Handle clientHandle, const char* readBuf, size_t len) {
+	// every request gets exactly one reply so the pipe server can match the replies.
+	// the client uses the seqNum to tell it from the replies of its earlier requests.
+	JsonField seqNumField{ "seqNum" };
+	uint32_t seqNum = 0;
+	if (JsonFieldScanner::scan(readBuf, len, &seqNumField, 1)) {
+		seqNumField.asUInt(seqNum);
+	}
+	char reply[64];
+	int replyLen = snprintf(reply, sizeof(reply), "{\"success\":false,\"seqNum\":%u}", seqNum);
+	backend_->deliverReply(clientHandle, reply, replyLen);
+}
+
+void BackendWorker::dispatchQueuedMessages() {
+	auto& interactive = lanes_[INTERACTIVE_LANE];
+	auto& background = lanes_[BACKGROUND_LANE];
+	while (ready_ && (!interactive.empty() || !background.empty())) {
+		// key events go first, but don't let them starve the background lane
+		MessageLane lane = (!interactive.empty() && (background.empty() || interactiveBurst_ < maxInteractiveBurst)) ?
+			INTERACTIVE_LANE : BACKGROUND_LANE;
+		auto& msg = lanes_[lane].front();
+		if (msg.expectReply && backend_->maxInFlight_ != 0 && queueDepth() >= backend_->maxInFlight_)
+			break;  // wait for a reply
+		if (lane == INTERACTIVE_LANE)
+			interactiveBurst_ = background.empty() ? 0 : interactiveBurst_ + 1;
+		else
+			interactiveBurst_ = 0;
+
+		backend_->laneWaitTime_[lane].record((uv_hrtime() - msg.queueTime) / 1000);
+		uint32_t seqNum = writeMessage(msg.clientHandle, msg.data.c_str(), msg.data.length());
+		if (msg.expectReply) {
+			addInFlightRequest(msg.clientHandle, seqNum);
+		}
+		if (lane == BACKGROUND_LANE) {
+			auto it = backgroundClients_.find(msg.clientHandle);
+			if (it != backgroundClients_.end() && --it->second == 0) {
+				backgroundClients_.erase(it);
+			}
+		}
+		lanes_[lane].pop_front();
+		queuedMessages_[lane].store(lanes_[lane].size(), std::memory_order_relaxed);
+	}
+}
+
+void BackendWorker::clearQueuedMessages() {
+	for (int lane = 0; lane < LANE_COUNT; ++lane) {
+		lanes_[lane].clear();
+		queuedMessages_[lane].store(0, std::memory_order_relaxed);
+	}
+	backgroundClients_.clear();
+	interactiveBurst_ = 0;
+}
+
+void BackendWorker::addInFlightRequest(ClientTable::Handle clientHandle, uint32_t seqNum) {
+	inFlightRequests_.push_back(InFlightRequest{ clientHandle, seqNum, false });
+	// only modified in the backend loop, so no atomic read-modify-write is needed here
+	queueDepth_.store(queueDepth_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void BackendWorker::decreaseQueueDepth(ClientTable::Handle clientHandle, const FrameHeader* header) {
+	auto request = inFlightRequests_.end();
+	if (header != nullptr) {
+		// binary frames echo the seqNum of the request
+		request = find_if(inFlightRequests_.begin(), inFlightRequests_.end(), [header](const InFlightRequest& request) {
+			return request.seqNum == header->seqNum;
+		});
+	}
+	if (request == inFlightRequests_.end() || request->clientHandle != clientHandle) {
+		// we cannot tell if it's the late reply of a timed out request, or the backend lost that
+		// one. assume it's the reply of a request which still holds a slot, so the worker is never
+		// blocked by lost replies. at worst one more request is sent until the late reply arrives.
+		request = find_if(inFlightRequests_.begin(), inFlightRequests_.end(), [clientHandle](const InFlightRequest& request) {
+			return request.clientHandle == clientHandle && !request.timedOut;
+		});
+		if (request == inFlightRequests_.end()) {
+			request = find_if(inFlightRequests_.begin(), inFlightRequests_.end(), [clientHandle](const InFlightRequest& request) {
+				return request.clientHandle == clientHandle;
+			});
+			if (request == inFlightRequests_.end())
+				return;
+		}
+	}
+	bool timedOut = request->timedOut;
+	inFlightRequests_.erase(request);
+	if (!timedOut) {  // the slot of a timed out request is already released
+		// the process is not hung
+		timeoutCount_ = 0;
+		queueDepth_.store(queueDepth_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		// the process has room for another request
+		dispatchQueuedMessages();
+	}
+}
+
+void BackendWorker::onRequestTimeout(ClientTable::Handle clientHandle) {
+	// the pipe server already failed the request. don't let its reply, which might never
+	// come, hold the slot, or all of the following requests would wait and time out too.
+	auto it = find_if(inFlightRequests_.begin(), inFlightRequests_.end(), [clientHandle](const InFlightRequest& request) {
+		return request.clientHandle == clientHandle && !request.timedOut;
 	});
+	if (it != inFlightRequests_.end()) {
+		it->timedOut = true;
+		queueDepth_.store(queueDepth_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		dispatchQueuedMessages();
+	}
+
+	++backend_->totalTimeouts_;
+	++timeoutCount_;
+	if (backend_->maxRequestTimeouts_ > 0 && timeoutCount_ >= backend_->maxRequestTimeouts_ && isProcessRunning()) {
+		// the backend keeps failing to reply in time, it's probably hung.
+		char msg[128];
+		snprintf(msg, sizeof(msg), "\nRestart hung backend: %s worker #%d\n", backend_->name_.c_str(), id_);
+		backend_->deliverOutput(msg, strlen(msg));
+		timeoutCount_ = 0;
+		restartProcess();
+	}
 }
 
-void BackendServer::startProcess() {
+uint32_t BackendWorker::writeMessage(ClientTable::Handle clientHandle, const char* readBuf, size_t len) {
+	// the message is written as several slices, and the payload is borrowed from
+	// the read buffer of the client, so nothing is copied in the common case.
+	static_assert(frameHeaderSize >= ClientTable::maxHandleStrLen + 1, "the header buffer is too small for the client ID");
+	char header[frameHeaderSize];
+	uv_buf_t bufs[3];
+	unsigned int nbufs;
+	uint32_t seqNum = 0;
+	if (stdoutFramer_.mode() == StreamFramer::BINARY_MODE) {
+		// message format: <frame header><json string>
+		seqNum = nextSeqNum_++;
+		FrameHeader frameHeader = { FRAME_REQUEST, uint32_t(len), clientHandle, seqNum };
+		encodeFrameHeader(frameHeader, header);
+		bufs[0] = uv_buf_init(header, unsigned(frameHeaderSize));
+		bufs[1] = uv_buf_init(const_cast<char*>(readBuf), unsigned(len));
+		nbufs = 2;
+	}
+	else {
+		// message format: <client_id>|<json string>\n
+		size_t headerLen = ClientTable::formatHandle(clientHandle, header);
+		header[headerLen++] = '|';
+		bufs[0] = uv_buf_init(header, unsigned(headerLen));
+		bufs[1] = uv_buf_init(const_cast<char*>(readBuf), unsigned(len));
+		bufs[2] = uv_buf_init(const_cast<char*>("\n"), 1);
+		nbufs = 3;
+	}
+
+	// write the message to the backend server
+	backend_->writeRequestPool().write(stdinStream(), bufs, nbufs, "written to backend", clientHandle);
+	return seqNum;
+}
+
+void BackendWorker::onReady() {
+	uv_timer_stop(readyTimer_);
+	if (ready_ || stdinPipe_ == nullptr)
+		return;
+	ready_ = true;
+	// send the messages received while the process is starting
+	dispatchQueuedMessages();
+}
+
+void BackendWorker::startProcess() {
 	process_ = new uv_process_t{};
 	process_->data = this;
 	// create pipes for stdio of the child process
 	stdinPipe_ = new uv_pipe_t{};
 	stdinPipe_->data = this;
-	uv_pipe_init(uv_default_loop(), stdinPipe_, 0);
+	uv_pipe_init(loop_, stdinPipe_, 0);
 
 	stdoutPipe_ = new uv_pipe_t{};
 	stdoutPipe_->data = this;
-	uv_pipe_init(uv_default_loop(), stdoutPipe_, 0);
+	uv_pipe_init(loop_, stdoutPipe_, 0);
+
+	// the stderr of the previous process might still be open if it did not exit cleanly.
+	// keep reading it until EOF, so we don't lose the end of its output, such as a traceback.
+	if (stderrPipe_ != nullptr) {
+		retiringStderrPipes_.push_back(stderrPipe_);
+		stderrPipe_ = nullptr;
+	}
+	stderrPipe_ = new uv_pipe_t{};
+	stderrPipe_->data = this;
+	uv_pipe_init(loop_, stderrPipe_, 0);
 
 	uv_stdio_container_t stdio_containers[3];
 	stdio_containers[0].data.stream = stdinStream();
 	stdio_containers[0].flags = uv_stdio_flags(UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE);
 	stdio_containers[1].data.stream = stdoutStream();
 	stdio_containers[1].flags = uv_stdio_flags(UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE);
-	stdio_containers[2].data.stream = nullptr;
-	stdio_containers[2].flags = UV_IGNORE;
-
-	char full_exe_path[MAX_PATH];
-	size_t cwd_len = MAX_PATH;
-	uv_cwd(full_exe_path, &cwd_len);
-	full_exe_path[cwd_len] = '\\';
-	strcpy(full_exe_path + cwd_len + 1, command_.c_str());
+	stdio_containers[2].data.stream = stderrStream();
+	stdio_containers[2].flags = uv_stdio_flags(UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE);
+
+	char cwd[1024];
+	size_t cwd_len = sizeof(cwd);
+	uv_cwd(cwd, &cwd_len);
+	string full_exe_path = string(cwd, cwd_len) + char(pathSeparator) + backend_->command_;
 	const char* argv[] = {
-		full_exe_path,
-		params_.c_str(),
+		full_exe_path.c_str(),
+		backend_->params_.c_str(),
 		nullptr
 	};
 	uv_process_options_t options = { 0 };
 	options.exit_cb = [](uv_process_t* process, int64_t exit_status, int term_signal) {
-		reinterpret_cast<BackendServer*>(process->data)->onProcessTerminated(exit_status, term_signal);
+		reinterpret_cast<BackendWorker*>(process->data)->onProcessTerminated(exit_status, term_signal);
 	};
 	options.flags = UV_PROCESS_WINDOWS_HIDE; //  UV_PROCESS_WINDOWS_VERBATIM_ARGUMENTS;
 	options.file = argv[0];
 	options.args = const_cast<char**>(argv);
+	// build our own new environments
+	vector<string> utf8_environ;
+#ifdef _WIN32
 	char full_working_dir[MAX_PATH];
-	::GetFullPathNameA(workingDir_.c_str(), MAX_PATH, full_working_dir, nullptr);
+	::GetFullPathNameA(backend_->workingDir_.c_str(), MAX_PATH, full_working_dir, nullptr);
 	options.cwd = full_working_dir;
-
-	// build our own new environments
 	auto env_strs = GetEnvironmentStringsW();
-	vector<string> utf8_environ;
 	for (auto penv = env_strs; *penv; penv += wcslen(penv) + 1) {
 		utf8_environ.emplace_back(utf8Codec.to_bytes(penv));
 	}
 	FreeEnvironmentStringsW(env_strs);
+#else
+	// relative to the launcher dir, which is the current dir
+	options.cwd = backend_->workingDir_.c_str();
+	for (char** penv = environ; *penv; ++penv) {
+		utf8_environ.emplace_back(*penv);
+	}
+#endif
 	// add our own environment variables
 	// NOTE: Force python to output UTF-8 encoded strings
 	// Reference: https://docs.python.org/3/using/cmdline.html#envvar-PYTHONIOENCODING
 	// By default, python uses ANSI encoding in Windows and this breaks our unicode support.
 	// FIXME: makes this configurable from backend.json.
 	utf8_environ.emplace_back("PYTHONIOENCODING=utf-8:ignore");
+	if (backend_->offerBinaryFraming_) {
+		// the backend replies with backendFramingAck if it supports binary framing.
+		// otherwise, we just keep using the text mode.
+		utf8_environ.emplace_back(backendFramingEnv);
+	}
+	// the backend replies with backendLogAck if it only writes debug output to stderr.
+	utf8_environ.emplace_back(backendLogEnv);
 	vector<const char*> env;
 	for (auto& v : utf8_environ) {
 		env.emplace_back(v.c_str());
@@ -143,7 +904,7 @@ void BackendServer::startProcess() {
 
 	options.stdio_count = 3;
 	options.stdio = stdio_containers;
-	int ret = uv_spawn(uv_default_loop(), process_, &options);
+	int ret = uv_spawn(loop_, process_, &options);
 	if (ret < 0) {
 		delete process_;
 		process_ = nullptr;
@@ -155,18 +916,39 @@ void BackendServer::startProcess() {
 			delete reinterpret_cast<uv_pipe_t*>(handle);
 		});
 		stdoutPipe_ = nullptr;
+		closeStderrPipe(stderrPipe_);
 		return;
 	}
 
+	running_ = true;
+	if (startCount_++ > 0) {
+		++backend_->totalRestarts_;
+	}
+
 	// start receiving data from the backend server
 	uv_read_start(stdoutStream(), allocReadBuf,
 		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-			reinterpret_cast<BackendServer*>(stream->data)->onProcessDataReceived(stream, nread, buf);
+			reinterpret_cast<BackendWorker*>(stream->data)->onProcessDataReceived(stream, nread, buf);
+		}
+	);
+	uv_read_start(stderrStream(), allocReadBuf,
+		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+			reinterpret_cast<BackendWorker*>(stream->data)->onProcessLogReceived(stream, nread, buf);
 		}
 	);
+
+	if (backend_->waitForReady_) {
+		// wait for the ready signal, but not forever in case the backend does not send it
+		uv_timer_start(readyTimer_, [](uv_timer_t* timer) {
+			reinterpret_cast<BackendWorker*>(timer->data)->onReady();
+		}, backendReadyTimeout, 0);
+	}
+	else {
+		onReady();
+	}
 }
 
-void BackendServer::terminateProcess() {
+void BackendWorker::terminateProcess() {
 	if (process_) {
 		closeStdioPipes();
 		uv_process_kill(process_, SIGTERM);
@@ -174,53 +956,188 @@ void BackendServer::terminateProcess() {
 }
 
 // check if the backend server process is running
-bool BackendServer::isProcessRunning() {
-	return process_ != nullptr;
+bool BackendWorker::isProcessRunning() {
+	return running_.load(std::memory_order_relaxed);
 }
 
-void BackendServer::allocReadBuf(uv_handle_t *, size_t suggested_size, uv_buf_t * buf) {
-	buf->base = new char[suggested_size];
-	buf->len = suggested_size;
+void BackendWorker::allocReadBuf(uv_handle_t * handle, size_t suggested_size, uv_buf_t * buf) {
+	auto worker = reinterpret_cast<BackendWorker*>(handle->data);
+	worker->backend_->readBufferPool().alloc(suggested_size, buf);
 }
 
-void BackendServer::onProcessDataReceived(uv_stream_t * stream, ssize_t nread, const uv_buf_t * buf) {
+void BackendWorker::onProcessDataReceived(uv_stream_t * stream, ssize_t nread, const uv_buf_t * buf) {
 	if (nread < 0 || nread == UV_EOF) {
-		if (buf->base) {
-			delete[]buf->base;
-		}
+		backend_->readBufferPool().release(buf);
 		// the backend server is broken, stop it
 		terminateProcess();
 		return;
 	}
 	if (buf->base) {
-		// initial ready message from the backend server
-		if (buf->base[0] == '\0') {
-			ready_ = true;
+		// initial ready message from the backend server. it's only sent in text mode at the
+		// start of a line, since a binary frame or a partial frame might start with '\0'.
+		if (nread > 0 && buf->base[0] == '\0' && stdoutFramer_.mode() == StreamFramer::TEXT_MODE && stdoutFramer_.pendingSize() == 0) {
+			onReady();
 		}
 		else {
-			// pass the reply to the main server for further handling and sending back to the client
-			pipeServer_->handleBackendReply(buf->base, nread);
+			// a reply might be split across several reads, so reassemble the frames first.
+			size_t textLen = stdoutFramer_.feed(buf->base, nread, [this](const FrameHeader* header, const char* data, size_t len) {
+				onFrameReceived(header, data, len);
+			});
+			// in text mode, everything printed by the backend goes to the debug history
+			// unless the backend writes its debug output to stderr instead.
+			if (textLen > 0 && !logOnStderr_) {
+				backend_->deliverOutput(buf->base, textLen);
+			}
+			if (stdoutFramer_.hasError()) {
+				// the binary stream is corrupted and we cannot recover from it
+				backend_->readBufferPool().release(buf);
+				terminateProcess();
+				return;
+			}
+		}
+		backend_->readBufferPool().release(buf);
+	}
+}
+
+void BackendWorker::onProcessLogReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+	if (nread < 0) {
+		backend_->readBufferPool().release(buf);
+		// the process has exited and we got all of its output
+		closeStderrPipe(reinterpret_cast<uv_pipe_t*>(stream));
+		return;
+	}
+	if (nread > 0) {
+		pendingLog_.append(buf->base, nread);
+		if (pendingLog_.length() >= maxPendingLogSize) {
+			flushLog();
+		}
+		else if (!uv_is_active(reinterpret_cast<uv_handle_t*>(logFlushTimer_))) {
+			uv_timer_start(logFlushTimer_, [](uv_timer_t* timer) {
+				reinterpret_cast<BackendWorker*>(timer->data)->flushLog();
+			}, logFlushDelay, 0);
+		}
+	}
+	backend_->readBufferPool().release(buf);
+}
+
+void BackendWorker::flushLog() {
+	if (logFlushTimer_ != nullptr) {
+		uv_timer_stop(logFlushTimer_);
+	}
+	if (!pendingLog_.empty()) {
+		backend_->deliverOutput(pendingLog_.c_str(), pendingLog_.length());
+		pendingLog_.clear();
+	}
+}
+
+void BackendWorker::closeStderrPipe(uv_pipe_t* pipe) {
+	flushLog();
+	if (pipe == stderrPipe_)
+		stderrPipe_ = nullptr;
+	else
+		retiringStderrPipes_.erase(remove(retiringStderrPipes_.begin(), retiringStderrPipes_.end(), pipe), retiringStderrPipes_.end());
+	uv_close(reinterpret_cast<uv_handle_t*>(pipe), [](uv_handle_t* handle) {
+		delete reinterpret_cast<uv_pipe_t*>(handle);
+	});
+}
+
+void BackendWorker::closeStderrPipes() {
+	if (stderrPipe_ != nullptr)
+		closeStderrPipe(stderrPipe_);
+	while (!retiringStderrPipes_.empty())
+		closeStderrPipe(retiringStderrPipes_.back());
+}
+
+void BackendWorker::onFrameReceived(const FrameHeader* header, const char* data, size_t len) {
+	if (header == nullptr) { // a line in text mode
+		if (len == sizeof(backendFramingAck) - 1 && memcmp(data, backendFramingAck, len) == 0) {
+			// the backend accepts binary framing. all of the following data is in binary frames.
+			if (backend_->offerBinaryFraming_) {
+				stdoutFramer_.setMode(StreamFramer::BINARY_MODE);
+			}
+			onReady();
+		}
+		else if (len == sizeof(backendReadyMessage) - 1 && memcmp(data, backendReadyMessage, len) == 0) {
+			onReady();
+		}
+		else if (len == sizeof(backendLogAck) - 1 && memcmp(data, backendLogAck, len) == 0) {
+			// the following lines on stdout are replies only
+			logOnStderr_ = true;
+		}
+		else {
+			// pass each complete reply line to the main server for sending back to the client
+			ClientTable::Handle clientHandle;
+			const char* msg;
+			size_t msgLen;
+			if (parseReplyLine(data, len, clientHandle, msg, msgLen)) {
+				TraceRecorder::record("backend replied", TraceRecorder::INSTANT, clientHandle);
+				backend_->deliverReply(clientHandle, msg, msgLen);
+				decreaseQueueDepth(clientHandle, nullptr);
+			}
+		}
+		return;
+	}
+
+	switch (header->type) {
+	case FRAME_REPLY:
+		TraceRecorder::record("backend replied", TraceRecorder::INSTANT, header->clientHandle);
+		backend_->deliverReply(header->clientHandle, data, len);
+		decreaseQueueDepth(header->clientHandle, header);
+		break;
+	case FRAME_LOG:
+		backend_->deliverOutput(data, len);
+		break;
+	}
+}
+
+bool BackendWorker::parseReplyLine(const char* line, size_t len, ClientTable::Handle& clientHandle, const char*& msg, size_t& msgLen) {
+	// Format of each line (without the trailing '\n'):
+	// PIME_MSG|<client_id>|<json reply>
+	// only handle lines prefixed with "PIME_MSG|" since other lines
+	// might be debug messages printed by the backend.
+	if (len > 9 && strncmp(line, "PIME_MSG|", 9) == 0) {
+		auto line_end = line + len;
+		line += 9; // Skip the prefix
+		auto sep = static_cast<const char*>(memchr(line, '|', line_end - line));
+		// split the client_id from the remaining json reply
+		if (sep != nullptr && ClientTable::parseHandle(line, sep - line, clientHandle)) {
+			msg = sep + 1;
+			msgLen = line_end - msg;
+			// because Windows uses CRLF "\r\n" for new lines, python and node.js
+			// try to convert "\n" to "\r\n" sometimes. Let's remove the additional '\r'
+			if (msgLen > 0 && msg[msgLen - 1] == '\r') {
+				--msgLen;
+			}
+			return true;
 		}
-		delete[]buf->base;
 	}
+	return false;
 }
 
-void BackendServer::onProcessTerminated(int64_t exit_status, int term_signal) {
+void BackendWorker::onProcessTerminated(int64_t exit_status, int term_signal) {
 	delete process_;
 	process_ = nullptr;
+	running_ = false;
 
 	closeStdioPipes();
 
-	pipeServer_->onBackendClosed(this);
+	backend_->deliverWorkerClosed(this);
 
-	if (needRestart_) {
+	// the process might be started again when the sessions of the clients are replayed
+	if (needRestart_ && !isProcessRunning()) {
 		startProcess();
-		needRestart_ = false;
 	}
+	needRestart_ = false;
 }
 
-void BackendServer::closeStdioPipes() {
+void BackendWorker::closeStdioPipes() {
 	ready_ = false;
+	queueDepth_ = 0;
+	inFlightRequests_.clear();
+	clearQueuedMessages();
+	uv_timer_stop(readyTimer_);
+	stdoutFramer_.reset();
+	logOnStderr_ = false;
 	if (stdinPipe_ != nullptr) {
 		uv_close(reinterpret_cast<uv_handle_t*>(stdinPipe_), [](uv_handle_t* handle) {
 			delete reinterpret_cast<uv_pipe_t*>(handle);
@@ -20,29 +20,79 @@
 #ifndef _BACKEND_SERVER_H_
 #define _BACKEND_SERVER_H_
 
+#ifdef _WIN32
 #include <Windows.h>
 #include <ShlObj.h>
 #include <Shellapi.h>
 #include <Lmcons.h> // for UNLEN
+#endif
 #include <cstring>
 #include <string>
 #include <vector>
+#include <deque>
 #include <unordered_map>
+#include <memory>
+#include <atomic>
 
 #include <uv.h>
 #include <json/json.h>
 
+#include "StreamFramer.h"
+#include "ClientTable.h"
+#include "LatencyHistogram.h"
+#include "SpscQueue.h"
+#include "ReadBufferPool.h"
+#include "WriteRequestPool.h"
+
 namespace PIME {
 
 class PipeServer;
+class BackendServer;
 struct ClientInfo;
 
-class BackendServer {
+// Client messages waiting to be sent to a worker process are queued by priority,
+// so typing in one app is not held up by slow requests of other apps.
+enum MessageLane {
+	INTERACTIVE_LANE, // key events, the user is waiting for them
+	BACKGROUND_LANE, // everything else, such as onMenu, onActivate, and close
+	LANE_COUNT
+};
+
+// A message passed between the client loop and the loop of a threaded backend.
+struct BackendLoopMessage {
+	enum Type {
+		// client loop => backend loop
+		CLIENT_REQUEST, // a client message waiting for a reply
+		CLIENT_NOTIFY, // a client message which is not replied, such as {"method":"close"}
+		REQUEST_TIMEOUT,
+		START_PROCESS,
+		RESTART_PROCESS,
+		TERMINATE_PROCESS,
+		STOP_LOOP,
+		// backend loop => client loop
+		REPLY,
+		OUTPUT,
+		WORKER_CLOSED
+	};
+
+	Type type;
+	int worker; // index of the worker, or -1 for all workers
+	ClientTable::Handle clientHandle;
+	MessageLane lane; // for client messages
+	std::string data; // its capacity is reused by the following messages
+};
+
+// A backend server process. Every BackendServer runs one or more of them.
+// All methods must be called in the event loop of the backend, except
+// id(), queueDepth(), queuedMessages(), isReady(), and isProcessRunning() which only read atomic
+// snapshots and can be called from the client loop in threaded mode.
+class BackendWorker {
 public:
+	friend class BackendServer;
 	friend class PipeServer;
 
-	BackendServer(PipeServer* pipeServer, const Json::Value& info);
-	~BackendServer();
+	BackendWorker(BackendServer* backend, int id);
+	~BackendWorker();
 
 	void startProcess();
 	void terminateProcess();
@@ -60,27 +110,323 @@ public:
 		return reinterpret_cast<uv_stream_t*>(stdoutPipe_);
 	}
 
-	void handleClientMessage(ClientInfo* client, const char* readBuf, size_t len);
+	uv_stream_t* stderrStream() {
+		return reinterpret_cast<uv_stream_t*>(stderrPipe_);
+	}
+
+	int id() const {
+		return id_;
+	}
+
+	// number of requests sent to the process which are not yet replied
+	size_t queueDepth() const {
+		return queueDepth_.load(std::memory_order_relaxed);
+	}
+
+	// number of client messages in a lane waiting to be sent to the process
+	size_t queuedMessages(MessageLane lane) const {
+		return queuedMessages_[lane].load(std::memory_order_relaxed);
+	}
+
+	// the process is started and ready to handle client messages
+	bool isReady() const {
+		return ready_.load(std::memory_order_relaxed);
+	}
+
+	void handleClientMessage(ClientTable::Handle clientHandle, const char* readBuf, size_t len, bool expectReply = true, MessageLane lane = BACKGROUND_LANE);
+
+	// terminate the process and close all handles so the event loop of the backend can exit
+	void shutdown();
+
+	// called when a request of the client is not replied in time
+	void onRequestTimeout(ClientTable::Handle clientHandle);
+
+	// split a reply line received in text mode into the client handle and the json reply
+	static bool parseReplyLine(const char* line, size_t len, ClientTable::Handle& clientHandle, const char*& msg, size_t& msgLen);
 
 private:
 	static void allocReadBuf(uv_handle_t*, size_t suggested_size, uv_buf_t* buf);
 	void onProcessDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+	void onProcessLogReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+	void flushLog();
+	// close the stderr of the current process or of a previous one
+	void closeStderrPipe(uv_pipe_t* pipe);
+	void closeStderrPipes();
+	void onFrameReceived(const FrameHeader* header, const char* data, size_t len);
 	void onProcessTerminated(int64_t exit_status, int term_signal);
 	void closeStdioPipes();
+	// returns the seqNum of the binary frame, or 0 in text mode
+	uint32_t writeMessage(ClientTable::Handle clientHandle, const char* data, size_t len);
+	void onReady();
+	void addInFlightRequest(ClientTable::Handle clientHandle, uint32_t seqNum);
+	// header is the binary frame of the reply, or nullptr in text mode
+	void decreaseQueueDepth(ClientTable::Handle clientHandle, const FrameHeader* header);
+	// send queued messages to the process while it has room for more requests
+	void dispatchQueuedMessages();
+	void clearQueuedMessages();
+	// reply {"success":false} to a request which cannot be sent to the process
+	void failRequest(ClientTable::Handle clientHandle, const char* readBuf, size_t len);
 
 private:
-	PipeServer* pipeServer_;
-	std::string name_;
+	// a client message waiting to be sent to the backend process
+	struct QueuedMessage {
+		ClientTable::Handle clientHandle;
+		bool expectReply;
+		uint64_t queueTime; // in ns
+		std::string data;
+	};
+
+	BackendServer* backend_;
+	int id_;
+	uv_loop_t* loop_; // the event loop of the backend
 	uv_process_t* process_;
+	std::atomic<bool> running_; // process_ != nullptr
 	uv_pipe_t* stdinPipe_;
 	uv_pipe_t* stdoutPipe_;
-	bool ready_;
-
+	StreamFramer stdoutFramer_; // splits the stdout of the backend process into lines or binary frames
+	// the log channel of the process. it's kept open after stdout is closed
+	// until we get everything the dying process wrote, such as a traceback.
+	uv_pipe_t* stderrPipe_;
+	// the stderr of the previous processes which are still read until EOF after a restart
+	std::vector<uv_pipe_t*> retiringStderrPipes_;
+	std::string pendingLog_; // log output not yet passed to the pipe server
+	uv_timer_t* logFlushTimer_;
+	bool logOnStderr_; // the process writes debug output to stderr only, so its stdout only has replies
+	std::atomic<bool> ready_;
 	bool needRestart_;
+	uint32_t nextSeqNum_; // sequence number of the next binary frame sent to the backend
+	unsigned int startCount_; // number of times the process is started
+	std::atomic<size_t> queueDepth_; // requests in inFlightRequests_ which are not timed out
+	// requests sent to the process and not replied yet, in the order they're sent
+	struct InFlightRequest {
+		ClientTable::Handle clientHandle;
+		uint32_t seqNum; // of the binary frame
+		bool timedOut; // its slot is released so the following requests are not blocked
+	};
+	std::deque<InFlightRequest> inFlightRequests_;
+	// messages received before the process is ready or while it's busy
+	std::deque<QueuedMessage> lanes_[LANE_COUNT];
+	std::atomic<size_t> queuedMessages_[LANE_COUNT];
+	// number of messages of each client in the background lane. the following
+	// messages of these clients are queued after them to keep them in order.
+	std::unordered_map<ClientTable::Handle, unsigned int> backgroundClients_;
+	unsigned int interactiveBurst_; // interactive messages sent in a row while background ones are waiting
+	uv_timer_t* readyTimer_; // stop waiting for the ready signal of the process after a timeout
+	// requests timed out in a row, without a reply in between
+	unsigned int timeoutCount_;
+};
+
+
+// A backend and its worker processes.
+//
+// By default, the worker processes run in the event loop of the pipe server
+// (the client loop). If "threaded" is set in backends.json, the backend gets
+// its own event loop running in a dedicated thread, so heavy output of the
+// backend does not delay the clients of other backends, and the other way round.
+// In threaded mode:
+//   * ClientInfo objects are owned by the client loop and never touched by
+//     the backend thread. Clients are referred to by their handles.
+//   * BackendWorker objects and their handles (process, pipes, timers) are
+//     owned by the backend loop.
+//   * The BackendServer object is created and destroyed by the client loop.
+//     Its configuration and the hash ring are read-only after construction.
+//     The public methods below are called in the client loop and pass
+//     messages to the backend loop through a bounded lock-free queue, and
+//     the backend loop passes replies back through another one.
+class BackendServer {
+public:
+	friend class BackendWorker;
+	friend class PipeServer;
+
+	BackendServer(PipeServer* pipeServer, const Json::Value& info);
+	~BackendServer();
+
+	// start the thread running the backend loop in threaded mode.
+	// this should be called once the client loop is ready to receive messages from it.
+	void startLoopThread();
+
+	bool isThreaded() const {
+		return loop_ != uv_default_loop();
+	}
+
+	const std::string& name() const {
+		return name_;
+	}
+
+	// the definition of the backend in backends.json
+	const Json::Value& info() const {
+		return info_;
+	}
+
+	// terminate all worker processes
+	void terminateProcess();
+	// check if any of the worker processes is running
+	bool isProcessRunning();
+	// restart all running worker processes
+	void restartProcess();
+	// start all worker processes which are not yet running
+	void startProcess();
+
+	// start the backend when the launcher starts rather than on the first client message
+	bool eagerStart() const {
+		return eagerStart_;
+	}
+
+	// stop the backend after no client uses it for this long (in ms), 0 to keep it running
+	uint64_t idleTimeout() const {
+		return idleTimeout_;
+	}
+
+	// a client is initialized to use the backend, or is disconnected
+	void attachClient() {
+		++clientCount_;
+		lastActiveTime_ = uv_now(uv_default_loop());
+	}
+
+	void detachClient() {
+		--clientCount_;
+		lastActiveTime_ = uv_now(uv_default_loop());
+	}
+
+	size_t clientCount() const {
+		return clientCount_;
+	}
+
+	// the last time a client message is sent to the backend or a client is detached (in ms)
+	uint64_t lastActiveTime() const {
+		return lastActiveTime_;
+	}
+
+	// terminate the worker processes to free their memory.
+	// they're started again by the next client message.
+	void suspend() {
+		suspended_ = true;
+		terminateProcess();
+	}
+
+	bool isSuspended() const {
+		return suspended_;
+	}
+
+	const std::vector<BackendWorker*>& workers() const {
+		return workers_;
+	}
+
+	// max time to wait for the reply of a request of the client (in ms)
+	uint64_t requestTimeout(const std::string& method, ClientInfo* client);
+
+	// latency histogram of the requests of a method, or nullptr if too many methods are tracked
+	LatencyHistogram* methodLatency(const std::string& method);
+
+	// record the latency of a replied request (in us)
+	void recordLatency(LatencyHistogram* methodLatency, uint64_t latency) {
+		latency_.record(latency);
+		if (methodLatency != nullptr) {
+			methodLatency->record(latency);
+		}
+	}
+
+	// pick a worker for a newly initialized client
+	BackendWorker* workerForClient(ClientInfo* client);
+
+	// the lane of a client message, key events take precedence over the others
+	static MessageLane laneForMethod(const std::string& method);
+
+	void handleClientMessage(ClientInfo* client, const char* readBuf, size_t len, MessageLane lane = BACKGROUND_LANE);
+
+	// notify the worker serving the client that the client is disconnected
+	void removeClient(ClientInfo* client);
+
+	// a request sent to the worker is not replied in time
+	void onRequestTimeout(BackendWorker* worker, ClientTable::Handle clientHandle);
+
+	// called in the client loop when the backend loop posts messages to it
+	void dispatchClientLoopMessages();
+
+private:
+	void buildHashRing();
+	// timeout of a method set in backends.json, or the default one (in ms)
+	uint64_t methodTimeout(const std::string& method) const;
+
+	// called in the event loop of the backend
+	void startWorkers();
+	void restartWorkers();
+	void terminateWorkers();
+	void closeLoopHandles();
+
+	// the buffer pools of the event loop of the backend
+	ReadBufferPool& readBufferPool();
+	WriteRequestPool& writeRequestPool();
+
+	// called in the backend loop to pass the output of a worker to the client loop
+	void deliverReply(ClientTable::Handle clientHandle, const char* msg, size_t len);
+	void deliverOutput(const char* data, size_t len);
+	void deliverWorkerClosed(BackendWorker* worker);
+
+	// threaded mode
+	// client requests are dropped if the queue is full, and the other messages are kept until there's room
+	bool postToBackendLoop(BackendLoopMessage::Type type, int worker, ClientTable::Handle clientHandle = ClientTable::invalidHandle, const char* data = nullptr, size_t len = 0, MessageLane lane = BACKGROUND_LANE);
+	void postToClientLoop(BackendLoopMessage::Type type, int worker, ClientTable::Handle clientHandle, const char* data, size_t len);
+	void dispatchBackendLoopMessages();
+	// called in the client loop to move the kept control messages to the queue. returns false if it's still full.
+	bool flushControlMessages();
+	bool flushPendingClientLoopMessages();
+
+private:
+	PipeServer* pipeServer_;
+	Json::Value info_;
+	std::string name_;
+	std::vector<BackendWorker*> workers_;
+	// consistent hash ring of the workers: sorted (hash of a virtual node, worker index) pairs
+	std::vector<std::pair<uint32_t, size_t>> hashRing_;
+
 	// command to launch the server process
 	std::string command_;
 	std::string params_;
 	std::string workingDir_;
+	bool offerBinaryFraming_; // offer binary framing to the backend process when starting it
+	bool waitForReady_; // the backend process tells us when it's ready to handle client messages
+	// max number of unreplied requests sent to a worker process, 0 for no limit.
+	// the others wait in the lanes of the worker so key events can overtake them.
+	size_t maxInFlight_;
+	bool eagerStart_;
+	uint64_t idleTimeout_;
+
+	// usage of the backend, only accessed in the client loop
+	size_t clientCount_;
+	uint64_t lastActiveTime_;
+	bool suspended_; // the processes are stopped on purpose rather than crashed
+
+	// max time to wait for the reply of a request of each method (in ms)
+	std::unordered_map<std::string, uint64_t> requestTimeouts_;
+	uint64_t defaultRequestTimeout_;
+	// restart a worker if this many requests time out in a row, 0 to never restart it
+	unsigned int maxRequestTimeouts_;
+
+	// statistics, the histograms are only updated by the client loop unless noted
+	LatencyHistogram latency_; // latency of all requests (in us)
+	std::unordered_map<std::string, std::unique_ptr<LatencyHistogram>> methodLatency_;
+	LatencyHistogram laneWaitTime_[LANE_COUNT]; // time messages spent in the lanes (in us), updated by the backend loop
+	std::atomic<uint64_t> totalTimeouts_; // number of timed out requests
+	std::atomic<uint64_t> totalRestarts_; // number of times a worker process is started again
+
+	// event loop of the worker processes, uv_default_loop() if not in threaded mode
+	uv_loop_t* loop_;
+	// threaded mode only
+	uv_thread_t thread_;
+	bool threadStarted_;
+	uv_async_t* wakeUpBackendLoop_; // notify the backend loop of new messages
+	std::unique_ptr<SpscQueue<BackendLoopMessage>> toBackendLoop_;
+	std::unique_ptr<SpscQueue<BackendLoopMessage>> toClientLoop_;
+	// messages other than client requests which do not fit in toBackendLoop_, only accessed in the client loop
+	std::deque<BackendLoopMessage> controlMessages_;
+	std::atomic<bool> hasControlMessages_; // read by the backend loop to ask for them
+	// messages for the client loop which do not fit in toClientLoop_, only accessed in the backend loop
+	std::deque<BackendLoopMessage> pendingClientLoopMessages_;
+	std::atomic<bool> hasPendingClientLoopMessages_; // read by the client loop to ask for them
+	std::atomic<bool> stopping_;
+	std::unique_ptr<ReadBufferPool> readBufferPool_;
+	std::unique_ptr<WriteRequestPool> writeRequestPool_;
 };
 
 } // namespace PIME
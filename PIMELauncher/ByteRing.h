@@ -0,0 +1,83 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_BYTE_RING_H_
+#define _PIME_BYTE_RING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+
+namespace PIME {
+
+// A preallocated ring buffer keeping the most recent bytes written to it.
+// Writing never allocates. When the ring is full, the oldest bytes are overwritten.
+// Positions are absolute offsets in the stream of all bytes ever written, so a
+// reader can keep a cursor and tell how much it has missed.
+class ByteRing {
+public:
+	explicit ByteRing(size_t capacity) :
+		buf_{ new char[capacity] },
+		capacity_{ capacity },
+		head_{ 0 } {
+	}
+
+	void write(const char* data, size_t len) {
+		if (len > capacity_) {  // only the last part fits
+			data += len - capacity_;
+			head_ += len - capacity_;
+			len = capacity_;
+		}
+		size_t offset = size_t(head_ % capacity_);
+		size_t n = (std::min)(len, capacity_ - offset);
+		memcpy(buf_.get() + offset, data, n);
+		memcpy(buf_.get(), data + n, len - n); // wrap around
+		head_ += len;
+	}
+
+	// position after the last byte written
+	uint64_t head() const {
+		return head_;
+	}
+
+	// position of the oldest byte still in the ring
+	uint64_t tail() const {
+		return head_ > capacity_ ? head_ - capacity_ : 0;
+	}
+
+	// get the contiguous data starting at pos, which stops at the end of the
+	// ring storage even if more data is wrapped around. returns its length.
+	// pos should be between tail() and head().
+	size_t readSlice(uint64_t pos, const char** data) const {
+		size_t offset = size_t(pos % capacity_);
+		*data = buf_.get() + offset;
+		return size_t((std::min)(head_ - pos, uint64_t(capacity_ - offset)));
+	}
+
+private:
+	std::unique_ptr<char[]> buf_;
+	size_t capacity_;
+	uint64_t head_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_BYTE_RING_H_
@@ -0,0 +1,157 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_CLIENT_TABLE_H_
+#define _PIME_CLIENT_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace PIME {
+
+struct ClientInfo;
+
+// Routing table mapping compact integer client handles to ClientInfo objects.
+// A handle packs the slot index in its low 16 bits and the generation of the
+// slot in its high 16 bits. The generation is bumped whenever a slot is freed,
+// so a late reply carrying the handle of a closed client can never be routed
+// to another client which happens to reuse the same slot.
+class ClientTable {
+public:
+	typedef uint32_t Handle;
+	static const Handle invalidHandle = 0;
+	// max length of a handle formatted as a decimal string, excluding '\0'
+	static const size_t maxHandleStrLen = 10;
+
+	ClientTable() : size_{ 0 } {
+	}
+
+	// returns invalidHandle if the table is full
+	Handle add(ClientInfo* client) {
+		uint32_t index;
+		if (!freeSlots_.empty()) {
+			index = freeSlots_.back();
+			freeSlots_.pop_back();
+		}
+		else {
+			if (slots_.size() > 0xffff)
+				return invalidHandle;
+			index = uint32_t(slots_.size());
+			slots_.push_back(Slot{ nullptr, 1 });
+		}
+		Slot& slot = slots_[index];
+		slot.client = client;
+		++size_;
+		return (uint32_t(slot.generation) << 16) | index;
+	}
+
+	bool remove(Handle handle) {
+		Slot* slot = slotFromHandle(handle);
+		if (slot == nullptr)
+			return false;
+		slot->client = nullptr;
+		// generation 0 is never used so a valid handle is never 0
+		if (++slot->generation == 0)
+			slot->generation = 1;
+		freeSlots_.push_back(handle & 0xffff);
+		--size_;
+		return true;
+	}
+
+	ClientInfo* find(Handle handle) const {
+		uint32_t index = handle & 0xffff;
+		if (index < slots_.size()) {
+			const Slot& slot = slots_[index];
+			if (slot.generation == (handle >> 16))
+				return slot.client;
+		}
+		return nullptr;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	// call func(ClientInfo*) for every client in the table.
+	// it's safe to remove the current client inside func.
+	template <typename Func>
+	void forEach(Func func) const {
+		for (size_t i = 0; i < slots_.size(); ++i) {
+			if (slots_[i].client != nullptr)
+				func(slots_[i].client);
+		}
+	}
+
+	// format the handle as a decimal string. returns the length of the string.
+	// buf should have room for at least maxHandleStrLen + 1 chars.
+	static size_t formatHandle(Handle handle, char* buf) {
+		char digits[maxHandleStrLen];
+		size_t n = 0;
+		do {
+			digits[n++] = char('0' + handle % 10);
+			handle /= 10;
+		} while (handle != 0);
+		for (size_t i = 0; i < n; ++i)
+			buf[i] = digits[n - i - 1];
+		buf[n] = '\0';
+		return n;
+	}
+
+	// parse a decimal handle string which is not necessarily null-terminated.
+	static bool parseHandle(const char* str, size_t len, Handle& handle) {
+		if (len == 0 || len > maxHandleStrLen)
+			return false;
+		uint64_t value = 0;
+		for (size_t i = 0; i < len; ++i) {
+			if (str[i] < '0' || str[i] > '9')
+				return false;
+			value = value * 10 + (str[i] - '0');
+		}
+		if (value > 0xffffffff)
+			return false;
+		handle = Handle(value);
+		return true;
+	}
+
+private:
+	struct Slot {
+		ClientInfo* client;
+		uint16_t generation;
+	};
+
+	Slot* slotFromHandle(Handle handle) {
+		uint32_t index = handle & 0xffff;
+		if (index < slots_.size()) {
+			Slot& slot = slots_[index];
+			if (slot.client != nullptr && slot.generation == (handle >> 16))
+				return &slot;
+		}
+		return nullptr;
+	}
+
+private:
+	std::vector<Slot> slots_;
+	std::vector<uint32_t> freeSlots_;
+	size_t size_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_CLIENT_TABLE_H_
@@ -0,0 +1,363 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cstdio>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include <cstring>
+#include <algorithm>
+#include <codecvt>  // for utf8 conversion
+#include <locale>  // for wstring_convert
+
+#include <json/json.h>
+
+#include "InputMethodIndex.h"
+#include "Utils.h"
+
+using namespace std;
+
+static wstring_convert<codecvt_utf8<wchar_t>> utf8Codec;
+
+namespace PIME {
+
+// File format (all integers are little-endian, strings are UTF-8 prefixed by a uint16 length):
+//   char[4] magic, uint32 version, uint32 dirCount
+//   for each dir: string path, uint64 dirModifiedTime, uint32 inputMethodCount
+//     for each input method: string dirName, uint64 modifiedTime, uint64 fileSize, uint8 valid, string guid
+static const char indexMagic[4] = { 'P', 'I', 'M', 'X' };
+static const uint32_t indexVersion = 2;
+static const int64_t maxIndexFileSize = 16 * 1024 * 1024;
+
+#ifdef _WIN32
+
+static uint64_t fileTimeToUint64(const FILETIME& time) {
+	return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+}
+
+// get the last modified time and the size of a file or dir. returns false if it does not exist.
+static bool getFileInfo(const wstring& path, uint64_t& modifiedTime, uint64_t& fileSize) {
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data))
+		return false;
+	modifiedTime = fileTimeToUint64(data.ftLastWriteTime);
+	fileSize = (uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+	return true;
+}
+
+// read the whole file at once
+static bool readFile(const wstring& filename, string& data) {
+	HANDLE file = ::CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	DWORD readSize = 0;
+	if (::GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= maxIndexFileSize) {
+		data.resize(size_t(fileSize.QuadPart));
+		if (!::ReadFile(file, &data[0], DWORD(data.length()), &readSize, nullptr))
+			readSize = 0;
+	}
+	::CloseHandle(file);
+	return readSize == data.length();
+}
+
+// write to a temp file first so another launcher never reads a partially written file
+static bool replaceFile(const wstring& filename, const string& data) {
+	wstring tempFilename = filename + L".tmp";
+	HANDLE file = ::CreateFileW(tempFilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD written = 0;
+	bool success = ::WriteFile(file, data.data(), DWORD(data.length()), &written, nullptr) && written == data.length();
+	::CloseHandle(file);
+	if (success)
+		success = ::MoveFileExW(tempFilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+	if (!success)
+		::DeleteFileW(tempFilename.c_str());
+	return success;
+}
+
+// names of the subdirs, except the hidden ones
+static void listSubdirs(const wstring& dirPath, vector<string>& subdirs) {
+	WIN32_FIND_DATAW findData = { 0 };
+	HANDLE hFind = ::FindFirstFileW((dirPath + L"\\*").c_str(), &findData);
+	if (hFind != INVALID_HANDLE_VALUE) {
+		do {
+			if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && findData.cFileName[0] != '.') { // this is a subdir
+				subdirs.push_back(utf8Codec.to_bytes(findData.cFileName));
+			}
+		} while (::FindNextFileW(hFind, &findData));
+		::FindClose(hFind);
+	}
+}
+
+#else // file names are UTF-8 encoded on other platforms
+
+static bool getFileInfo(const wstring& path, uint64_t& modifiedTime, uint64_t& fileSize) {
+	struct stat st;
+	if (stat(utf8Codec.to_bytes(path).c_str(), &st) != 0)
+		return false;
+	modifiedTime = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	fileSize = uint64_t(st.st_size);
+	return true;
+}
+
+static bool readFile(const wstring& filename, string& data) {
+	FILE* file = fopen(utf8Codec.to_bytes(filename).c_str(), "rb");
+	if (file == nullptr)
+		return false;
+	size_t readSize = 0;
+	struct stat st;
+	if (fstat(fileno(file), &st) == 0 && st.st_size > 0 && st.st_size <= maxIndexFileSize) {
+		data.resize(size_t(st.st_size));
+		readSize = fread(&data[0], 1, data.length(), file);
+	}
+	fclose(file);
+	return readSize == data.length();
+}
+
+static bool replaceFile(const wstring& filename, const string& data) {
+	string path = utf8Codec.to_bytes(filename);
+	string tempPath = path + ".tmp";
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	bool success = fwrite(data.data(), 1, data.length(), file) == data.length();
+	success = (fclose(file) == 0) && success;
+	if (success)
+		success = rename(tempPath.c_str(), path.c_str()) == 0;
+	if (!success)
+		remove(tempPath.c_str());
+	return success;
+}
+
+static void listSubdirs(const wstring& dirPath, vector<string>& subdirs) {
+	string path = utf8Codec.to_bytes(dirPath);
+	if (DIR* dir = opendir(path.c_str())) {
+		while (struct dirent* entry = readdir(dir)) {
+			struct stat st;
+			if (entry->d_name[0] != '.' && stat((path + "/" + entry->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+				subdirs.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+}
+
+#endif // _WIN32
+
+static void putUint(string& buf, uint64_t value, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		buf += char((value >> (i * 8)) & 0xff);
+	}
+}
+
+static void putString(string& buf, const string& str) {
+	size_t len = (std::min)(str.length(), size_t(0xffff));
+	putUint(buf, len, 2);
+	buf.append(str, 0, len);
+}
+
+// bounds-checked reader of the index file
+struct IndexReader {
+	const unsigned char* p;
+	const unsigned char* end;
+	bool ok;
+
+	uint64_t getUint(size_t size) {
+		uint64_t value = 0;
+		if (size_t(end - p) < size) {
+			ok = false;
+			return 0;
+		}
+		for (size_t i = 0; i < size; ++i) {
+			value |= uint64_t(p[i]) << (i * 8);
+		}
+		p += size;
+		return value;
+	}
+
+	string getString() {
+		size_t len = size_t(getUint(2));
+		if (size_t(end - p) < len) {
+			ok = false;
+			return string();
+		}
+		string str(reinterpret_cast<const char*>(p), len);
+		p += len;
+		return str;
+	}
+};
+
+InputMethodIndex::InputMethodIndex() :
+	dirty_{false},
+	parsedCount_{0},
+	cachedCount_{0} {
+}
+
+bool InputMethodIndex::load(const wstring& filename) {
+	dirs_.clear();
+	string data;
+	if (!readFile(filename, data) || data.length() < sizeof(indexMagic) || memcmp(data.data(), indexMagic, sizeof(indexMagic)) != 0)
+		return false;
+
+	auto begin = reinterpret_cast<const unsigned char*>(data.data());
+	IndexReader reader{ begin + sizeof(indexMagic), begin + data.length(), true };
+	if (reader.getUint(4) != indexVersion)
+		return false;
+	uint32_t dirCount = uint32_t(reader.getUint(4));
+	for (uint32_t i = 0; i < dirCount && reader.ok; ++i) {
+		string path = reader.getString();
+		DirEntry& dir = dirs_[path];
+		dir.dirModifiedTime = reader.getUint(8);
+		dir.scanned = false;
+		uint32_t inputMethodCount = uint32_t(reader.getUint(4));
+		for (uint32_t j = 0; j < inputMethodCount && reader.ok; ++j) {
+			InputMethod inputMethod;
+			inputMethod.dirName = reader.getString();
+			inputMethod.modifiedTime = reader.getUint(8);
+			inputMethod.fileSize = reader.getUint(8);
+			inputMethod.valid = reader.getUint(1) != 0;
+			inputMethod.guid = reader.getString();
+			dir.inputMethods.push_back(std::move(inputMethod));
+		}
+	}
+	if (!reader.ok) {  // the file is corrupted, parse everything again
+		dirs_.clear();
+		return false;
+	}
+	return true;
+}
+
+bool InputMethodIndex::save(const wstring& filename) {
+	// only keep the dirs scanned in this run
+	for (auto it = dirs_.begin(); it != dirs_.end();) {
+		if (!it->second.scanned) {
+			it = dirs_.erase(it);
+			dirty_ = true;
+		}
+		else {
+			++it;
+		}
+	}
+	if (!dirty_)
+		return true;
+
+	string data(indexMagic, sizeof(indexMagic));
+	putUint(data, indexVersion, 4);
+	putUint(data, dirs_.size(), 4);
+	for (auto& item : dirs_) {
+		putString(data, item.first);
+		putUint(data, item.second.dirModifiedTime, 8);
+		putUint(data, item.second.inputMethods.size(), 4);
+		for (auto& inputMethod : item.second.inputMethods) {
+			putString(data, inputMethod.dirName);
+			putUint(data, inputMethod.modifiedTime, 8);
+			putUint(data, inputMethod.fileSize, 8);
+			putUint(data, inputMethod.valid ? 1 : 0, 1);
+			putString(data, inputMethod.guid);
+		}
+	}
+
+	if (!replaceFile(filename, data))
+		return false;
+	dirty_ = false;
+	return true;
+}
+
+bool InputMethodIndex::loadInputMethod(const wstring& inputMethodsDir, const string& dirName, const InputMethod* cached, InputMethod& result) {
+	wstring imejson = joinPath(joinPath(inputMethodsDir, utf8Codec.from_bytes(dirName)), L"ime.json");
+	result.dirName = dirName;
+	result.valid = false;
+	result.guid.clear();
+	// Make sure the file exists
+	if (!getFileInfo(imejson, result.modifiedTime, result.fileSize)) {
+		result.modifiedTime = result.fileSize = 0;
+		if (cached == nullptr || cached->modifiedTime != 0)
+			dirty_ = true;
+		return false;
+	}
+	if (cached != nullptr && cached->modifiedTime == result.modifiedTime && cached->fileSize == result.fileSize) {
+		// not changed since the index was saved
+		result.valid = cached->valid;
+		result.guid = cached->guid;
+		if (result.valid)
+			++cachedCount_;
+		return result.valid;
+	}
+	// load the json file to get the info of input method
+	dirty_ = true;
+	Json::Value json;
+	if (!loadJsonFile(imejson, json))
+		return false;
+	++parsedCount_;
+	result.valid = true;
+	result.guid = json["guid"].asString();
+	transform(result.guid.begin(), result.guid.end(), result.guid.begin(), ::tolower);  // convert GUID to lower case
+	return true;
+}
+
+const vector<string>& InputMethodIndex::scanDir(const wstring& inputMethodsDir) {
+	DirEntry& dir = dirs_[utf8Codec.to_bytes(inputMethodsDir)];
+	if (dir.scanned)
+		return dir.guids;
+
+	uint64_t dirModifiedTime = 0, dirSize;
+	getFileInfo(inputMethodsDir, dirModifiedTime, dirSize);
+	vector<InputMethod> inputMethods;
+	if (dirModifiedTime != 0 && dirModifiedTime == dir.dirModifiedTime) {
+		// no input method is added or removed, so we don't need to list the dir.
+		// only check if any of the ime.json files is changed, added, or removed.
+		for (auto& cached : dir.inputMethods) {
+			InputMethod inputMethod;
+			loadInputMethod(inputMethodsDir, cached.dirName, &cached, inputMethod);
+			inputMethods.push_back(std::move(inputMethod));
+		}
+	}
+	else {
+		// scan the dir for lang profile definition files (ime.json)
+		unordered_map<string, const InputMethod*> cachedInputMethods;
+		for (auto& cached : dir.inputMethods) {
+			cachedInputMethods[cached.dirName] = &cached;
+		}
+		vector<string> subdirs;
+		listSubdirs(inputMethodsDir, subdirs);
+		for (auto& dirName : subdirs) {
+			auto it = cachedInputMethods.find(dirName);
+			InputMethod inputMethod;
+			loadInputMethod(inputMethodsDir, dirName, it != cachedInputMethods.end() ? it->second : nullptr, inputMethod);
+			inputMethods.push_back(std::move(inputMethod));
+		}
+		dir.dirModifiedTime = dirModifiedTime;
+		dirty_ = true;
+	}
+
+	dir.inputMethods.swap(inputMethods);
+	dir.guids.clear();
+	for (auto& inputMethod : dir.inputMethods) {
+		if (inputMethod.valid)
+			dir.guids.push_back(inputMethod.guid);
+	}
+	dir.scanned = true;
+	return dir.guids;
+}
+
+} // namespace PIME
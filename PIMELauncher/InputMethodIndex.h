@@ -0,0 +1,88 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_INPUT_METHOD_INDEX_H_
+#define _PIME_INPUT_METHOD_INDEX_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace PIME {
+
+// Cache of the GUIDs of the input methods of every backend, so the launcher
+// does not need to parse every ime.json file at startup.
+// Every ime.json is keyed by its last modified time and size, and the input
+// methods dir of a backend by its last modified time, which changes when an
+// input method is added or removed. Only the changed files are parsed again.
+// Subdirs without a valid ime.json are kept too, since writing the file later
+// does not change the time of the input methods dir. They're checked on every scan.
+// The index is saved in a compact binary file which is loaded with a single read.
+class InputMethodIndex {
+public:
+	InputMethodIndex();
+
+	// load the index saved by a previous run. returns false if it's missing or invalid.
+	bool load(const std::wstring& filename);
+
+	// save the entries of the dirs scanned since load(), if anything is changed.
+	bool save(const std::wstring& filename);
+
+	// get the lower case GUIDs of the input methods in the input methods dir of a backend
+	const std::vector<std::string>& scanDir(const std::wstring& inputMethodsDir);
+
+	// statistics of the last scan
+	size_t parsedCount() const { // number of ime.json files parsed
+		return parsedCount_;
+	}
+
+	size_t cachedCount() const { // number of ime.json files found in the index
+		return cachedCount_;
+	}
+
+private:
+	struct InputMethod {
+		std::string dirName; // in UTF-8
+		uint64_t modifiedTime; // 0 if there's no ime.json
+		uint64_t fileSize;
+		bool valid; // false if ime.json is missing or cannot be parsed
+		std::string guid;
+	};
+
+	struct DirEntry {
+		uint64_t dirModifiedTime;
+		std::vector<InputMethod> inputMethods;
+		std::vector<std::string> guids;
+		bool scanned;
+	};
+
+	// result is always filled, even if the input method is invalid. returns result.valid.
+	bool loadInputMethod(const std::wstring& inputMethodsDir, const std::string& dirName, const InputMethod* cached, InputMethod& result);
+
+private:
+	std::unordered_map<std::string, DirEntry> dirs_; // the keys are the full paths of the dirs in UTF-8
+	bool dirty_;
+	size_t parsedCount_;
+	size_t cachedCount_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_INPUT_METHOD_INDEX_H_
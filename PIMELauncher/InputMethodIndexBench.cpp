@@ -0,0 +1,240 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+// Builds an input methods dir with many input methods in /tmp, and measures how
+// long the launcher takes to find them without the index (cold start) and with
+// it (warm start). Also checks that changes to the dir are picked up by the index.
+//
+// Usage: PIMEInputMethodIndexBench [--imes <n>] [--bench <iterations>]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <chrono>
+#include <codecvt>
+#include <locale>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "InputMethodIndex.h"
+
+using namespace std;
+using namespace PIME;
+
+static wstring_convert<codecvt_utf8<wchar_t>> utf8Codec;
+
+static string imeGuid(int i) {
+	char guid[64];
+	snprintf(guid, sizeof(guid), "{c5f37da0-274e-4837-9b7c-%012x}", unsigned(i));
+	return guid;
+}
+
+// an ime.json like the ones of the python backend, with a config the size of a real one
+static string imeJson(const string& guid, int i) {
+	string json = "{\n    \"name\": \"input method " + to_string(i) + "\",\n";
+	json += "    \"version\": \"0.1\",\n    \"guid\": \"" + guid + "\",\n";
+	json += "    \"locale\": \"zh_TW\",\n    \"fallbackLocale\": \"zh_TW\",\n";
+	json += "    \"icon\": \"icon.ico\",\n    \"win8_icon\": \"\",\n";
+	json += "    \"moduleName\": \"ime" + to_string(i) + "\",\n    \"serviceName\": \"IME" + to_string(i) + "TextService\",\n";
+	json += "    \"configTool\": \"config/config.py\",\n    \"keywords\": [";
+	for (int j = 0; j < 64; ++j) {
+		json += (j > 0 ? ", \"" : "\"") + string("\xe4\xb8\xad\xe6\x96\x87 keyword ") + to_string(j) + "\"";
+	}
+	json += "]\n}\n";
+	return json;
+}
+
+static bool writeFile(const string& path, const string& data) {
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	bool ok = fwrite(data.data(), 1, data.length(), file) == data.length();
+	return (fclose(file) == 0) && ok;
+}
+
+static void removeDir(const string& path) {
+	nftw(path.c_str(), [](const char* path, const struct stat* st, int type, struct FTW* ftw) {
+		return remove(path);
+	}, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// file times might only be updated every few ms, so wait before changing the
+// dir again, or the change might not be seen like with a real installation.
+static void waitForNextFileTime() {
+	usleep(20000);
+}
+
+template <typename Func>
+static double measure(unsigned int iterations, Func func) {
+	auto start = chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i) {
+		func();
+	}
+	auto elapsed = chrono::steady_clock::now() - start;
+	return chrono::duration<double, milli>(elapsed).count() / iterations;
+}
+
+class IndexBench {
+public:
+	IndexBench() :
+		failures_{ 0 } {
+	}
+
+	bool init(int imeCount) {
+		char dirTemplate[] = "/tmp/PIMEInputMethodIndexBench-XXXXXX";
+		if (mkdtemp(dirTemplate) == nullptr)
+			return false;
+		topDir_ = dirTemplate;
+		imesDir_ = topDir_ + "/input_methods";
+		indexFile_ = utf8Codec.from_bytes(topDir_ + "/index.bin");
+		if (mkdir(imesDir_.c_str(), 0700) != 0)
+			return false;
+		for (int i = 0; i < imeCount; ++i) {
+			string dir = imesDir_ + "/ime" + to_string(i);
+			if (mkdir(dir.c_str(), 0700) != 0 || !writeFile(dir + "/ime.json", imeJson(imeGuid(i), i)))
+				return false;
+			expected_.insert(imeGuid(i));
+		}
+		// a subdir which is not an input method
+		return mkdir((imesDir_ + "/__pycache__").c_str(), 0700) == 0;
+	}
+
+	~IndexBench() {
+		if (!topDir_.empty())
+			removeDir(topDir_);
+	}
+
+	// what the launcher does at startup
+	const vector<string>& scan(InputMethodIndex& index) {
+		index.load(indexFile_);
+		const vector<string>& guids = index.scanDir(utf8Codec.from_bytes(imesDir_));
+		index.save(indexFile_);
+		return guids;
+	}
+
+	void check(const char* step, size_t expectedParsed) {
+		InputMethodIndex index;
+		const vector<string>& guids = scan(index);
+		set<string> found(guids.begin(), guids.end());
+		if (found != expected_ || guids.size() != expected_.size()) {
+			fprintf(stderr, "%s: found %u input methods, expected %u\n", step, unsigned(guids.size()), unsigned(expected_.size()));
+			++failures_;
+		}
+		else if (index.parsedCount() != expectedParsed) {
+			fprintf(stderr, "%s: parsed %u ime.json files, expected %u\n", step, unsigned(index.parsedCount()), unsigned(expectedParsed));
+			++failures_;
+		}
+	}
+
+	bool checkChanges() {
+		remove(utf8Codec.to_bytes(indexFile_).c_str());
+		check("cold scan", expected_.size());
+		check("warm scan", 0);
+
+		// an input method installed in two steps: the dir is created first, and
+		// ime.json is written later, which does not change the time of imesDir_.
+		string dir = imesDir_ + "/late";
+		waitForNextFileTime();
+		mkdir(dir.c_str(), 0700);
+		check("dir without ime.json", 0);
+		waitForNextFileTime();
+		writeFile(dir + "/ime.json", imeJson(imeGuid(100000), 100000));
+		expected_.insert(imeGuid(100000));
+		check("ime.json written later", 1);
+
+		// change the guid of an input method
+		waitForNextFileTime();
+		writeFile(dir + "/ime.json", imeJson(imeGuid(100001), 1000001));
+		expected_.erase(imeGuid(100000));
+		expected_.insert(imeGuid(100001));
+		check("ime.json changed", 1);
+
+		// a broken ime.json is not an input method, and is not parsed again until it's changed
+		waitForNextFileTime();
+		writeFile(dir + "/ime.json", "{");
+		expected_.erase(imeGuid(100001));
+		check("ime.json broken", 0);
+		check("ime.json still broken", 0);
+
+		// the input method is uninstalled, but the dir is left behind
+		waitForNextFileTime();
+		remove((dir + "/ime.json").c_str());
+		check("ime.json removed", 0);
+		waitForNextFileTime();
+		removeDir(dir);
+		check("dir removed", 0);
+		printf("checks: %u failures\n", failures_);
+		return failures_ == 0;
+	}
+
+	void bench(unsigned int iterations) {
+		string indexPath = utf8Codec.to_bytes(indexFile_);
+		volatile size_t sink = 0;
+		double coldTime = measure(iterations, [&]() {
+			remove(indexPath.c_str());
+			InputMethodIndex index;
+			sink = sink + scan(index).size();
+		});
+		double warmTime = measure(iterations, [&]() {
+			InputMethodIndex index;
+			sink = sink + scan(index).size();
+		});
+		printf("input methods: %u\n", unsigned(expected_.size()));
+		printf("cold start (parse every ime.json): %.3f ms\n", coldTime);
+		printf("warm start (load the index): %.3f ms\n", warmTime);
+	}
+
+private:
+	string topDir_;
+	string imesDir_;
+	wstring indexFile_;
+	set<string> expected_;
+	unsigned int failures_;
+};
+
+int main(int argc, char** argv) {
+	int imeCount = 60;
+	unsigned int benchIterations = 200;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--imes" && i + 1 < argc)
+			imeCount = atoi(argv[++i]);
+		else if (arg == "--bench" && i + 1 < argc)
+			benchIterations = unsigned(atoi(argv[++i]));
+		else {
+			fprintf(stderr, "Usage: %s [--imes n] [--bench iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	IndexBench bench;
+	if (!bench.init(imeCount)) {
+		fprintf(stderr, "Fail to create the input methods in /tmp\n");
+		return 1;
+	}
+	bool ok = bench.checkChanges();
+	if (benchIterations > 0) {
+		bench.bench(benchIterations);
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,428 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_JSON_FIELD_SCANNER_H_
+#define _PIME_JSON_FIELD_SCANNER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <string>
+
+namespace PIME {
+
+// A top-level field of a json object found by scanJsonFields().
+// The value points into the scanned data, so it's only valid as long as the data is.
+struct JsonField {
+	enum Type {
+		MISSING,
+		STRING,
+		NUMBER,
+		OTHER  // true, false, null, an object, or an array
+	};
+
+	explicit JsonField(const char* name) :
+		name{ name },
+		nameLen{ strlen(name) },
+		type{ MISSING },
+		value{ nullptr },
+		len{ 0 },
+		escaped{ false } {
+	}
+
+	const char* name;
+	size_t nameLen;
+	Type type;
+	const char* value; // the raw value, without the quotes for strings
+	size_t len;
+	bool escaped; // the string contains escape sequences
+
+	bool isString() const {
+		return type == STRING;
+	}
+
+	// the value is a string equal to str
+	bool equals(const char* str) const {
+		if (type != STRING)
+			return false;
+		if (escaped)
+			return asString() == str;
+		return strlen(str) == len && memcmp(value, str, len) == 0;
+	}
+
+	bool isTrue() const {
+		return type == OTHER && len == 4 && memcmp(value, "true", 4) == 0;
+	}
+
+	// the value is a non-negative integer which fits in 32 bits
+	bool asUInt(uint32_t& result) const {
+		if (type != NUMBER || len == 0 || len > 10)
+			return false;
+		uint64_t v = 0;
+		for (size_t i = 0; i < len; ++i) {
+			if (value[i] < '0' || value[i] > '9')
+				return false;
+			v = v * 10 + (value[i] - '0');
+		}
+		if (v > 0xffffffffu)
+			return false;
+		result = uint32_t(v);
+		return true;
+	}
+
+	// the decoded string, or an empty string if the value is not a string
+	std::string asString() const {
+		std::string result;
+		if (type != STRING)
+			return result;
+		if (!escaped)
+			return std::string(value, len);
+		decodeString(value, value + len, result);
+		return result;
+	}
+
+	// decode the escape sequences of a json string. the string must be scanned by scanJsonFields().
+	template <typename Output>
+	static void decodeString(const char* p, const char* end, Output& out) {
+		while (p < end) {
+			if (*p != '\\') {
+				out.push_back(*p++);
+				continue;
+			}
+			++p;
+			switch (*p++) {
+			case 'b': out.push_back('\b'); break;
+			case 'f': out.push_back('\f'); break;
+			case 'n': out.push_back('\n'); break;
+			case 'r': out.push_back('\r'); break;
+			case 't': out.push_back('\t'); break;
+			case 'u': {
+				uint32_t cp = hex4(p);
+				p += 4;
+				if (cp >= 0xd800 && cp <= 0xdbff && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+					// a surrogate pair
+					uint32_t low = hex4(p + 2);
+					if (low >= 0xdc00 && low <= 0xdfff) {
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+						p += 6;
+					}
+				}
+				appendUtf8(cp, out);
+				break;
+			}
+			default: out.push_back(p[-1]); break;  // '"', '\\', and '/'
+			}
+		}
+	}
+
+private:
+	static uint32_t hex4(const char* p) {
+		uint32_t v = 0;
+		for (int i = 0; i < 4; ++i) {
+			char c = p[i];
+			v = (v << 4) | uint32_t(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+		}
+		return v;
+	}
+
+	template <typename Output>
+	static void appendUtf8(uint32_t cp, Output& out) {
+		if (cp < 0x80) {
+			out.push_back(char(cp));
+		}
+		else if (cp < 0x800) {
+			out.push_back(char(0xc0 | (cp >> 6)));
+			out.push_back(char(0x80 | (cp & 0x3f)));
+		}
+		else if (cp < 0x10000) {
+			out.push_back(char(0xe0 | (cp >> 12)));
+			out.push_back(char(0x80 | ((cp >> 6) & 0x3f)));
+			out.push_back(char(0x80 | (cp & 0x3f)));
+		}
+		else {
+			out.push_back(char(0xf0 | (cp >> 18)));
+			out.push_back(char(0x80 | ((cp >> 12) & 0x3f)));
+			out.push_back(char(0x80 | ((cp >> 6) & 0x3f)));
+			out.push_back(char(0x80 | (cp & 0x3f)));
+		}
+	}
+};
+
+// Scans a UTF-8 encoded json object and fills the top-level fields with the given names,
+// without building a DOM or allocating memory. This is much cheaper than Json::Reader
+// for picking the method and the sequence number out of every client message.
+// If a field appears more than once, the last one wins, like Json::Reader.
+// Returns false if the data is not a json object. Nested values are skipped without
+// being fully validated, so some malformed messages are accepted.
+class JsonFieldScanner {
+public:
+	static bool scan(const char* data, size_t len, JsonField* fields, size_t fieldCount) {
+		// every helper takes the current position and returns the position after what it parsed,
+		// or nullptr on errors, so the position can stay in a register.
+		const char* p = data;
+		const char* end = data + len;
+		p = skipSpaces(p, end);
+		if (p == end || *p != '{')
+			return false;
+		p = skipSpaces(p + 1, end);
+		if (p < end && *p == '}') {
+			++p;
+		}
+		else {
+			for (;;) {
+				// "name": value
+				if (p == end || *p != '"')
+					return false;
+				const char* name = p + 1;
+				bool nameEscaped;
+				p = skipString(name, end, nameEscaped);
+				if (p == nullptr)
+					return false;
+				JsonField* field = findField(fields, fieldCount, name, p - 1 - name, nameEscaped);
+				p = skipSpaces(p, end);
+				if (p == end || *p != ':')
+					return false;
+				p = skipSpaces(p + 1, end);
+
+				const char* value = p;
+				JsonField::Type type;
+				bool escaped = false;
+				p = skipValue(p, end, type, escaped);
+				if (p == nullptr)
+					return false;
+				if (field != nullptr) {
+					field->type = type;
+					if (type == JsonField::STRING) {  // without the quotes
+						field->value = value + 1;
+						field->len = p - value - 2;
+					}
+					else {
+						field->value = value;
+						field->len = p - value;
+					}
+					field->escaped = escaped;
+				}
+
+				p = skipSpaces(p, end);
+				if (p == end)
+					return false;
+				if (*p == '}') {
+					++p;
+					break;
+				}
+				if (*p != ',')
+					return false;
+				p = skipSpaces(p + 1, end);
+			}
+		}
+		// only whitespace may follow the object
+		return skipSpaces(p, end) == end;
+	}
+
+private:
+	static JsonField* findField(JsonField* fields, size_t fieldCount, const char* name, size_t nameLen, bool escaped) {
+		if (escaped)
+			return findEscapedField(fields, fieldCount, name, nameLen);
+		for (size_t i = 0; i < fieldCount; ++i) {
+			if (fields[i].nameLen == nameLen && memcmp(fields[i].name, name, nameLen) == 0)
+				return &fields[i];
+		}
+		return nullptr;
+	}
+
+	// kept out of findField() so the common path does not need a stack buffer
+	static JsonField* findEscapedField(JsonField* fields, size_t fieldCount, const char* name, size_t nameLen) {
+		// field names are short, a longer name cannot match any of them
+		char decoded[64];
+		struct Buffer {
+			char* data;
+			size_t len;
+			void push_back(char c) {
+				if (len < sizeof(decoded))
+					data[len] = c;
+				++len;
+			}
+		} buf{ decoded, 0 };
+		JsonField::decodeString(name, name + nameLen, buf);
+		if (buf.len > sizeof(decoded))
+			return nullptr;
+		return findField(fields, fieldCount, decoded, buf.len, false);
+	}
+
+	static const char* skipValue(const char* p, const char* end, JsonField::Type& type, bool& escaped) {
+		if (p == end)
+			return nullptr;
+		switch (*p) {
+		case '"':
+			type = JsonField::STRING;
+			return skipString(p + 1, end, escaped);
+		case '{':
+		case '[':
+			type = JsonField::OTHER;
+			return skipContainer(p, end);
+		case 't':
+			type = JsonField::OTHER;
+			return skipLiteral(p, end, "true", 4);
+		case 'f':
+			type = JsonField::OTHER;
+			return skipLiteral(p, end, "false", 5);
+		case 'n':
+			type = JsonField::OTHER;
+			return skipLiteral(p, end, "null", 4);
+		default:
+			type = JsonField::NUMBER;
+			return skipNumber(p, end);
+		}
+	}
+
+	// p points to the char after the opening quote. returns the position after the closing quote.
+	static const char* skipString(const char* p, const char* end, bool& escaped) {
+		// most strings are short field names, so a simple loop is faster than memchr() here
+		const char* begin = p;
+		bool hasEscapes = false;
+		while (p < end) {
+			char c = *p;
+			if (c == '"') {
+				escaped = hasEscapes;
+				if (hasEscapes && !validateEscapes(begin, p))
+					return nullptr;
+				return p + 1;
+			}
+			if (c == '\\') {
+				hasEscapes = true;
+				++p;  // skip the escaped char
+			}
+			++p;
+		}
+		return nullptr;
+	}
+
+	static bool validateEscapes(const char* p, const char* end) {
+		while ((p = static_cast<const char*>(memchr(p, '\\', end - p))) != nullptr) {
+			++p;
+			switch (*p++) {
+			case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+				break;
+			case 'u':
+				if (end - p < 4)
+					return false;
+				for (int i = 0; i < 4; ++i) {
+					if (!isxdigit(static_cast<unsigned char>(p[i])))
+						return false;
+				}
+				p += 4;
+				break;
+			default:
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static const char* skipLiteral(const char* p, const char* end, const char* literal, size_t literalLen) {
+		if (size_t(end - p) < literalLen || memcmp(p, literal, literalLen) != 0)
+			return nullptr;
+		return p + literalLen;
+	}
+
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	static const char* skipNumber(const char* p, const char* end) {
+		if (p < end && *p == '-')
+			++p;
+		if (p < end && *p == '0')
+			++p;
+		else if ((p = skipDigits(p, end)) == nullptr)
+			return nullptr;
+		if (p < end && *p == '.') {
+			if ((p = skipDigits(p + 1, end)) == nullptr)
+				return nullptr;
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			++p;
+			if (p < end && (*p == '+' || *p == '-'))
+				++p;
+			if ((p = skipDigits(p, end)) == nullptr)
+				return nullptr;
+		}
+		return p;
+	}
+
+	// at least one digit is required
+	static const char* skipDigits(const char* p, const char* end) {
+		const char* begin = p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			++p;
+		}
+		return p != begin ? p : nullptr;
+	}
+
+	// skip a nested object or array
+	static const char* skipContainer(const char* p, const char* end) {
+		char close = (*p == '[') ? ']' : '}';
+		// fast path for arrays of numbers, such as the keyStates of the key events:
+		// if no string or nested array comes before the first ']', it's the end.
+		// (an object always contains a string unless it's empty.)
+		if (close == ']') {
+			auto closePos = static_cast<const char*>(memchr(p + 1, ']', end - p - 1));
+			if (closePos == nullptr)
+				return nullptr;
+			size_t n = closePos - p - 1;
+			if (memchr(p + 1, '"', n) == nullptr && memchr(p + 1, '[', n) == nullptr)
+				return closePos + 1;
+		}
+
+		// match the brackets while skipping the strings
+		size_t depth = 0;
+		while (p < end) {
+			switch (*p++) {
+			case '"': {
+				bool escaped;
+				if ((p = skipString(p, end, escaped)) == nullptr)
+					return nullptr;
+				break;
+			}
+			case '[':
+			case '{':
+				++depth;
+				break;
+			case ']':
+			case '}':
+				if (--depth == 0)
+					return p[-1] == close ? p : nullptr;
+				break;
+			}
+		}
+		return nullptr;
+	}
+
+	static const char* skipSpaces(const char* p, const char* end) {
+		// compact json written by Json::FastWriter has no whitespace, so check that first
+		while (p < end && static_cast<unsigned char>(*p) <= ' ' &&
+			(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+			++p;
+		}
+		return p;
+	}
+};
+
+} // namespace PIME
+
+#endif // _PIME_JSON_FIELD_SCANNER_H_
@@ -0,0 +1,396 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+// how long it takes to scan the key events sent by the text service.
+// how long it takes to scan a typical key event sent by the text service.
+//
+// Usage: PIMEJsonScannerBench [--fuzz <iterations>] [--bench <iterations>] [--seed <n>]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include <json/json.h>
+
+#include "JsonFieldScanner.h"
+
+using namespace std;
+using namespace PIME;
+
+static const char* fieldNames[] = { "method", "seqNum", "id" };
+static const size_t fieldCount = 3;
+
+class MessageGenerator {
+public:
+	explicit MessageGenerator(unsigned int seed) :
+		random_{ seed } {
+	}
+
+	// a random json object using the fields we look for, nested values, escapes, and whitespace
+	string object(int depth = 0) {
+		string json = "{";
+		int memberCount = int(pick(depth == 0 ? 8 : 4));
+		for (int i = 0; i < memberCount; ++i) {
+			if (i > 0) {
+				json += ',';
+			}
+			spaces(json);
+			name(json, depth);
+			spaces(json);
+			json += ':';
+			spaces(json);
+			value(json, depth);
+			spaces(json);
+		}
+		json += '}';
+		return json;
+	}
+
+	size_t pick(size_t n) {
+		return random_() % n;
+	}
+
+private:
+	void name(string& json, int depth) {
+		switch (pick(8)) {
+		case 0: case 1: case 2:
+			json += '"';
+			json += fieldNames[pick(fieldCount)];  // the same field might appear more than once
+			json += '"';
+			break;
+		case 3:
+			json += "\"\\u006dethod\"";  // an escaped field name
+			break;
+		default:
+			str(json);
+			break;
+		}
+	}
+
+	void value(string& json, int depth) {
+		switch (pick(depth < 3 ? 8 : 6)) {
+		case 0: case 1:
+			str(json);
+			break;
+		case 2: case 3:
+			number(json);
+			break;
+		case 4:
+			json += pick(2) ? "true" : "false";
+			break;
+		case 5:
+			json += "null";
+			break;
+		case 6:
+			array(json, depth + 1);
+			break;
+		case 7:
+			json += object(depth + 1);
+			break;
+		}
+	}
+
+	void array(string& json, int depth) {
+		json += '[';
+		int count = int(pick(6));
+		bool numbersOnly = pick(2) != 0;  // like keyStates
+		for (int i = 0; i < count; ++i) {
+			if (i > 0) {
+				json += ',';
+			}
+			spaces(json);
+			if (numbersOnly)
+				number(json);
+			else
+				value(json, depth);
+			spaces(json);
+		}
+		json += ']';
+	}
+
+	void str(string& json) {
+		static const char* pieces[] = {
+			"a", "init", "filterKeyDown", "{c5f37da0-274e-4837-9b7c-9bb79fe85d9d}", " ", "]", "}", "[", "{", ",", ":",
+			"\\\"", "\\\\", "\\/", "\\b", "\\f", "\\n", "\\r", "\\t", "\\u0041", "\\u00e9", "\\u4e2d", "\\ud83d\\ude00",
+			"\xe4\xb8\xad", "\xc3\xa9", "\\\\\\\""
+		};
+		json += '"';
+		int count = int(pick(5));
+		for (int i = 0; i < count; ++i) {
+			json += pieces[pick(sizeof(pieces) / sizeof(pieces[0]))];
+		}
+		json += '"';
+	}
+
+	void number(string& json) {
+		switch (pick(6)) {
+		case 0:
+			json += to_string(random_());
+			break;
+		case 1:
+			json += to_string(pick(256));
+			break;
+		case 2:
+			json += "-" + to_string(pick(1000));
+			break;
+		case 3:
+			json += to_string(pick(100)) + "." + to_string(pick(100));
+			break;
+		case 4:
+			json += to_string(pick(10)) + (pick(2) ? "e" : "E-") + to_string(pick(5));
+			break;
+		case 5:
+			json += "12345678901234567890";  // too large for 32 bits
+			break;
+		}
+	}
+
+	void spaces(string& json) {
+		static const char spaceChars[] = " \t\r\n";
+		while (pick(4) == 0) {
+			json += spaceChars[pick(4)];
+		}
+	}
+
+private:
+	mt19937 random_;
+};
+
+// jsoncpp combines a high surrogate with any following \\u escape, while the
+// scanner decodes unpaired surrogates one by one. ignore such ill-formed strings.
+static bool hasUnpairedSurrogate(const JsonField& field) {
+	string raw(field.value, field.len);
+	for (size_t pos = 0; (pos = raw.find("\\u", pos)) != string::npos; pos += 2) {
+		// count the backslashes before the escape
+		size_t backslashes = 0;
+		while (pos >= backslashes + 1 && raw[pos - backslashes - 1] == '\\') {
+			++backslashes;
+		}
+		if (backslashes % 2 != 0 || raw.length() - pos < 6)
+			continue;
+		unsigned int cp = unsigned(strtoul(raw.substr(pos + 2, 4).c_str(), nullptr, 16));
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			unsigned int low = 0;
+			if (raw.compare(pos + 6, 2, "\\u") == 0 && raw.length() - pos >= 12)
+				low = unsigned(strtoul(raw.substr(pos + 8, 4).c_str(), nullptr, 16));
+			if (low < 0xdc00 || low > 0xdfff)
+				return true;
+			pos += 6;
+		}
+	}
+	return false;
+}
+
+// returns an error message if the fields found by the scanner are different from the ones parsed by jsoncpp
+static string compareFields(const Json::Value& root, const JsonField* fields) {
+	for (size_t i = 0; i < fieldCount; ++i) {
+		const JsonField& field = fields[i];
+		string name = field.name;
+		if (!root.isMember(name)) {
+			if (field.type != JsonField::MISSING)
+				return name + " should be missing";
+			continue;
+		}
+		const Json::Value& value = root[name];
+		if (value.isString()) {
+			if (field.type != JsonField::STRING)
+				return name + " should be a string";
+			if (hasUnpairedSurrogate(field))
+				continue;
+			if (field.asString() != value.asString())
+				return name + " has a different value: " + field.asString();
+			if (!field.equals(value.asCString()) && value.asString().find('\0') == string::npos)
+				return name + " is not equal to the decoded string";
+		}
+		else if (value.isNumeric() && !value.isBool()) {
+			if (field.type != JsonField::NUMBER)
+				return name + " should be a number";
+			uint32_t n;
+			string raw(field.value, field.len);
+			bool isInteger = raw.find_first_not_of("0123456789") == string::npos;
+			if (isInteger && value.isUInt() && (!field.asUInt(n) || n != value.asUInt()))
+				return name + " has a different number: " + raw;
+			if (field.asUInt(n) && !(value.isUInt() && n == value.asUInt()))
+				return name + " is not a 32-bit unsigned integer: " + raw;
+		}
+		else if (field.type != JsonField::OTHER) {
+			return name + " should be another type";
+		}
+	}
+	return string();
+}
+
+static bool scanAndCompare(const string& json, bool valid) {
+	// copy the message to a buffer of the exact size, so reading past the end is caught by sanitizers
+	vector<char> buf(json.begin(), json.end());
+	JsonField fields[] = { JsonField{ fieldNames[0] }, JsonField{ fieldNames[1] }, JsonField{ fieldNames[2] } };
+	bool scanned = JsonFieldScanner::scan(buf.data(), buf.size(), fields, fieldCount);
+
+	Json::Value root;
+	Json::Reader reader(Json::Features::strictMode());
+	bool parsed = reader.parse(json, root) && root.isObject();
+	if (valid && (!scanned || !parsed)) {
+		fprintf(stderr, "Fail to scan a valid message (scanner: %d, jsoncpp: %d): %s\n", scanned, parsed, json.c_str());
+		return false;
+	}
+	if (scanned && parsed) {
+		string error = compareFields(root, fields);
+		if (!error.empty()) {
+			fprintf(stderr, "Mismatch: %s\n  message: %s\n", error.c_str(), json.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool fuzz(unsigned int iterations, unsigned int seed) {
+	MessageGenerator generator{ seed };
+	unsigned int failures = 0;
+	for (unsigned int i = 0; i < iterations && failures < 10; ++i) {
+		string json = generator.object();
+		if (!scanAndCompare(json, true))
+			++failures;
+
+		// a corrupted copy of the message. the scanner might accept some of them, but
+		// it should agree with jsoncpp whenever both accept it, and never crash.
+		string mutated = json;
+		int mutations = int(generator.pick(3)) + 1;
+		for (int j = 0; j < mutations && !mutated.empty(); ++j) {
+			size_t pos = generator.pick(mutated.length());
+			static const char bytes[] = "{}[]\",:\\ 0-.eEtfnu\x80";
+			switch (generator.pick(4)) {
+			case 0:
+				mutated.erase(pos, 1);
+				break;
+			case 1:
+				mutated.insert(pos, 1, bytes[generator.pick(sizeof(bytes) - 1)]);
+				break;
+			case 2:
+				mutated[pos] = bytes[generator.pick(sizeof(bytes) - 1)];
+				break;
+			case 3:
+				mutated.resize(pos);
+				break;
+			}
+		}
+		if (!scanAndCompare(mutated, false))
+			++failures;
+	}
+	printf("fuzz: %u iterations, %u failures\n", iterations, failures);
+	return failures == 0;
+}
+
+template <typename Func>
+static double measure(unsigned int iterations, Func func) {
+	auto start = chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i) {
+		func();
+	}
+	auto elapsed = chrono::steady_clock::now() - start;
+	return chrono::duration<double, nano>(elapsed).count() / iterations;
+}
+
+// the best of several rounds, since the other processes on a shared machine slow down some of them
+template <typename Func>
+static double measureBest(unsigned int iterations, Func func) {
+	const unsigned int rounds = 10;
+	double best = measure(iterations / rounds + 1, func);
+	for (unsigned int i = 1; i < rounds; ++i) {
+		best = min(best, measure(iterations / rounds + 1, func));
+	}
+	return best;
+}
+
+// time the scan of a key event written by PIMEClient, for the fields read by PipeServer::handleClientMessage()
+static void benchKeyEvent(const char* name, const Json::Value& keyEvent, unsigned int iterations) {
+	string json = Json::FastWriter().write(keyEvent);
+	volatile uint32_t sink = 0;
+	double scannerTime = measureBest(iterations, [&]() {
+		JsonField fields[] = { JsonField{ "method" }, JsonField{ "seqNum" }, JsonField{ "id" }, JsonField{ "fusedKeyEvents" } };
+		JsonFieldScanner::scan(json.data(), json.length(), fields, 4);
+		uint32_t seqNum = 0;
+		fields[1].asUInt(seqNum);
+		sink = sink + seqNum + uint32_t(fields[0].len);
+	});
+	double jsoncppTime = measure(iterations / 10 + 1, [&]() {
+		Json::Value msg;
+		Json::Reader reader;
+		reader.parse(json.data(), json.data() + json.length(), msg);
+		sink = sink + msg.get("seqNum", 0).asUInt();
+	});
+	printf("%s: %u bytes\n", name, unsigned(json.length()));
+	printf("  JsonFieldScanner: %.1f ns/message\n", scannerTime);
+	printf("  Json::Reader: %.1f ns/message\n", jsoncppTime);
+}
+
+static void bench(unsigned int iterations) {
+	Json::Value keyEvent;
+	keyEvent["method"] = "filterKeyDown";
+	keyEvent["charCode"] = 'a';
+	keyEvent["keyCode"] = 'A';
+	keyEvent["repeatCount"] = 0;
+	keyEvent["scanCode"] = 30;
+	keyEvent["isExtended"] = false;
+	keyEvent["seqNum"] = 12345;
+
+	// sent to the text services which accept compact key events, see PIMEClient::keyEventToJson()
+	Json::Value compactKeyEvent = keyEvent;
+	compactKeyEvent["keyModifiers"] = 1 << 16;  // NumLock is on
+	compactKeyEvent["keysDown"] = Json::Value(Json::arrayValue);
+	compactKeyEvent["keysDown"].append('A');
+	benchKeyEvent("compact key event", compactKeyEvent, iterations);
+
+	// with the state of every key
+	Json::Value keyStates(Json::arrayValue);
+	for (int i = 0; i < 256; ++i) {
+		keyStates.append(0);
+	}
+	keyEvent["keyStates"] = keyStates;
+	benchKeyEvent("key event", keyEvent, iterations);
+}
+
+int main(int argc, char** argv) {
+	unsigned int fuzzIterations = 100000;
+	unsigned int benchIterations = 1000000;
+	unsigned int seed = 1;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--fuzz" && i + 1 < argc)
+			fuzzIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--bench" && i + 1 < argc)
+			benchIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = unsigned(atoi(argv[++i]));
+		else {
+			fprintf(stderr, "Usage: %s [--fuzz iterations] [--bench iterations] [--seed n]\n", argv[0]);
+			return 1;
+		}
+	}
+	bool ok = fuzz(fuzzIterations, seed);
+	if (benchIterations > 0) {
+		bench(benchIterations);
+	}
+	return ok ? 0 : 1;
+}
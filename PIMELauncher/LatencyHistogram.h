@@ -0,0 +1,124 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_LATENCY_HISTOGRAM_H_
+#define _PIME_LATENCY_HISTOGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+namespace PIME {
+
+// HDR-style histogram of latencies in microseconds.
+// Values are counted in log-linear buckets: every power of two range is split
+// into subBucketCount / 2 equal sub-buckets, so the reported percentiles are
+// within ~3% of the real values, from 1 us to about 19 hours.
+// Recording a value is a few relaxed atomic operations on a fixed array, which
+// neither locks nor allocates, so it's cheap enough to do for every request.
+class LatencyHistogram {
+public:
+	static const unsigned int subBucketBits = 6;
+	static const uint64_t subBucketCount = uint64_t(1) << subBucketBits;
+	static const unsigned int maxValueBits = 36; // larger values are clamped
+	static const size_t bucketCount = subBucketCount + (maxValueBits - subBucketBits) * (subBucketCount / 2);
+
+	LatencyHistogram() {
+		reset();
+	}
+
+	void record(uint64_t value) {
+		buckets_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		uint64_t max = max_.load(std::memory_order_relaxed);
+		while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	uint64_t count() const {
+		return count_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t max() const {
+		return max_.load(std::memory_order_relaxed);
+	}
+
+	// the value below which the given percentage (0 - 100) of the recorded values fall
+	uint64_t percentile(double percent) const {
+		uint64_t total = count();
+		if (total == 0)
+			return 0;
+		uint64_t target = uint64_t(percent / 100.0 * total + 0.5);
+		if (target < 1)
+			target = 1;
+		uint64_t sum = 0;
+		for (size_t i = 0; i < bucketCount; ++i) {
+			sum += buckets_[i].load(std::memory_order_relaxed);
+			if (sum >= target) {
+				uint64_t value = bucketUpperBound(i);
+				uint64_t maxValue = max();
+				return value < maxValue ? value : maxValue;
+			}
+		}
+		return max();
+	}
+
+	void reset() {
+		for (auto& bucket : buckets_) {
+			bucket.store(0, std::memory_order_relaxed);
+		}
+		count_.store(0, std::memory_order_relaxed);
+		max_.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static size_t bucketIndex(uint64_t value) {
+		if (value < subBucketCount)
+			return size_t(value);
+		const uint64_t maxValue = (uint64_t(1) << maxValueBits) - 1;
+		if (value > maxValue)
+			value = maxValue;
+		unsigned int msb = subBucketBits;
+		while ((value >> (msb + 1)) != 0) {
+			++msb;
+		}
+		// keep the highest subBucketBits bits of the value
+		unsigned int shift = msb - (subBucketBits - 1);
+		uint64_t subBucket = (value >> shift) - subBucketCount / 2;
+		return size_t(subBucketCount + (shift - 1) * (subBucketCount / 2) + subBucket);
+	}
+
+	// the largest value counted in the bucket
+	static uint64_t bucketUpperBound(size_t index) {
+		if (index < subBucketCount)
+			return index;
+		uint64_t shift = (index - subBucketCount) / (subBucketCount / 2) + 1;
+		uint64_t subBucket = (index - subBucketCount) % (subBucketCount / 2) + subBucketCount / 2;
+		return ((subBucket + 1) << shift) - 1;
+	}
+
+private:
+	std::atomic<uint32_t> buckets_[bucketCount];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> max_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_LATENCY_HISTOGRAM_H_
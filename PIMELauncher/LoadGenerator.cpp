@@ -0,0 +1,659 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+// A load generator for PIMELauncher on platforms other than Windows.
+// It starts a launcher with a temporary PIME dir using the python backend of the
+// source tree, connects many simulated text service clients to it, and lets every
+// client type key events one after another like a user does. Then it reports the
+// throughput and the latency percentiles of the requests.
+//
+// Usage: PIMELoadGenerator <PIMELauncher executable> [options]
+//   --clients <n>       number of simulated clients (default: 16)
+//   --keys <n>          number of key strokes typed by every client (default: 250)
+//                       every key stroke sends filterKeyDown, onKeyDown, filterKeyUp, and onKeyUp.
+//   --background <n>    number of additional clients which keep switching between apps
+//                       (onDeactivate and onActivate) while the others are typing (default: 0)
+//   --guid <guid>       the input method to use (default: meow)
+//   --workers <n>       number of worker processes of the backend (default: 1)
+//   --threaded          run the backend in its own event loop thread
+//   --max-in-flight <n> max number of unreplied requests sent to a worker, 0 for no limit
+//   --framing <mode>    framing of the backend, "text" or "binary" (default: binary)
+//   --python <path>     the python interpreter running the backend
+//   --no-fused          send onKeyDown and onKeyUp even if the backend already handled
+//                       the keys together with filterKeyDown and filterKeyUp
+//   --loop-queue-size <n>  size of the queues between the loops in threaded mode, a power of 2.
+//                       a small one makes them full all the time.
+//   --restart-after <ms>  restart the backend through the debug console once after all clients
+//                       are activated. the requests lost with the processes fail, so only a
+//                       stall or a closed connection fails the run then.
+//   --key-delay <ms>    make the backend sleep before handling every key, like a slow lookup does.
+//                       with fused key events, this is done in filterKeyDown and filterKeyUp.
+//   --filter-timeout <ms>  timeout of filterKeyDown and filterKeyUp set in backends.json
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <csignal>
+#include <ftw.h>
+#include <unistd.h>
+
+#include <uv.h>
+#include <json/json.h>
+
+#include "BackendProtocol.h"
+#include "LatencyHistogram.h"
+#include "StreamFramer.h"
+
+using namespace std;
+using namespace PIME;
+
+extern char** environ;
+
+// give up if the launcher does not accept connections in time (in ms)
+static const uint64_t connectTimeout = 10000;
+static const uint64_t connectRetryInterval = 50;
+
+// the launcher is stuck if no reply arrives for this long (in ms)
+static const uint64_t stallTimeout = 30000;
+
+static const char* keyMethods[] = { "filterKeyDown", "onKeyDown", "filterKeyUp", "onKeyUp" };
+
+class LoadGenerator;
+
+// a simulated text service
+struct LoadClient {
+	LoadGenerator* generator_;
+	uv_pipe_t pipe_;
+	uv_connect_t connectReq_;
+	StreamFramer framer_;
+	unsigned int seqNum_;
+	unsigned int sentRequests_; // number of requests sent after the client is activated
+	uint64_t requestTime_; // when the pending request is sent (in ns)
+	bool activated_;
+	bool background_; // sends onDeactivate and onActivate instead of key events
+	bool compactKeyEvents_; // the text service accepts key events without the full keyStates array
+
+	LoadClient(LoadGenerator* generator, bool background) :
+		generator_{ generator },
+		seqNum_{ 0 },
+		sentRequests_{ 0 },
+		requestTime_{ 0 },
+		activated_{ false },
+		background_{ background },
+		compactKeyEvents_{ false } {
+		framer_.setMode(StreamFramer::BINARY_MODE);
+	}
+};
+
+class LoadGenerator {
+public:
+	LoadGenerator() :
+		clientCount_{ 16 },
+		backgroundCount_{ 0 },
+		keysPerClient_{ 250 },
+		guid_{ "{c5f37da0-274e-4837-9b7c-9bb79fe85d9d}" },  // meow
+		workers_{ 1 },
+		threaded_{ false },
+		maxInFlight_{ -1 },
+		framing_{ "binary" },
+		python_{ PIME_PYTHON },
+		fusedKeyEvents_{ true },
+		loopQueueSize_{ 0 },
+		restartAfter_{ 0 },
+		keyDelay_{ 0 },
+		filterTimeout_{ 0 },
+		launcherProcess_{},
+		connectTimer_{},
+		stallTimer_{},
+		restartTimer_{},
+		debugPipe_{},
+		debugConnectReq_{},
+		lastReplyTime_{ 0 },
+		aborted_{ false },
+		connectStartTime_{ 0 },
+		launchTime_{ 0 },
+		startTime_{ 0 },
+		activatedTime_{ 0 },
+		activatedClients_{ 0 },
+		finishedClients_{ 0 },
+		failedRequests_{ 0 } {
+	}
+
+	bool parseArgs(int argc, char** argv);
+	int exec();
+
+	void onConnected(LoadClient* client, int status);
+	void onDataReceived(LoadClient* client, ssize_t nread, const uv_buf_t* buf);
+	void onReply(LoadClient* client, const char* data, size_t len);
+
+private:
+	bool initPimeDir();
+	bool startLauncher();
+	void connectClients();
+	void sendRequest(LoadClient* client, const Json::Value& request);
+	void sendNextRequest(LoadClient* client);
+	void restartBackend();
+	void checkStall();
+	void finish();
+	void report();
+
+private:
+	string launcherPath_;
+	int clientCount_;
+	int backgroundCount_;
+	int keysPerClient_;
+	string guid_;
+	int workers_;
+	bool threaded_;
+	int maxInFlight_; // -1 to use the default
+	string framing_;
+	string python_;
+	bool fusedKeyEvents_;
+	unsigned int loopQueueSize_; // 0 to use the default
+	uint64_t restartAfter_; // in ms, 0 to never restart the backend
+	unsigned int keyDelay_; // in ms
+	unsigned int filterTimeout_; // in ms, 0 to use the default
+
+	string pimeDir_; // temporary dir containing backends.json and the sockets
+	uv_process_t launcherProcess_;
+	uv_timer_t connectTimer_;
+	uv_timer_t stallTimer_;
+	uv_timer_t restartTimer_;
+	uv_pipe_t debugPipe_; // connection to the debug console pipe of the launcher
+	uv_connect_t debugConnectReq_;
+	uint64_t lastReplyTime_; // in ms
+	bool aborted_; // the launcher is stuck or closed a connection
+	uint64_t connectStartTime_; // in ms
+	uint64_t launchTime_; // in ns
+	vector<LoadClient*> clients_;
+	Json::Value keyStates_;
+
+	uint64_t startTime_; // when the first client is activated (in ns)
+	uint64_t activatedTime_; // when all clients are activated (in ns)
+	int activatedClients_;
+	int finishedClients_;
+	unsigned int failedRequests_;
+	LatencyHistogram latency_; // latency of the key events (in us)
+	LatencyHistogram backgroundLatency_; // latency of the requests of the background clients (in us)
+};
+
+bool LoadGenerator::parseArgs(int argc, char** argv) {
+	if (argc < 2)
+		return false;
+	launcherPath_ = argv[1];
+	for (int i = 2; i < argc; ++i) {
+		string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+		if (arg == "--clients" && hasValue)
+			clientCount_ = atoi(argv[++i]);
+		else if (arg == "--background" && hasValue)
+			backgroundCount_ = atoi(argv[++i]);
+		else if (arg == "--keys" && hasValue)
+			keysPerClient_ = atoi(argv[++i]);
+		else if (arg == "--guid" && hasValue) {
+			guid_ = argv[++i];
+			// the text service sends GUIDs in lower case
+			transform(guid_.begin(), guid_.end(), guid_.begin(), ::tolower);
+		}
+		else if (arg == "--workers" && hasValue)
+			workers_ = atoi(argv[++i]);
+		else if (arg == "--threaded")
+			threaded_ = true;
+		else if (arg == "--max-in-flight" && hasValue)
+			maxInFlight_ = atoi(argv[++i]);
+		else if (arg == "--framing" && hasValue)
+			framing_ = argv[++i];
+		else if (arg == "--python" && hasValue)
+			python_ = argv[++i];
+		else if (arg == "--no-fused")
+			fusedKeyEvents_ = false;
+		else if (arg == "--loop-queue-size" && hasValue)
+			loopQueueSize_ = unsigned(atoi(argv[++i]));
+		else if (arg == "--key-delay" && hasValue)
+			keyDelay_ = unsigned(atoi(argv[++i]));
+		else if (arg == "--filter-timeout" && hasValue)
+			filterTimeout_ = unsigned(atoi(argv[++i]));
+		else if (arg == "--restart-after" && hasValue)
+			restartAfter_ = uint64_t(atoi(argv[++i]));
+		else
+			return false;
+	}
+	return clientCount_ > 0 && keysPerClient_ > 0 && backgroundCount_ >= 0;
+}
+
+bool LoadGenerator::initPimeDir() {
+	char dirTemplate[] = "/tmp/PIMELoadGenerator-XXXXXX";
+	if (mkdtemp(dirTemplate) == nullptr)
+		return false;
+	pimeDir_ = dirTemplate;
+
+	// the same layout as the installed PIME dir, using the python backend of the source tree
+	if (symlink(PIME_SOURCE_DIR "/python", (pimeDir_ + "/python").c_str()) != 0 ||
+		symlink(python_.c_str(), (pimeDir_ + "/python3").c_str()) != 0)
+		return false;
+
+	Json::Value backend;
+	backend["name"] = "python";
+	backend["command"] = "python3";
+	backend["workingDir"] = "python";
+	backend["params"] = "server.py";
+	if (keyDelay_ > 0) {
+		// run the server with the key handlers of the text services slowed down
+		string script = "import os, sys, time\n"
+			"sys.path.insert(0, os.getcwd())\n"
+			"import server, textService\n"
+			"def slowDown(handle):\n"
+			"    def slowHandle(*args):\n"
+			"        time.sleep(" + to_string(keyDelay_) + " / 1000.0)\n"
+			"        return handle(*args)\n"
+			"    return slowHandle\n"
+			"textService.TextService.handleKeyEvent = slowDown(textService.TextService.handleKeyEvent)\n"
+			"textService.TextService.handleFusedKeyEvent = slowDown(textService.TextService.handleFusedKeyEvent)\n"
+			"server.main()\n";
+		string scriptPath = pimeDir_ + "/slow_server.py";
+		FILE* file = fopen(scriptPath.c_str(), "w");
+		if (file == nullptr)
+			return false;
+		fwrite(script.data(), 1, script.length(), file);
+		fclose(file);
+		backend["params"] = scriptPath;
+	}
+	if (filterTimeout_ > 0) {
+		backend["requestTimeouts"]["filterKeyDown"] = filterTimeout_;
+		backend["requestTimeouts"]["filterKeyUp"] = filterTimeout_;
+	}
+	backend["framing"] = framing_;
+	backend["workers"] = workers_;
+	backend["threaded"] = threaded_;
+	backend["eagerStart"] = true;
+	backend["idleTimeout"] = 0;
+	if (maxInFlight_ >= 0)
+		backend["maxInFlight"] = maxInFlight_;
+	if (loopQueueSize_ > 0)
+		backend["loopQueueSize"] = loopQueueSize_;
+	Json::Value backends(Json::arrayValue);
+	backends.append(backend);
+
+	FILE* file = fopen((pimeDir_ + "/backends.json").c_str(), "w");
+	if (file == nullptr)
+		return false;
+	string config = Json::StyledWriter().write(backends);
+	fwrite(config.data(), 1, config.length(), file);
+	fclose(file);
+	return true;
+}
+
+bool LoadGenerator::startLauncher() {
+	vector<string> envStrs;
+	for (char** penv = environ; *penv; ++penv) {
+		envStrs.emplace_back(*penv);
+	}
+	envStrs.emplace_back("PIME_DIR=" + pimeDir_);
+	envStrs.emplace_back("PIME_SOCKET_DIR=" + pimeDir_);
+	// keep the input method index in the temporary dir, and don't write python caches to the source tree
+	envStrs.emplace_back("XDG_CACHE_HOME=" + pimeDir_);
+	envStrs.emplace_back("PYTHONDONTWRITEBYTECODE=1");
+	vector<char*> env;
+	for (auto& str : envStrs) {
+		env.push_back(const_cast<char*>(str.c_str()));
+	}
+	env.push_back(nullptr);
+
+	char* args[] = { const_cast<char*>(launcherPath_.c_str()), nullptr };
+	uv_stdio_container_t stdio[3];
+	stdio[0].flags = UV_IGNORE;
+	stdio[1].flags = UV_INHERIT_FD;
+	stdio[1].data.fd = 1;
+	stdio[2].flags = UV_INHERIT_FD;
+	stdio[2].data.fd = 2;
+
+	uv_process_options_t options = { 0 };
+	options.exit_cb = [](uv_process_t* process, int64_t exit_status, int term_signal) {
+		uv_close(reinterpret_cast<uv_handle_t*>(process), nullptr);
+	};
+	options.file = args[0];
+	options.args = args;
+	options.env = env.data();
+	options.stdio_count = 3;
+	options.stdio = stdio;
+	launcherProcess_.data = this;
+	launchTime_ = uv_hrtime();
+	int ret = uv_spawn(uv_default_loop(), &launcherProcess_, &options);
+	if (ret < 0) {
+		fprintf(stderr, "Fail to start %s: %s\n", launcherPath_.c_str(), uv_strerror(ret));
+		return false;
+	}
+	return true;
+}
+
+void LoadGenerator::connectClients() {
+	// the launcher might not be listening yet, retry until all clients are connected
+	for (auto client : clients_) {
+		if (uv_is_active(reinterpret_cast<uv_handle_t*>(&client->pipe_)) || client->connectReq_.data != nullptr)
+			continue;
+		client->connectReq_.data = client;
+		uv_pipe_connect(&client->connectReq_, &client->pipe_, (pimeDir_ + "/Launcher").c_str(), [](uv_connect_t* req, int status) {
+			auto client = reinterpret_cast<LoadClient*>(req->data);
+			client->generator_->onConnected(client, status);
+		});
+	}
+}
+
+void LoadGenerator::onConnected(LoadClient* client, int status) {
+	if (status < 0) {
+		// reset the handle and try again later
+		client->connectReq_.data = nullptr;
+		uv_close(reinterpret_cast<uv_handle_t*>(&client->pipe_), [](uv_handle_t* handle) {
+			auto client = reinterpret_cast<LoadClient*>(handle->data);
+			uv_pipe_init(uv_default_loop(), &client->pipe_, 0);
+			client->pipe_.data = client;
+		});
+		if (uv_now(uv_default_loop()) - connectStartTime_ > connectTimeout) {
+			fprintf(stderr, "Fail to connect to the launcher: %s\n", uv_strerror(status));
+			aborted_ = true;
+			finish();
+		}
+		return;
+	}
+
+	uv_read_start(reinterpret_cast<uv_stream_t*>(&client->pipe_),
+		[](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+			buf->base = new char[suggested_size];
+			buf->len = suggested_size;
+		},
+		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+			auto client = reinterpret_cast<LoadClient*>(stream->data);
+			client->generator_->onDataReceived(client, nread, buf);
+			delete []buf->base;
+		}
+	);
+
+	// initialize the text service like PIMEClient does
+	Json::Value request;
+	request["method"] = "init";
+	request["id"] = guid_;
+	request["isWindows8Above"] = true;
+	request["isMetroApp"] = false;
+	request["isUiLess"] = false;
+	request["isConsole"] = false;
+	request["fusedKeyEvents"] = fusedKeyEvents_;
+	sendRequest(client, request);
+}
+
+void LoadGenerator::onDataReceived(LoadClient* client, ssize_t nread, const uv_buf_t* buf) {
+	if (nread < 0) {
+		fprintf(stderr, "The launcher closed the connection: %s\n", uv_strerror(int(nread)));
+		aborted_ = true;
+		finish();
+		return;
+	}
+	client->framer_.feed(buf->base, nread, [this, client](const FrameHeader* header, const char* data, size_t len) {
+		if (header != nullptr && header->type == FRAME_REPLY) {
+			onReply(client, data, len);
+		}
+	});
+}
+
+void LoadGenerator::onReply(LoadClient* client, const char* data, size_t len) {
+	uint64_t now = uv_hrtime();
+	lastReplyTime_ = uv_now(uv_default_loop());
+	string reply(data, len);
+	if (reply.find("\"success\": true") == string::npos && reply.find("\"success\":true") == string::npos)
+		++failedRequests_;
+
+	if (!client->activated_) {
+		if (client->seqNum_ == 1) {  // the reply to init
+			client->compactKeyEvents_ = reply.find("\"compactKeyEvents\": true") != string::npos;
+			Json::Value request;
+			request["method"] = "onActivate";
+			request["isKeyboardOpen"] = true;
+			sendRequest(client, request);
+			return;
+		}
+		client->activated_ = true;
+		if (activatedClients_++ == 0)
+			startTime_ = now;
+		if (activatedClients_ == clientCount_ + backgroundCount_) {
+			activatedTime_ = now;
+			if (restartAfter_ > 0) {
+				uv_timer_start(&restartTimer_, [](uv_timer_t* timer) {
+					reinterpret_cast<LoadGenerator*>(timer->data)->restartBackend();
+				}, restartAfter_, 0);
+			}
+		}
+	}
+	else if (client->background_) {
+		backgroundLatency_.record((now - client->requestTime_) / 1000);
+	}
+	else {
+		latency_.record((now - client->requestTime_) / 1000);
+		// the reply of filterKeyDown or filterKeyUp might contain the reply of handling the key as well.
+		// skip onKeyDown or onKeyUp then, like the real client does.
+		if (client->sentRequests_ % 2 == 1 && (reply.find("\"onKeyDown\"") != string::npos || reply.find("\"onKeyUp\"") != string::npos))
+			++client->sentRequests_;
+	}
+
+	if (client->background_) {
+		// keep going until all of the other clients finish typing
+		sendNextRequest(client);
+	}
+	else if (client->sentRequests_ < unsigned(keysPerClient_) * 4) {
+		sendNextRequest(client);
+	}
+	else if (++finishedClients_ == clientCount_) {
+		finish();
+	}
+}
+
+void LoadGenerator::sendNextRequest(LoadClient* client) {
+	if (client->background_) {
+		Json::Value request;
+		request["method"] = (client->sentRequests_++ % 2 == 0) ? "onDeactivate" : "onActivate";
+		request["isKeyboardOpen"] = true;
+		sendRequest(client, request);
+		return;
+	}
+	// type A to Z repeatedly
+	unsigned int key = client->sentRequests_ / 4;
+	int keyCode = 'A' + key % 26;
+	Json::Value request;
+	request["method"] = keyMethods[client->sentRequests_ % 4];
+	request["charCode"] = keyCode + ('a' - 'A');
+	request["keyCode"] = keyCode;
+	request["repeatCount"] = 1;
+	request["scanCode"] = 0;
+	request["isExtended"] = false;
+	if (client->compactKeyEvents_) {
+		// no modifiers and no other keys are down, like the real client does
+		request["keyModifiers"] = 0;
+		request["keysDown"] = Json::Value(Json::arrayValue);
+	}
+	else {
+		request["keyStates"] = keyStates_;
+	}
+	++client->sentRequests_;
+	sendRequest(client, request);
+}
+
+void LoadGenerator::sendRequest(LoadClient* client, const Json::Value& request) {
+	struct WriteRequest {
+		uv_write_t req;
+		char header[frameHeaderSize];
+		string data;
+	};
+	auto writeReq = new WriteRequest();
+	Json::Value msg = request;
+	msg["seqNum"] = ++client->seqNum_;
+	writeReq->data = Json::FastWriter().write(msg);
+	encodeFrameHeader(FrameHeader{ FRAME_REQUEST, uint32_t(writeReq->data.length()), 0, client->seqNum_ }, writeReq->header);
+	uv_buf_t bufs[] = {
+		uv_buf_init(writeReq->header, sizeof(writeReq->header)),
+		uv_buf_init(&writeReq->data[0], unsigned(writeReq->data.length()))
+	};
+	client->requestTime_ = uv_hrtime();
+	uv_write(&writeReq->req, reinterpret_cast<uv_stream_t*>(&client->pipe_), bufs, 2, [](uv_write_t* req, int status) {
+		delete reinterpret_cast<WriteRequest*>(req);
+	});
+}
+
+void LoadGenerator::restartBackend() {
+	// send the command like the debug console does
+	debugConnectReq_.data = this;
+	uv_pipe_connect(&debugConnectReq_, &debugPipe_, (pimeDir_ + "/Debug").c_str(), [](uv_connect_t* req, int status) {
+		auto generator = reinterpret_cast<LoadGenerator*>(req->data);
+		if (status < 0) {
+			fprintf(stderr, "Fail to connect to the debug console pipe: %s\n", uv_strerror(status));
+			return;
+		}
+		// the recent debug output is sent to us, discard it
+		uv_read_start(reinterpret_cast<uv_stream_t*>(&generator->debugPipe_),
+			[](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+				static char discarded[65536];
+				*buf = uv_buf_init(discarded, sizeof(discarded));
+			},
+			[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+				if (nread < 0)
+					uv_read_stop(stream);
+			}
+		);
+		static char command[] = "DEBUG_CMD:RESTART_BACKENDS\n";
+		static uv_write_t writeReq;
+		uv_buf_t buf = uv_buf_init(command, unsigned(strlen(command)));
+		uv_write(&writeReq, reinterpret_cast<uv_stream_t*>(&generator->debugPipe_), &buf, 1, nullptr);
+		printf("restarting the backend after %llu ms\n", (unsigned long long)generator->restartAfter_);
+	});
+}
+
+void LoadGenerator::checkStall() {
+	if (uv_now(uv_default_loop()) - lastReplyTime_ > stallTimeout) {
+		fprintf(stderr, "No reply from the launcher for %llu ms, it's stuck\n", (unsigned long long)stallTimeout);
+		aborted_ = true;
+		finish();
+	}
+}
+
+void LoadGenerator::finish() {
+	uv_timer_stop(&connectTimer_);
+	uv_close(reinterpret_cast<uv_handle_t*>(&connectTimer_), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&stallTimer_), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&restartTimer_), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&debugPipe_), nullptr);
+	for (auto client : clients_) {
+		uv_close(reinterpret_cast<uv_handle_t*>(&client->pipe_), [](uv_handle_t* handle) {
+			delete reinterpret_cast<LoadClient*>(handle->data);
+		});
+	}
+	clients_.clear();
+	// the backends exit when their stdin is closed with the launcher
+	if (uv_is_active(reinterpret_cast<uv_handle_t*>(&launcherProcess_))) {
+		uv_process_kill(&launcherProcess_, SIGTERM);
+	}
+}
+
+void LoadGenerator::report() {
+	uint64_t endTime = uv_hrtime();
+	uint64_t requests = latency_.count();
+	printf("clients: %d, requests: %llu, failed: %u\n", clientCount_, (unsigned long long)requests, failedRequests_);
+	if (activatedClients_ == clientCount_ + backgroundCount_) {
+		printf("time to start the launcher and activate all clients: %.1f ms\n", (activatedTime_ - launchTime_) / 1000000.0);
+	}
+	if (requests > 0) {
+		printf("throughput: %.1f requests/s, %.1f key strokes/s\n", requests * 1000000000.0 / (endTime - startTime_),
+			double(clientCount_) * keysPerClient_ * 1000000000.0 / (endTime - startTime_));
+		printf("latency (ms): p50: %.3f, p90: %.3f, p99: %.3f, p99.9: %.3f, max: %.3f\n",
+			latency_.percentile(50) / 1000.0,
+			latency_.percentile(90) / 1000.0,
+			latency_.percentile(99) / 1000.0,
+			latency_.percentile(99.9) / 1000.0,
+			latency_.max() / 1000.0);
+	}
+	if (backgroundLatency_.count() > 0) {
+		printf("background clients: %d, requests: %llu, latency (ms): p50: %.3f, p99: %.3f, max: %.3f\n",
+			backgroundCount_,
+			(unsigned long long)backgroundLatency_.count(),
+			backgroundLatency_.percentile(50) / 1000.0,
+			backgroundLatency_.percentile(99) / 1000.0,
+			backgroundLatency_.max() / 1000.0);
+	}
+}
+
+int LoadGenerator::exec() {
+	if (!initPimeDir()) {
+		fprintf(stderr, "Fail to create the PIME dir in /tmp\n");
+		return 1;
+	}
+	if (!startLauncher())
+		return 1;
+
+	keyStates_ = Json::Value(Json::arrayValue);
+	for (int i = 0; i < 256; ++i) {
+		keyStates_.append(0);
+	}
+	for (int i = 0; i < clientCount_ + backgroundCount_; ++i) {
+		auto client = new LoadClient(this, i >= clientCount_);
+		uv_pipe_init(uv_default_loop(), &client->pipe_, 0);
+		client->pipe_.data = client;
+		client->connectReq_.data = nullptr;
+		clients_.push_back(client);
+	}
+
+	uv_timer_init(uv_default_loop(), &connectTimer_);
+	connectTimer_.data = this;
+	connectStartTime_ = uv_now(uv_default_loop());
+	uv_timer_start(&connectTimer_, [](uv_timer_t* timer) {
+		reinterpret_cast<LoadGenerator*>(timer->data)->connectClients();
+	}, connectRetryInterval, connectRetryInterval);
+
+	lastReplyTime_ = connectStartTime_;
+	uv_timer_init(uv_default_loop(), &stallTimer_);
+	stallTimer_.data = this;
+	uv_timer_start(&stallTimer_, [](uv_timer_t* timer) {
+		reinterpret_cast<LoadGenerator*>(timer->data)->checkStall();
+	}, 1000, 1000);
+	uv_timer_init(uv_default_loop(), &restartTimer_);
+	restartTimer_.data = this;
+	uv_pipe_init(uv_default_loop(), &debugPipe_, 0);
+	debugPipe_.data = this;
+
+	uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+	report();
+
+	// remove the temporary dir, without following the symlinks to the source tree
+	nftw(pimeDir_.c_str(), [](const char* path, const struct stat* st, int type, struct FTW* ftw) {
+		return remove(path);
+	}, 16, FTW_DEPTH | FTW_PHYS);
+	if (aborted_ || finishedClients_ < clientCount_)
+		return 1;
+	// the requests lost with the restarted processes fail
+	return (latency_.count() > 0 && (failedRequests_ == 0 || restartAfter_ > 0)) ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+	signal(SIGPIPE, SIG_IGN);
+	LoadGenerator generator;
+	if (!generator.parseArgs(argc, argv)) {
+		fprintf(stderr, "Usage: %s <PIMELauncher executable> [--clients n] [--keys n] [--background n] [--guid guid] [--workers n] [--threaded] [--max-in-flight n] [--framing text|binary] [--python path] [--no-fused] [--loop-queue-size n] [--restart-after ms] [--key-delay ms] [--filter-timeout ms]\n", argv[0]);
+		return 1;
+	}
+	return generator.exec();
+}
@@ -0,0 +1,162 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#include "NamedPipeTransport.h"
+#include <Lmcons.h> // for UNLEN
+#include <cstring>
+#include <codecvt>  // for utf8 conversion
+#include <locale>  // for wstring_convert
+
+#include "../libIME/WindowsVersion.h"
+
+using namespace std;
+
+namespace PIME {
+
+static wstring_convert<codecvt_utf8<wchar_t>> utf8Codec;
+
+Transport* createDefaultTransport() {
+	return new NamedPipeTransport();
+}
+
+NamedPipeTransport::NamedPipeTransport() :
+	securittyDescriptor_(nullptr),
+	acl_(nullptr),
+	everyoneSID_(nullptr),
+	allAppsSID_(nullptr) {
+}
+
+NamedPipeTransport::~NamedPipeTransport() {
+	if (everyoneSID_ != nullptr)
+		FreeSid(everyoneSID_);
+	if (allAppsSID_ != nullptr)
+		FreeSid(allAppsSID_);
+	if (securittyDescriptor_ != nullptr)
+		LocalFree(securittyDescriptor_);
+	if (acl_ != nullptr)
+		LocalFree(acl_);
+}
+
+string NamedPipeTransport::getPipeName(const char* base_name) {
+	string pipe_name;
+	char username[UNLEN + 1];
+	DWORD unlen = UNLEN + 1;
+	if (GetUserNameA(username, &unlen)) {
+		// add username to the pipe path so it will not clash with other users' pipes.
+		pipe_name = "\\\\.\\pipe\\";
+		pipe_name += username;
+		pipe_name += "\\PIME\\";
+		pipe_name += base_name;
+	}
+	return pipe_name;
+}
+
+void NamedPipeTransport::initSecurityAttributes() {
+	// create security attributes for the pipe
+	// http://msdn.microsoft.com/en-us/library/windows/desktop/hh448449(v=vs.85).aspx
+	// define new Win 8 app related constants
+	memset(&explicitAccesses_, 0, sizeof(explicitAccesses_));
+	// Create a well-known SID for the Everyone group.
+	// FIXME: we should limit the access to current user only
+	// See this article for details: https://msdn.microsoft.com/en-us/library/windows/desktop/hh448493(v=vs.85).aspx
+
+	SID_IDENTIFIER_AUTHORITY worldSidAuthority = SECURITY_WORLD_SID_AUTHORITY;
+	AllocateAndInitializeSid(&worldSidAuthority, 1,
+		SECURITY_WORLD_RID, 0, 0, 0, 0, 0, 0, 0, &everyoneSID_);
+
+	// https://services.land.vic.gov.au/ArcGIS10.1/edESRIArcGIS10_01_01_3143/Python/pywin32/PLATLIB/win32/Demos/security/explicit_entries.py
+
+	explicitAccesses_[0].grfAccessPermissions = GENERIC_ALL;
+	explicitAccesses_[0].grfAccessMode = SET_ACCESS;
+	explicitAccesses_[0].grfInheritance = SUB_CONTAINERS_AND_OBJECTS_INHERIT;
+	explicitAccesses_[0].Trustee.pMultipleTrustee = NULL;
+	explicitAccesses_[0].Trustee.MultipleTrusteeOperation = NO_MULTIPLE_TRUSTEE;
+	explicitAccesses_[0].Trustee.TrusteeForm = TRUSTEE_IS_SID;
+	explicitAccesses_[0].Trustee.TrusteeType = TRUSTEE_IS_WELL_KNOWN_GROUP;
+	explicitAccesses_[0].Trustee.ptstrName = (LPTSTR)everyoneSID_;
+
+	// FIXME: will this work under Windows 7 and Vista?
+	// create SID for app containers
+	SID_IDENTIFIER_AUTHORITY appPackageAuthority = SECURITY_APP_PACKAGE_AUTHORITY;
+	AllocateAndInitializeSid(&appPackageAuthority,
+		SECURITY_BUILTIN_APP_PACKAGE_RID_COUNT,
+		SECURITY_APP_PACKAGE_BASE_RID,
+		SECURITY_BUILTIN_PACKAGE_ANY_PACKAGE,
+		0, 0, 0, 0, 0, 0, &allAppsSID_);
+
+	explicitAccesses_[1].grfAccessPermissions = GENERIC_ALL;
+	explicitAccesses_[1].grfAccessMode = SET_ACCESS;
+	explicitAccesses_[1].grfInheritance = SUB_CONTAINERS_AND_OBJECTS_INHERIT;
+	explicitAccesses_[1].Trustee.pMultipleTrustee = NULL;
+	explicitAccesses_[1].Trustee.MultipleTrusteeOperation = NO_MULTIPLE_TRUSTEE;
+	explicitAccesses_[1].Trustee.TrusteeForm = TRUSTEE_IS_SID;
+	explicitAccesses_[1].Trustee.TrusteeType = TRUSTEE_IS_GROUP;
+	explicitAccesses_[1].Trustee.ptstrName = (LPTSTR)allAppsSID_;
+
+	// create DACL
+	DWORD err = SetEntriesInAcl(2, explicitAccesses_, NULL, &acl_);
+	if (0 == err) {
+		// security descriptor
+		securittyDescriptor_ = (PSECURITY_DESCRIPTOR)LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
+		InitializeSecurityDescriptor(securittyDescriptor_, SECURITY_DESCRIPTOR_REVISION);
+
+		// Add the ACL to the security descriptor. 
+		SetSecurityDescriptorDacl(securittyDescriptor_, TRUE, acl_, FALSE);
+	}
+
+	securityAttributes_.nLength = sizeof(SECURITY_ATTRIBUTES);
+	securityAttributes_.lpSecurityDescriptor = securittyDescriptor_;
+	securityAttributes_.bInheritHandle = TRUE;
+}
+
+// References:
+// https://msdn.microsoft.com/en-us/library/windows/desktop/aa365588(v=vs.85).aspx
+int NamedPipeTransport::listen(uv_loop_t* loop, uv_pipe_t* server, const char* name, bool allowAppContainers) {
+	SECURITY_ATTRIBUTES* sa = nullptr;
+	if (allowAppContainers && Ime::WindowsVersion().isWindows8Above()) {
+		// Setting special security attributes to the named pipe is only needed 
+		// for Windows >= 8 since older versions do not have app containers (metro apps) 
+		// in which connecting to pipes are blocked by default permission settings.
+		if (securittyDescriptor_ == nullptr) {
+			initSecurityAttributes();
+		}
+		sa = &securityAttributes_;
+	}
+
+	wchar_t username[UNLEN + 1];
+	DWORD unlen = UNLEN + 1;
+	if (!GetUserNameW(username, &unlen))
+		return UV_EINVAL;
+	// add username to the pipe path so it will not clash with other users' pipes.
+	char pipe_name[MAX_PATH];
+	std::string utf8_username = utf8Codec.to_bytes(username, username + unlen);
+	sprintf(pipe_name, "\\\\.\\pipe\\%s\\PIME\\%s", utf8_username.c_str(), name);
+	// create the pipe
+	uv_pipe_init_windows_named_pipe(loop, server, 0, PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, sa);
+	return uv_pipe_bind(server, pipe_name);
+}
+
+int NamedPipeTransport::accept(uv_pipe_t* server, uv_pipe_t* client) {
+	uv_pipe_init_windows_named_pipe(server->loop, client, 0, server->pipe_mode, server->security_attributes);
+	uv_stream_set_blocking((uv_stream_t*)client, 0);
+	return uv_accept((uv_stream_t*)server, (uv_stream_t*)client);
+}
+
+} // namespace PIME
@@ -0,0 +1,63 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_NAMED_PIPE_TRANSPORT_H_
+#define _PIME_NAMED_PIPE_TRANSPORT_H_
+
+#include <Windows.h>
+#include <Winnt.h> // for security attributes constants
+#include <aclapi.h> // for ACL
+#include <string>
+
+#include "Transport.h"
+
+namespace PIME {
+
+// Windows named pipes in message mode: \\.\pipe\<username>\PIME\<name>
+class NamedPipeTransport : public Transport {
+public:
+	NamedPipeTransport();
+	virtual ~NamedPipeTransport();
+
+	virtual int listen(uv_loop_t* loop, uv_pipe_t* server, const char* name, bool allowAppContainers);
+	virtual int accept(uv_pipe_t* server, uv_pipe_t* client);
+
+	virtual bool preservesMessageBoundaries() const {
+		return true;
+	}
+
+	static std::string getPipeName(const char* base_name);
+
+private:
+	void initSecurityAttributes();
+
+private:
+	// security attribute stuff for creating the server pipe
+	PSECURITY_DESCRIPTOR securittyDescriptor_;
+	SECURITY_ATTRIBUTES securityAttributes_;
+	PACL acl_;
+	EXPLICIT_ACCESS explicitAccesses_[2];
+	PSID everyoneSID_;
+	PSID allAppsSID_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_NAMED_PIPE_TRANSPORT_H_
@@ -199,6 +199,15 @@ BOOL DebugConsole::dialogWndProc(HWND hwnd, UINT msg, WPARAM wp, LPARAM lp) {
 		case IDC_RESTART_BACKENDS:
 			sendCommand("DEBUG_CMD:RESTART_BACKENDS\n");
 			break;
+		case IDC_BACKEND_STATUS:
+			sendCommand("DEBUG_CMD:BACKEND_STATUS\n");
+			break;
+		case IDC_STATS:
+			sendCommand("DEBUG_CMD:STATS\n");
+			break;
+		case IDC_TRACE:
+			sendCommand("DEBUG_CMD:TRACE\n");
+			break;
 		}
 		break;
 	case WM_CLOSE:
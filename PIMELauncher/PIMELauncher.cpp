@@ -17,14 +17,28 @@
 //	Boston, MA  02110-1301, USA.
 //
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <csignal>
+#endif
 #include "PipeServer.h"
 
+#ifdef _WIN32
 int WINAPI WinMain(HINSTANCE hinst, HINSTANCE hprev, LPSTR cmd, int show) {
 	// Disable all Windows error reporting message boxes since
 	// this will block user input. We want to handle the errors silently.
 	::SetErrorMode(SEM_NOOPENFILEERRORBOX|SEM_FAILCRITICALERRORS|SEM_NOGPFAULTERRORBOX|SEM_NOALIGNMENTFAULTEXCEPT);
 
 	PIME::PipeServer server;
-	return server.exec(cmd);
+	return server.exec();
 }
+#else
+int main(int argc, char** argv) {
+	// write errors of closed client connections are handled by libuv
+	signal(SIGPIPE, SIG_IGN);
+
+	PIME::PipeServer server;
+	return server.exec();
+}
+#endif
@@ -18,12 +18,17 @@
 //
 
 #include "PipeServer.h"
+#ifdef _WIN32
 #include <Windows.h>
 #include <ShlObj.h>
 #include <Shellapi.h>
-#include <Lmcons.h> // for UNLEN
+#include "NamedPipeTransport.h"
+#else
+#include <sys/stat.h>
+#endif
 #include <iostream>
 #include <cstring>
+#include <cctype>
 #include <cassert>
 #include <string>
 #include <vector>
@@ -37,8 +42,9 @@
 #include <json/json.h>
 
 #include "BackendServer.h"
+#include "TraceRecorder.h"
 #include "Utils.h"
-#include "../libIME/WindowsVersion.h"
+#include "InputMethodIndex.h"
 
 using namespace std;
 
@@ -48,32 +54,64 @@ namespace PIME {
 
 PipeServer* PipeServer::singleton_ = nullptr;
 
+// max size of the recent debug messages we keep for the debug console
+static const size_t debugHistorySize = 256 * 1024;
+
+// if the backend process dies again within this period after replaying the session
+// of a client, the client is probably the cause, so disconnect it instead (in ms).
+static const uint64_t minSessionReplayInterval = 10000;
+
+// the heap of request deadlines is compacted when it has twice as many entries as the
+// clients plus this many, so answered requests do not pile up in it
+static const size_t minDeadlinesToCompact = 1024;
+
+// interval of checking for idle backends (in ms)
+static const uint64_t reapInterval = 10000;
+
+// when the system is low on memory, stop the least recently used backend
+// which is not used for at least this long (in ms).
+static const uint64_t minLowMemoryIdleTime = 60000;
+
+// editors often write a file several times when saving it, so wait until
+// the config files stop changing for a while before reloading them (in ms).
+static const uint64_t configReloadDelay = 500;
+
+// interval of writing the recorded trace events to the trace file (in ms)
+static const uint64_t traceFlushInterval = 200;
+
 
 ClientInfo::ClientInfo(PipeServer* server) :
-	backend_(nullptr), server_{ server } {
+	backend_(nullptr),
+	worker_(nullptr),
+	handle_{ ClientTable::invalidHandle },
+	pendingSeqNum_{ 0 },
+	requestDeadline_{ 0 },
+	lateReplies_{ 0 },
+	requestStartTime_{ 0 },
+	requestLatency_{ nullptr },
+	lastReplayTime_{ 0 },
+	sessionLost_{ false },
+	fusedKeyEvents_{ false },
+	server_{ server } {
 }
 
 bool ClientInfo::isInitialized() const {
 	return (!clientId_.empty() && backend_ != nullptr);
 }
 
-bool ClientInfo::init(const Json::Value & params) {
-	const char* method = params["method"].asCString();
-	if (method != nullptr) {
-		if (strcmp(method, "init") == 0) {  // the client connects to us the first time
-			// generate a new uuid for client ID
-			UUID uuid;
-			UuidCreate(&uuid);
-			RPC_CSTR uuid_str = nullptr;
-			UuidToStringA(&uuid, &uuid_str);
-			clientId_ = (char*)uuid_str;
-			RpcStringFreeA(&uuid_str);
+bool ClientInfo::init(const JsonField& method, const JsonField& id) {
+	if (method.isString()) {
+		if (method.equals("init")) {  // the client connects to us the first time
+			// use the handle in the routing table as client ID
+			char handle_str[ClientTable::maxHandleStrLen + 1];
+			clientId_.assign(handle_str, ClientTable::formatHandle(handle_, handle_str));
 
 			// find a backend for the client text service
-			const char* guid = params["id"].asCString();
-			backend_ = server_->backendFromLangProfileGuid(guid);
+			backend_ = server_->backendFromLangProfileGuid(id.asString().c_str());
 			if (backend_ != nullptr) {
-				// FIXME: write some response to indicate the failure
+				// pin the client to one of the worker processes of the backend
+				worker_ = backend_->workerForClient(this);
+				backend_->attachClient();
 				return true;
 			}
 		}
@@ -83,12 +121,18 @@ bool ClientInfo::init(const Json::Value & params) {
 
 
 PipeServer::PipeServer() :
-	securittyDescriptor_(nullptr),
-	acl_(nullptr),
-	everyoneSID_(nullptr),
-	allAppsSID_(nullptr),
+	transport_(createDefaultTransport()),
 	quitExistingLauncher_(false),
-	debugClientPipe_{ nullptr } {
+	debugClientPipe_{ nullptr },
+	debugHistory_{ debugHistorySize },
+	debugCursor_{ 0 },
+	debugWriteReq_{},
+	debugWriteLen_{ 0 },
+	reloadBackends_{ false } {
+#ifdef _WIN32
+	lowMemoryNotification_ = nullptr;
+#endif
+	debugWriteReq_.data = this;
 	// this can only be assigned once
 	assert(singleton_ == nullptr);
 	singleton_ = this;
@@ -96,21 +140,18 @@ PipeServer::PipeServer() :
 
 PipeServer::~PipeServer() {
 	closeDebugClient();
+	TraceRecorder::stop();
 
-	if (everyoneSID_ != nullptr)
-		FreeSid(everyoneSID_);
-	if (allAppsSID_ != nullptr)
-		FreeSid(allAppsSID_);
-	if (securittyDescriptor_ != nullptr)
-		LocalFree(securittyDescriptor_);
-	if (acl_ != nullptr)
-		LocalFree(acl_);
+#ifdef _WIN32
+	if (lowMemoryNotification_ != nullptr)
+		CloseHandle(lowMemoryNotification_);
+#endif
 }
 
 void PipeServer::initBackendServers(const std::wstring & topDirPath) {
 	// load known backend implementations
 	Json::Value backends;
-	if (loadJsonFile(topDirPath + L"\\backends.json", backends)) {
+	if (loadJsonFile(joinPath(topDirPath, L"backends.json"), backends)) {
 		if (backends.isArray()) {
 			for (auto it = backends.begin(); it != backends.end(); ++it) {
 				auto& backendInfo = *it;
@@ -124,39 +165,228 @@ void PipeServer::initBackendServers(const std::wstring & topDirPath) {
 	initInputMethods(topDirPath);
 }
 
+// the per-user dir for the files written by the launcher, or an empty string if it's unavailable.
+// the launcher is usually installed in a read-only dir.
+static std::wstring userDataDir() {
+	std::wstring dir;
+#ifdef _WIN32
+	wchar_t appDataDir[MAX_PATH];
+	if (SUCCEEDED(::SHGetFolderPathW(NULL, CSIDL_LOCAL_APPDATA, NULL, 0, appDataDir))) {
+		dir = appDataDir;
+		dir += L"\\PIME";
+		::CreateDirectoryW(dir.c_str(), nullptr);
+	}
+#else
+	string cacheDir;
+	if (const char* xdgCacheHome = getenv("XDG_CACHE_HOME"))
+		cacheDir = xdgCacheHome;
+	else if (const char* home = getenv("HOME"))
+		cacheDir = string(home) + "/.cache";
+	if (!cacheDir.empty()) {
+		cacheDir += "/PIME";
+		mkdir(cacheDir.c_str(), 0700);
+		dir = utf8Codec.from_bytes(cacheDir);
+	}
+#endif
+	return dir;
+}
+
 void PipeServer::initInputMethods(const std::wstring& topDirPath) {
+	uint64_t startTime = uv_hrtime();
+	// the index is saved per user
+	std::wstring indexFile = userDataDir();
+	if (!indexFile.empty()) {
+		indexFile = joinPath(indexFile, L"launcher_ime_index.bin");
+	}
+	InputMethodIndex index;
+	if (!indexFile.empty()) {
+		index.load(indexFile);
+	}
+
 	// maps language profiles to backend names
+	// NOTE: the map is built separately and swapped in at once when reloading,
+	// so new clients never see a partially updated map.
+	std::unordered_map<std::string, BackendServer*> backendMap;
+	size_t inputMethodCount = 0;
 	for (BackendServer* backend : backends_) {
-		std::wstring dirPath = topDirPath + L"\\" + utf8Codec.from_bytes(backend->name_) + L"\\input_methods";
-		// scan the dir for lang profile definition files (ime.json)
-		WIN32_FIND_DATA findData = { 0 };
-		HANDLE hFind = ::FindFirstFile((dirPath + L"\\*").c_str(), &findData);
-		if (hFind != INVALID_HANDLE_VALUE) {
-			do {
-				if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) { // this is a subdir
-					if (findData.cFileName[0] != '.') {
-						std::wstring imejson = dirPath;
-						imejson += '\\';
-						imejson += findData.cFileName;
-						imejson += L"\\ime.json";
-						// Make sure the file exists
-						DWORD fileAttrib = GetFileAttributesW(imejson.c_str());
-						if (fileAttrib != INVALID_FILE_ATTRIBUTES) {
-							// load the json file to get the info of input method
-							Json::Value json;
-							if (loadJsonFile(imejson, json)) {
-								std::string guid = json["guid"].asString();
-								transform(guid.begin(), guid.end(), guid.begin(), tolower);  // convert GUID to lwoer case
-																							 // map text service GUID to its backend server
-								backendMap_.insert(std::make_pair(guid, backendFromName(backend->name_.c_str())));
-							}
-						}
-					}
-				}
-			} while (::FindNextFile(hFind, &findData));
-			::FindClose(hFind);
+		std::wstring dirPath = joinPath(joinPath(topDirPath, utf8Codec.from_bytes(backend->name_)), L"input_methods");
+		// only the changed ime.json files are parsed
+		for (auto& guid : index.scanDir(dirPath)) {
+			// map text service GUID to its backend server
+			backendMap.insert(std::make_pair(guid, backendFromName(backend->name_.c_str())));
+			++inputMethodCount;
 		}
 	}
+	backendMap_.swap(backendMap);
+
+	if (!indexFile.empty()) {
+		index.save(indexFile);
+	}
+	char msg[128];
+	snprintf(msg, sizeof(msg), "Loaded %u input methods in %.2f ms (%u parsed, %u from the index)\n",
+		unsigned(inputMethodCount),
+		(uv_hrtime() - startTime) / 1000000.0,
+		unsigned(index.parsedCount()),
+		unsigned(index.cachedCount()));
+	outputDebugMessage(msg, strlen(msg));
+}
+
+void PipeServer::watchConfigFiles() {
+	// the dir is watched instead of the file since editors might replace the file when saving it
+	uv_fs_event_init(uv_default_loop(), &configWatcher_);
+	configWatcher_.data = this;
+	uv_fs_event_start(&configWatcher_, [](uv_fs_event_t* handle, const char* filename, int events, int status) {
+		if (status == 0 && filename != nullptr && _stricmp(filename, "backends.json") == 0) {
+			reinterpret_cast<PipeServer*>(handle->data)->scheduleReload(true);
+		}
+	}, utf8Codec.to_bytes(topDirPath_).c_str(), 0);
+
+	uv_timer_init(uv_default_loop(), &reloadTimer_);
+	reloadTimer_.data = this;
+
+	watchInputMethodDirs();
+}
+
+void PipeServer::watchInputMethodDirs() {
+	for (auto watcher : inputMethodWatchers_) {
+		uv_close(reinterpret_cast<uv_handle_t*>(watcher), [](uv_handle_t* handle) {
+			delete reinterpret_cast<uv_fs_event_t*>(handle);
+		});
+	}
+	inputMethodWatchers_.clear();
+
+	for (BackendServer* backend : backends_) {
+		std::string dirPath = utf8Codec.to_bytes(joinPath(joinPath(topDirPath_, utf8Codec.from_bytes(backend->name_)), L"input_methods"));
+		bool watched = watchInputMethodDir(dirPath, UV_FS_EVENT_RECURSIVE, [](uv_fs_event_t* handle, const char* filename, int events, int status) {
+			if (status != 0)
+				return;
+			// only care about input methods being added, removed, or their ime.json being changed.
+			// the input method dirs also contain other files, such as python caches, which change often.
+			if (filename != nullptr && strchr(filename, char(pathSeparator)) != nullptr) {
+				size_t len = strlen(filename);
+				const char suffix[] = { char(pathSeparator), 'i', 'm', 'e', '.', 'j', 's', 'o', 'n', '\0' };
+				if (len < sizeof(suffix) - 1 || _stricmp(filename + len - (sizeof(suffix) - 1), suffix) != 0)
+					return;
+			}
+			reinterpret_cast<PipeServer*>(handle->data)->scheduleReload(false);
+		});
+		if (!watched)  // the backend has no input methods dir
+			continue;
+#if !defined(_WIN32) && !defined(__APPLE__)
+		// UV_FS_EVENT_RECURSIVE is only supported on Windows and macOS. inotify only reports
+		// the entries of the watched dir itself, so the dir of every input method is watched too.
+		uv_fs_t req;
+		if (uv_fs_scandir(uv_default_loop(), &req, dirPath.c_str(), 0, nullptr) >= 0) {
+			uv_dirent_t entry;
+			while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+				if (entry.type != UV_DIRENT_DIR)
+					continue;
+				watchInputMethodDir(dirPath + char(pathSeparator) + entry.name, 0, [](uv_fs_event_t* handle, const char* filename, int events, int status) {
+					if (status == 0 && filename != nullptr && _stricmp(filename, "ime.json") == 0)
+						reinterpret_cast<PipeServer*>(handle->data)->scheduleReload(false);
+				});
+			}
+		}
+		uv_fs_req_cleanup(&req);
+#endif
+	}
+}
+
+bool PipeServer::watchInputMethodDir(const std::string& dirPath, unsigned int flags, uv_fs_event_cb callback) {
+	auto watcher = new uv_fs_event_t{};
+	uv_fs_event_init(uv_default_loop(), watcher);
+	watcher->data = this;
+	if (uv_fs_event_start(watcher, callback, dirPath.c_str(), flags) < 0) {
+		uv_close(reinterpret_cast<uv_handle_t*>(watcher), [](uv_handle_t* handle) {
+			delete reinterpret_cast<uv_fs_event_t*>(handle);
+		});
+		return false;
+	}
+	inputMethodWatchers_.push_back(watcher);
+	return true;
+}
+
+void PipeServer::scheduleReload(bool reloadBackends) {
+	if (reloadBackends) {
+		reloadBackends_ = true;
+	}
+	// restart the timer on every change
+	uv_timer_start(&reloadTimer_, [](uv_timer_t* timer) {
+		auto _this = reinterpret_cast<PipeServer*>(timer->data);
+		if (_this->reloadBackends_) {
+			_this->reloadBackends_ = false;
+			_this->reloadBackendServers();
+		}
+		else {
+			_this->initInputMethods(_this->topDirPath_);
+#if !defined(_WIN32) && !defined(__APPLE__)
+			// watch the dirs of the added input methods
+			_this->watchInputMethodDirs();
+#endif
+		}
+	}, configReloadDelay, 0);
+}
+
+void PipeServer::reloadBackendServers() {
+	Json::Value backends;
+	if (!loadJsonFile(joinPath(topDirPath_, L"backends.json"), backends) || !backends.isArray()) {
+		// the file is probably broken while being edited, keep using the current config.
+		const char msg[] = "\nFail to reload backends.json\n";
+		outputDebugMessage(msg, strlen(msg));
+		return;
+	}
+
+	// keep the backends whose definitions are not changed, with their processes and clients.
+	std::vector<BackendServer*> newBackends;
+	std::vector<BackendServer*> addedBackends;
+	for (auto it = backends.begin(); it != backends.end(); ++it) {
+		auto& backendInfo = *it;
+		auto old = find_if(backends_.begin(), backends_.end(), [&backendInfo](BackendServer* backend) {
+			return backend != nullptr && backend->info() == backendInfo;
+		});
+		if (old != backends_.end()) {
+			newBackends.push_back(*old);
+			*old = nullptr;  // mark it as reused
+		}
+		else {
+			BackendServer* backend = new BackendServer(this, backendInfo);
+			newBackends.push_back(backend);
+			addedBackends.push_back(backend);
+		}
+	}
+
+	// the remaining ones are changed or removed
+	for (BackendServer* backend : backends_) {
+		if (backend != nullptr) {
+			string msg = "\nStop backend: " + backend->name_ + "\n";
+			outputDebugMessage(msg.c_str(), msg.length());
+			retireBackend(backend);
+		}
+	}
+	backends_.swap(newBackends);
+
+	for (BackendServer* backend : addedBackends) {
+		string msg = "\nLoad backend: " + backend->name_ + "\n";
+		outputDebugMessage(msg.c_str(), msg.length());
+		backend->startLoopThread();
+		if (backend->eagerStart()) {
+			backend->startProcess();
+		}
+	}
+
+	// a backend might be renamed, so its input methods are mapped to another one now
+	initInputMethods(topDirPath_);
+	watchInputMethodDirs();
+}
+
+void PipeServer::retireBackend(BackendServer* backend) {
+	// disconnect the clients of the backend. they will reconnect and use the new config.
+	clients_.forEach([this, backend](ClientInfo* client) {
+		if (client->backend_ == backend) {
+			disconnectClient(client);
+		}
+	});
+	delete backend;
 }
 
 void PipeServer::finalizeBackendServers() {
@@ -176,21 +406,114 @@ BackendServer* PipeServer::backendFromName(const char* name) {
 	return nullptr;
 }
 
-void PipeServer::onBackendClosed(BackendServer * backend) {
-	// the backend server is terminated, disconnect all clients using this backend
-	auto removed_it = std::remove_if(clients_.begin(), clients_.end(),
-		[backend](ClientInfo* client) {
-		if (client->backend_ == backend) {
-			// if the client is using this broken backend, disconnect it
-			uv_close((uv_handle_t*)&client->pipe_, [](uv_handle_t* handle) {
-				auto client = (ClientInfo*)handle->data;
-				delete client;
-			});
-			return true;
+void PipeServer::onBackendClosed(BackendWorker * worker) {
+	// the backend worker process is terminated. instead of disconnecting the clients served by it,
+	// which makes every app reconnect at the same time, replay their sessions to the restarted
+	// process so the apps don't notice.
+	// clients of the other workers of the same backend are not affected.
+	uint64_t now = uv_now(uv_default_loop());
+	bool suspended = worker->backend_->isSuspended();
+	clients_.forEach([this, worker, suspended, now](ClientInfo* client) {
+		if (client->worker_ != worker)
+			return;
+		if (client->initMessage_.empty() ||
+			(!suspended && client->lastReplayTime_ != 0 && now - client->lastReplayTime_ < minSessionReplayInterval)) {
+			// the client cannot be restored, or it probably crashes the backend. disconnect it.
+			disconnectClient(client);
+			return;
+		}
+
+		// replies from the dead process are all delivered before we get here
+		client->lateReplies_ = 0;
+		if (client->requestDeadline_ != 0) {
+			// the pending request is lost with the process
+			client->requestDeadline_ = 0;
+			client->requestStartTime_ = 0;
+			sendFailureReply(client, client->pendingSeqNum_);
+		}
+
+		if (suspended) {
+			// the process is stopped to free memory, don't start it until the client needs it.
+			client->sessionLost_ = true;
+		}
+		else {
+			replayClientSession(client);
 		}
-		return false;
 	});
-	clients_.erase(removed_it, clients_.cend());
+}
+
+// keep a copy of a message with "replay":true added, so the backend knows that the
+// client won't get the reply to it when the session is replayed.
+static void setReplayMessage(string& replayMessage, const char* msg, size_t len) {
+	const char* end = msg + len;
+	const char* p = msg;
+	while (p < end && isspace((unsigned char)*p))
+		++p;
+	if (p == end || *p != '{') {  // not a json object, replay it as is
+		replayMessage.assign(msg, len);
+		return;
+	}
+	++p;
+	const char* field = "\"replay\":true";
+	replayMessage.assign(msg, p);
+	replayMessage += field;
+	while (p < end && isspace((unsigned char)*p))
+		++p;
+	if (p < end && *p != '}')
+		replayMessage += ',';
+	replayMessage.append(p, end);
+}
+
+void PipeServer::replayClientSession(ClientInfo* client) {
+	client->lastReplayTime_ = uv_now(uv_default_loop());
+	client->sessionLost_ = false;
+	TraceRecorder::record("replay session", TraceRecorder::INSTANT, client->handle_);
+
+	// the client already got the replies to these messages, so drop the new ones.
+	// the process is started again if needed, and the requests sent by the client
+	// after this are queued after the replayed messages until it's ready.
+	client->lateReplies_ += 1;
+	client->backend_->handleClientMessage(client, client->initMessage_.c_str(), client->initMessage_.length());
+	if (!client->activateMessage_.empty()) {
+		client->lateReplies_ += 1;
+		client->backend_->handleClientMessage(client, client->activateMessage_.c_str(), client->activateMessage_.length());
+	}
+	string msg = "\nReplay the session of client " + client->clientId_ + "\n";
+	outputDebugMessage(msg.c_str(), msg.length());
+}
+
+void PipeServer::reapBackends() {
+	uint64_t now = uv_now(uv_default_loop());
+	for (auto backend : backends_) {
+		if (backend->idleTimeout() != 0 && backend->clientCount() == 0 &&
+			!backend->isSuspended() && backend->isProcessRunning() &&
+			now - backend->lastActiveTime() >= backend->idleTimeout()) {
+			string msg = "\nStop idle backend: " + backend->name_ + "\n";
+			outputDebugMessage(msg.c_str(), msg.length());
+			backend->suspend();
+		}
+	}
+
+#ifdef _WIN32
+	BOOL lowMemory = FALSE;
+	if (lowMemoryNotification_ != nullptr && QueryMemoryResourceNotification(lowMemoryNotification_, &lowMemory) && lowMemory) {
+		// stop the least recently used backend, even if it has clients.
+		// only one of them is stopped at a time, the next one is stopped later if it's not enough.
+		BackendServer* lruBackend = nullptr;
+		for (auto backend : backends_) {
+			if (!backend->isSuspended() && backend->isProcessRunning() &&
+				now - backend->lastActiveTime() >= minLowMemoryIdleTime &&
+				(lruBackend == nullptr || backend->lastActiveTime() < lruBackend->lastActiveTime())) {
+				lruBackend = backend;
+			}
+		}
+		if (lruBackend != nullptr) {
+			string msg = "\nLow memory, stop backend: " + lruBackend->name_ + "\n";
+			outputDebugMessage(msg.c_str(), msg.length());
+			lruBackend->suspend();
+		}
+	}
+#endif
 }
 
 BackendServer* PipeServer::backendFromLangProfileGuid(const char* guid) {
@@ -200,21 +523,8 @@ BackendServer* PipeServer::backendFromLangProfileGuid(const char* guid) {
 	return nullptr;
 }
 
-string PipeServer::getPipeName(const char* base_name) {
-	string pipe_name;
-	char username[UNLEN + 1];
-	DWORD unlen = UNLEN + 1;
-	if (GetUserNameA(username, &unlen)) {
-		// add username to the pipe path so it will not clash with other users' pipes.
-		pipe_name = "\\\\.\\pipe\\";
-		pipe_name += username;
-		pipe_name += "\\PIME\\";
-		pipe_name += base_name;
-	}
-	return pipe_name;
-}
-
-void PipeServer::parseCommandLine(LPSTR cmd) {
+void PipeServer::parseCommandLine() {
+#ifdef _WIN32
 	int argc;
 	wchar_t** argv = CommandLineToArgvW(GetCommandLine(), &argc);
 	// parse command line options
@@ -224,168 +534,162 @@ void PipeServer::parseCommandLine(LPSTR cmd) {
 			quitExistingLauncher_ = true;
 	}
 	LocalFree(argv);
+#endif
 }
 
 // send IPC message "quit" to the existing PIME Launcher process.
 void PipeServer::terminateExistingLauncher() {
-	string pipe_name = getPipeName("Launcher");
+#ifdef _WIN32
+	string pipe_name = NamedPipeTransport::getPipeName("Launcher");
 	char buf[16];
 	DWORD rlen;
 	::CallNamedPipeA(pipe_name.c_str(), "quit", 4, buf, sizeof(buf) - 1, &rlen, 1000); // wait for 1 sec.
+#endif
 }
 
 void PipeServer::quit() {
 	finalizeBackendServers();
+#ifdef _WIN32
 	ExitProcess(0); // quit PipeServer
+#else
+	exit(0);
+#endif
 }
 
-void PipeServer::handleBackendReply(const char * readBuf, size_t len) {
-	recentDebugMessages_.emplace_back(readBuf, len);
-	// only keep recent 100 messages
-	if (recentDebugMessages_.size() >= 100) {
-		recentDebugMessages_.pop_front();
-	}
-	// print to debug console if there is any
+void PipeServer::handleBackendOutput(const char * readBuf, size_t len) {
 	outputDebugMessage(readBuf, len);
+}
 
-	// pass the response back to the clients
-	auto line = readBuf;
-	auto buf_end = readBuf + len;
-	while (line < buf_end) {
-		// Format of each line:
-		// PIMG_MSG|<client_id>|<json reply>\n
-		if (auto line_end = strchr(line, '\n')) {
-			// only handle lines prefixed with "PIME_MSG|" since other lines
-			// might be debug messages printed by the backend.
-			if (strncmp(line, "PIME_MSG|", 9) == 0) {
-				line += 9; // Skip the prefix
-				if (auto sep = strchr(line, '|')) {
-					// split the client_id from the remaining json reply
-					string clientId(line, sep - line);
-					auto msg = sep + 1;
-					auto msg_len = line_end - msg;
-					// because Windows uses CRLF "\r\n" for new lines, python and node.js
-					// try to convert "\n" to "\r\n" sometimes. Let's remove the additional '\r'
-					if (msg_len > 0 && msg[msg_len - 1] == '\r') {
-						--msg_len;
-					}
-					// send the reply message back to the client
-					sendReplyToClient(clientId, msg, msg_len);
-				}
+void PipeServer::handleBackendReply(ClientTable::Handle clientHandle, const char* msg, size_t len) {
+	sendReplyToClient(clientHandle, msg, len);
+}
+
+void PipeServer::sendReplyToClient(ClientTable::Handle clientHandle, const char* msg, size_t len) {
+	// find the client with this handle
+	// NOTE: replies to an already closed client are dropped here.
+	if (auto client = clients_.find(clientHandle)) {
+		if (client->lateReplies_ > 0) {
+			// we already sent a failure reply to the client when the request timed out.
+			// the backend handles requests of a client in order, so this is the late one,
+			// unless the backend lost the requests which timed out. the reply of the pending
+			// request is recognized by its seqNum then, and the lost replies are not waited for.
+			JsonField seqNumField{ "seqNum" };
+			uint32_t seqNum;
+			if (client->requestDeadline_ != 0 && JsonFieldScanner::scan(msg, len, &seqNumField, 1) &&
+				seqNumField.asUInt(seqNum) && seqNum == client->pendingSeqNum_) {
+				client->lateReplies_ = 0;
+			}
+			else {
+				--client->lateReplies_;
+				TraceRecorder::record("late reply dropped", TraceRecorder::INSTANT, clientHandle);
+				return;
 			}
-			line = line_end + 1;
 		}
-		else {
-			break;
+		client->requestDeadline_ = 0;
+		if (client->requestStartTime_ != 0 && client->backend_ != nullptr) {
+			uint64_t latency = (uv_hrtime() - client->requestStartTime_) / 1000;
+			client->backend_->recordLatency(client->requestLatency_, latency);
+			client->requestStartTime_ = 0;
 		}
+		writeToClient(client, msg, len);
 	}
 }
 
-void PipeServer::sendReplyToClient(const std::string clientId, const char* msg, size_t len) {
-	// find the client with this ID
-	auto it = std::find_if(clients_.cbegin(), clients_.cend(), [clientId](const ClientInfo* client) {
-		return client->clientId_ == clientId;
-	});
-	if (it != clients_.cend()) {
-		auto client = *it;
-		uv_buf_t buf = {len, (char*)msg};
-		uv_write_t* req = new uv_write_t{};
-		uv_write(req, client->stream(), &buf, 1, [](uv_write_t* req, int status) {
-			delete req;
-		});
+void PipeServer::writeToClient(ClientInfo* client, const char* msg, size_t len) {
+	TraceRecorder::record("request", TraceRecorder::END, client->handle_, client->pendingSeqNum_);
+	// msg might point into the read buffer of the backend output, which is freed after we return.
+	// the write request pool copies it only if it cannot be written immediately.
+	if (transport_->preservesMessageBoundaries()) {
+		writeRequestPool_.write(client->stream(), msg, len);
 	}
+	else {
+		char header[frameHeaderSize];
+		encodeFrameHeader(FrameHeader{ FRAME_REPLY, uint32_t(len), client->handle_, client->pendingSeqNum_ }, header);
+		uv_buf_t bufs[] = {
+			uv_buf_init(header, sizeof(header)),
+			uv_buf_init(const_cast<char*>(msg), unsigned(len))
+		};
+		writeRequestPool_.write(client->stream(), bufs, 2);
+	}
+}
+
+// reply {"success":false} to the client so it's not blocked
+void PipeServer::sendFailureReply(ClientInfo* client, unsigned int seqNum) {
+	char msg[64];
+	int len = snprintf(msg, sizeof(msg), "{\"success\":false,\"seqNum\":%u}", seqNum);
+	writeToClient(client, msg, len);
 }
 
-void PipeServer::initSecurityAttributes() {
-	// create security attributes for the pipe
-	// http://msdn.microsoft.com/en-us/library/windows/desktop/hh448449(v=vs.85).aspx
-	// define new Win 8 app related constants
-	memset(&explicitAccesses_, 0, sizeof(explicitAccesses_));
-	// Create a well-known SID for the Everyone group.
-	// FIXME: we should limit the access to current user only
-	// See this article for details: https://msdn.microsoft.com/en-us/library/windows/desktop/hh448493(v=vs.85).aspx
-
-	SID_IDENTIFIER_AUTHORITY worldSidAuthority = SECURITY_WORLD_SID_AUTHORITY;
-	AllocateAndInitializeSid(&worldSidAuthority, 1,
-		SECURITY_WORLD_RID, 0, 0, 0, 0, 0, 0, 0, &everyoneSID_);
-
-	// https://services.land.vic.gov.au/ArcGIS10.1/edESRIArcGIS10_01_01_3143/Python/pywin32/PLATLIB/win32/Demos/security/explicit_entries.py
-
-	explicitAccesses_[0].grfAccessPermissions = GENERIC_ALL;
-	explicitAccesses_[0].grfAccessMode = SET_ACCESS;
-	explicitAccesses_[0].grfInheritance = SUB_CONTAINERS_AND_OBJECTS_INHERIT;
-	explicitAccesses_[0].Trustee.pMultipleTrustee = NULL;
-	explicitAccesses_[0].Trustee.MultipleTrusteeOperation = NO_MULTIPLE_TRUSTEE;
-	explicitAccesses_[0].Trustee.TrusteeForm = TRUSTEE_IS_SID;
-	explicitAccesses_[0].Trustee.TrusteeType = TRUSTEE_IS_WELL_KNOWN_GROUP;
-	explicitAccesses_[0].Trustee.ptstrName = (LPTSTR)everyoneSID_;
-
-	// FIXME: will this work under Windows 7 and Vista?
-	// create SID for app containers
-	SID_IDENTIFIER_AUTHORITY appPackageAuthority = SECURITY_APP_PACKAGE_AUTHORITY;
-	AllocateAndInitializeSid(&appPackageAuthority,
-		SECURITY_BUILTIN_APP_PACKAGE_RID_COUNT,
-		SECURITY_APP_PACKAGE_BASE_RID,
-		SECURITY_BUILTIN_PACKAGE_ANY_PACKAGE,
-		0, 0, 0, 0, 0, 0, &allAppsSID_);
-
-	explicitAccesses_[1].grfAccessPermissions = GENERIC_ALL;
-	explicitAccesses_[1].grfAccessMode = SET_ACCESS;
-	explicitAccesses_[1].grfInheritance = SUB_CONTAINERS_AND_OBJECTS_INHERIT;
-	explicitAccesses_[1].Trustee.pMultipleTrustee = NULL;
-	explicitAccesses_[1].Trustee.MultipleTrusteeOperation = NO_MULTIPLE_TRUSTEE;
-	explicitAccesses_[1].Trustee.TrusteeForm = TRUSTEE_IS_SID;
-	explicitAccesses_[1].Trustee.TrusteeType = TRUSTEE_IS_GROUP;
-	explicitAccesses_[1].Trustee.ptstrName = (LPTSTR)allAppsSID_;
-
-	// create DACL
-	DWORD err = SetEntriesInAcl(2, explicitAccesses_, NULL, &acl_);
-	if (0 == err) {
-		// security descriptor
-		securittyDescriptor_ = (PSECURITY_DESCRIPTOR)LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
-		InitializeSecurityDescriptor(securittyDescriptor_, SECURITY_DESCRIPTOR_REVISION);
-
-		// Add the ACL to the security descriptor. 
-		SetSecurityDescriptorDacl(securittyDescriptor_, TRUE, acl_, FALSE);
-	}
-
-	securityAttributes_.nLength = sizeof(SECURITY_ATTRIBUTES);
-	securityAttributes_.lpSecurityDescriptor = securittyDescriptor_;
-	securityAttributes_.bInheritHandle = TRUE;
-}
-
-
-// References:
-// https://msdn.microsoft.com/en-us/library/windows/desktop/aa365588(v=vs.85).aspx
-void PipeServer::initPipe(uv_pipe_t* pipe, const char* app_name, SECURITY_ATTRIBUTES* sa) {
-	wchar_t username[UNLEN + 1];
-	DWORD unlen = UNLEN + 1;
-	if (GetUserNameW(username, &unlen)) {
-		// add username to the pipe path so it will not clash with other users' pipes.
-		char pipe_name[MAX_PATH];
-		std::string utf8_username = utf8Codec.to_bytes(username, username + unlen);
-		sprintf(pipe_name, "\\\\.\\pipe\\%s\\PIME\\%s", utf8_username.c_str(), app_name);
-		// create the pipe
-		uv_pipe_init_windows_named_pipe(uv_default_loop(), pipe, 0, PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, sa);
-		pipe->data = this;
-		uv_pipe_bind(pipe, pipe_name);
+void PipeServer::startRequestDeadline(ClientInfo* client, uint64_t timeout) {
+	uint64_t deadline = uv_now(uv_default_loop()) + timeout;
+	client->requestDeadline_ = 0;
+	if (requestDeadlines_.size() >= 2 * clients_.size() + minDeadlinesToCompact) {
+		// most of the deadlines are of answered requests, which are only dropped when they
+		// expire. rebuild the heap with the pending ones, at most one for each client.
+		// the timer might fire before the earliest of them, and is restarted then.
+		std::vector<RequestDeadline> pending;
+		pending.reserve(clients_.size() + 1);
+		clients_.forEach([&pending](ClientInfo* client) {
+			if (client->requestDeadline_ != 0)
+				pending.emplace_back(client->requestDeadline_, client->handle_);
+		});
+		requestDeadlines_ = decltype(requestDeadlines_)(std::greater<RequestDeadline>(), std::move(pending));
+	}
+	client->requestDeadline_ = deadline;
+	bool isEarliest = requestDeadlines_.empty() || deadline < requestDeadlines_.top().first;
+	requestDeadlines_.emplace(deadline, client->handle_);
+	if (isEarliest) {
+		uv_timer_start(&requestDeadlineTimer_, [](uv_timer_t* timer) {
+			reinterpret_cast<PipeServer*>(timer->data)->onRequestDeadlineTimer();
+		}, timeout, 0);
 	}
 }
 
+void PipeServer::onRequestDeadlineTimer() {
+	uint64_t now = uv_now(uv_default_loop());
+	while (!requestDeadlines_.empty() && requestDeadlines_.top().first <= now) {
+		auto deadline = requestDeadlines_.top();
+		requestDeadlines_.pop();
+		auto client = clients_.find(deadline.second);
+		if (client != nullptr && client->requestDeadline_ == deadline.first) {
+			// the backend does not reply in time, fail the request so the app is not frozen.
+			client->requestDeadline_ = 0;
+			client->requestStartTime_ = 0;
+			++client->lateReplies_;
+			TraceRecorder::record("timeout", TraceRecorder::INSTANT, client->handle_, client->pendingSeqNum_);
+			sendFailureReply(client, client->pendingSeqNum_);
+			if (client->backend_ != nullptr && client->worker_ != nullptr) {
+				client->backend_->onRequestTimeout(client->worker_, client->handle_);
+			}
+		}
+	}
+	if (!requestDeadlines_.empty()) {
+		uv_timer_start(&requestDeadlineTimer_, [](uv_timer_t* timer) {
+			reinterpret_cast<PipeServer*>(timer->data)->onRequestDeadlineTimer();
+		}, requestDeadlines_.top().first - now, 0);
+	}
+}
 
 void PipeServer::onNewClientConnected(uv_stream_t* server, int status) {
-	auto server_pipe = reinterpret_cast<uv_pipe_t*>(server);
 	auto client = new ClientInfo{this};
-	uv_pipe_init_windows_named_pipe(uv_default_loop(), &client->pipe_, 0, server_pipe->pipe_mode, server_pipe->security_attributes);
+	transport_->accept(reinterpret_cast<uv_pipe_t*>(server), &client->pipe_);
 	client->pipe_.data = client;
-	uv_stream_set_blocking((uv_stream_t*)&client->pipe_, 0);
-	uv_accept(server, (uv_stream_t*)&client->pipe_);
-	clients_.push_back(client);
+	if (!transport_->preservesMessageBoundaries()) {
+		client->framer_.setMode(StreamFramer::BINARY_MODE);
+	}
+	client->handle_ = clients_.add(client);
+	if (client->handle_ == ClientTable::invalidHandle) {
+		// too many connected clients
+		uv_close((uv_handle_t*)&client->pipe_, [](uv_handle_t* handle) {
+			delete (ClientInfo*)handle->data;
+		});
+		return;
+	}
 
 	uv_read_start((uv_stream_t*)&client->pipe_,
 		[](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-			buf->base = new char[suggested_size];
-			buf->len = suggested_size;
+			auto client = (ClientInfo*)handle->data;
+			client->server_->readBufferPool_.alloc(suggested_size, buf);
 		},
 		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 			auto client = (ClientInfo*)stream->data;
@@ -396,28 +700,44 @@ void PipeServer::onNewClientConnected(uv_stream_t* server, int status) {
 
 void PipeServer::onClientDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 	auto client = (ClientInfo*)stream->data;
-	if (nread <= 0 || nread == UV_EOF || buf->base == nullptr) {
-		if (buf->base) {
-			delete []buf->base;
-		}
+	if (nread == 0) {  // nothing to read for now, not an error
+		readBufferPool_.release(buf);
+		return;
+	}
+	if (nread < 0 || buf->base == nullptr) {
+		readBufferPool_.release(buf);
 		// the client connection seems to be broken. close it.
 		closeClient(client);
 		return;
 	}
 	if (buf->base) {
-		handleClientMessage(client, buf->base, buf->len);
-		delete[]buf->base;
+		if (transport_->preservesMessageBoundaries()) {
+			handleClientMessage(client, buf->base, nread);
+		}
+		else {
+			client->framer_.feed(buf->base, nread, [this, client](const FrameHeader* header, const char* data, size_t len) {
+				if (header != nullptr && header->type == FRAME_REQUEST) {
+					handleClientMessage(client, data, len);
+				}
+			});
+		}
+		readBufferPool_.release(buf);
+		if (client->framer_.hasError()) {
+			closeClient(client);
+		}
 	}
 }
 
-int PipeServer::exec(LPSTR cmd) {
-	parseCommandLine(cmd);
+int PipeServer::exec() {
+	TraceRecorder::setThreadName("client loop");
+	parseCommandLine();
 	if (quitExistingLauncher_) { // terminate existing launcher process
 		terminateExistingLauncher();
 		return 0;
 	}
 
 	// get the PIME directory
+#ifdef _WIN32
 	wchar_t exeFilePathBuf[MAX_PATH];
 	DWORD len = GetModuleFileNameW(NULL, exeFilePathBuf, MAX_PATH);
 	exeFilePathBuf[len] = '\0';
@@ -433,21 +753,29 @@ int PipeServer::exec(LPSTR cmd) {
 
 	// must set CWD to our dir. otherwise the backends won't launch.
 	::SetCurrentDirectoryW(topDirPath_.c_str());
+#else
+	// $PIME_DIR overrides the dir of the executable, so a build tree can run the backends of a source tree.
+	string topDir;
+	if (const char* pimeDir = getenv("PIME_DIR")) {
+		topDir = pimeDir;
+	}
+	else {
+		char exePath[1024];
+		size_t len = sizeof(exePath);
+		uv_exepath(exePath, &len);
+		topDir.assign(exePath, len);
+		topDir.erase(topDir.rfind('/'));
+	}
+	topDirPath_ = utf8Codec.from_bytes(topDir);
+	uv_chdir(topDir.c_str());
+#endif
 
 	// this is the first instance
 	initBackendServers(topDirPath_);
 
-	// preparing for the server pipe
-	SECURITY_ATTRIBUTES* sa = nullptr;
-	if (Ime::WindowsVersion().isWindows8Above()) {
-		// Setting special security attributes to the named pipe is only needed 
-		// for Windows >= 8 since older versions do not have app containers (metro apps) 
-		// in which connecting to pipes are blocked by default permission settings.
-		initSecurityAttributes();
-		sa = &securityAttributes_;
-	}
-	// initialize the server pipe
-	initPipe(&serverPipe_, "Launcher", sa);
+	// initialize the server pipe. apps in app containers (metro apps) need to connect to it.
+	transport_->listen(uv_default_loop(), &serverPipe_, "Launcher", true);
+	serverPipe_.data = this;
 
 	// listen to events from clients
 	uv_listen(reinterpret_cast<uv_stream_t*>(&serverPipe_), 32, [](uv_stream_t* server, int status) {
@@ -455,8 +783,50 @@ int PipeServer::exec(LPSTR cmd) {
 		_this->onNewClientConnected(server, status);
 	});
 
+	// timer used to fail the requests which are not replied in time
+	uv_timer_init(uv_default_loop(), &requestDeadlineTimer_);
+	requestDeadlineTimer_.data = this;
+
+	// receive the messages of the backends running in their own threads
+	uv_async_init(uv_default_loop(), &backendMessageAsync_, [](uv_async_t* async) {
+		auto _this = reinterpret_cast<PipeServer*>(async->data);
+		for (auto backend : _this->backends_) {
+			backend->dispatchClientLoopMessages();
+		}
+	});
+	backendMessageAsync_.data = this;
+	for (auto backend : backends_) {
+		backend->startLoopThread();
+	}
+
+	// launch the backends which should be ready before the first client connects,
+	// so the user does not wait for them to load on the first keystroke.
+	for (auto backend : backends_) {
+		if (backend->eagerStart()) {
+			backend->startProcess();
+		}
+	}
+
+	// reload the config when it's changed without restarting the launcher
+	watchConfigFiles();
+
+	// free the memory used by the backends which are not in use
+#ifdef _WIN32
+	lowMemoryNotification_ = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+#endif
+	uv_timer_init(uv_default_loop(), &reapTimer_);
+	reapTimer_.data = this;
+	uv_timer_start(&reapTimer_, [](uv_timer_t* timer) {
+		reinterpret_cast<PipeServer*>(timer->data)->reapBackends();
+	}, reapInterval, reapInterval);
+
+	// write the recorded trace events to the file periodically when tracing
+	uv_timer_init(uv_default_loop(), &traceFlushTimer_);
+	traceFlushTimer_.data = this;
+
 	// initialize the debug pipe connected by debug console
-	initPipe(&debugServerPipe_, "Debug", nullptr);
+	transport_->listen(uv_default_loop(), &debugServerPipe_, "Debug", false);
+	debugServerPipe_.data = this;
 
 	// listen to events from the debug console
 	uv_listen(reinterpret_cast<uv_stream_t*>(&debugServerPipe_), 1, [](uv_stream_t* server, int status) {
@@ -475,29 +845,65 @@ void PipeServer::handleClientMessage(ClientInfo* client, const char* readBuf, si
 		quit();
 		return;
 	}
+	// only a few fields are needed for routing, so don't build the whole json DOM.
+	// a malformed message is treated as an empty object.
+	JsonField fields[] = { JsonField{ "method" }, JsonField{ "seqNum" }, JsonField{ "id" }, JsonField{ "fusedKeyEvents" } };
+	if (!JsonFieldScanner::scan(readBuf, len, fields, 4)) {
+		fields[0].type = fields[1].type = fields[2].type = fields[3].type = JsonField::MISSING;
+	}
+	const JsonField& methodField = fields[0];
 	if (!client->isInitialized()) {
-		Json::Value msg;
-		Json::Reader reader;
-		if (reader.parse(readBuf, msg)) {
-			client->init(msg);
-		}
+		client->init(methodField, fields[2]);
 	}
+	uint32_t seqNum = 0;
+	fields[1].asUInt(seqNum);
+	TraceRecorder::record("request", TraceRecorder::BEGIN, client->handle_, seqNum, methodField.value, methodField.len);
 	// pass the incoming message to the backend
 	auto backend = client->backend_;
 	if (backend) {
-		backend->handleClientMessage(client, readBuf, len);
+		string method = methodField.asString();
+		if (client->sessionLost_) {
+			// the backend process was suspended, restore the session before handling the message
+			replayClientSession(client);
+		}
+		// remember the session in case the backend process needs to be restarted
+		if (method == "init") {
+			client->initMessage_.assign(readBuf, len);
+			client->fusedKeyEvents_ = fields[3].isTrue();
+		}
+		else if (method == "onActivate") {
+			setReplayMessage(client->activateMessage_, readBuf, len);
+		}
+		else if (method == "onDeactivate") {
+			client->activateMessage_.clear();
+		}
+		client->pendingSeqNum_ = seqNum;
+		client->requestStartTime_ = uv_hrtime();
+		client->requestLatency_ = backend->methodLatency(method);
+		// the client is blocked until it gets the reply, so don't wait for the backend forever.
+		startRequestDeadline(client, backend->requestTimeout(method, client));
+		// key events are sent to the backend before slower requests of other clients
+		backend->handleClientMessage(client, readBuf, len, BackendServer::laneForMethod(method));
+	}
+	else {
+		// no backend can handle the client
+		sendFailureReply(client, seqNum);
 	}
 }
 
 void PipeServer::closeClient(ClientInfo* client) {
 	if (client->backend_ != nullptr) {
-		// FIXME: client->backend_->removeClient(client->clientId_);
 		// notify the backend server to remove the client
-		const char msg[] = "{\"method\":\"close\"}";
-		client->backend_->handleClientMessage(client, msg, strlen(msg));
+		client->backend_->removeClient(client);
 	}
+	disconnectClient(client);
+}
 
-	clients_.erase(find(clients_.begin(), clients_.end(), client));
+void PipeServer::disconnectClient(ClientInfo* client) {
+	if (client->backend_ != nullptr) {
+		client->backend_->detachClient();
+	}
+	clients_.remove(client->handle_);
 	uv_close((uv_handle_t*)&client->pipe_, [](uv_handle_t* handle) {
 		auto client = (ClientInfo*)handle->data;
 		delete client;
@@ -505,12 +911,9 @@ void PipeServer::closeClient(ClientInfo* client) {
 }
 
 void PipeServer::onNewDebugClientConnected(uv_stream_t* server, int status) {
-	auto server_pipe = reinterpret_cast<uv_pipe_t*>(server);
 	uv_pipe_t* client_pipe = new uv_pipe_t{};
-	uv_pipe_init_windows_named_pipe(uv_default_loop(), client_pipe, 0, server_pipe->pipe_mode, server_pipe->security_attributes);
+	transport_->accept(reinterpret_cast<uv_pipe_t*>(server), client_pipe);
 	client_pipe->data = this;
-	uv_stream_set_blocking((uv_stream_t*)client_pipe, 0);
-	uv_accept(server, (uv_stream_t*)client_pipe);
 
 	// kill existing debug console client since we only allow one connection
 	if (debugClientPipe_) {
@@ -521,8 +924,8 @@ void PipeServer::onNewDebugClientConnected(uv_stream_t* server, int status) {
 	// read debugging commands from the debug console
 	uv_read_start((uv_stream_t*)debugClientPipe_,
 		[](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-			buf->base = new char[suggested_size];
-			buf->len = suggested_size;
+			auto server = (PipeServer*)handle->data;
+			server->readBufferPool_.alloc(suggested_size, buf);
 		},
 		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 			auto server = (PipeServer*)stream->data;
@@ -531,18 +934,15 @@ void PipeServer::onNewDebugClientConnected(uv_stream_t* server, int status) {
 	);
 
 	// if there are recent debug messages, output them to the debug console
-	for (auto& msg : recentDebugMessages_) {
-		outputDebugMessage(msg.c_str(), msg.length());
-	}
+	debugCursor_ = debugHistory_.tail();
+	flushDebugOutput();
 }
 
 void PipeServer::onDebugClientDataReceived(uv_stream_t * stream, ssize_t nread, const uv_buf_t * buf) {
 	// receive debug commands from the debug console
 	// debug commands are issued line by line and starts with "DEBUG_CMD:" prefix.
 	if (nread <= 0 || nread == UV_EOF || buf->base == nullptr) {
-		if (buf->base) {
-			delete[]buf->base;
-		}
+		readBufferPool_.release(buf);
 		// the client connection seems to be broken. close it.
 		closeDebugClient();
 		return;
@@ -559,38 +959,182 @@ void PipeServer::onDebugClientDataReceived(uv_stream_t * stream, ssize_t nread,
 					}
 				}
 			}
+			else if (line == "DEBUG_CMD:BACKEND_STATUS") {
+				outputBackendStatus();
+			}
+			else if (line == "DEBUG_CMD:STATS") {
+				outputLatencyStats();
+			}
+			else if (line == "DEBUG_CMD:TRACE") {
+				toggleTracing();
+			}
 		}
-		delete[]buf->base;
+		readBufferPool_.release(buf);
 	}
 }
 
 void PipeServer::closeDebugClient() {
+	if (debugClientPipe_ == nullptr)
+		return;
+	// NOTE: the pending write is cancelled and its callback is called before the pipe is freed.
 	uv_close((uv_handle_t*)debugClientPipe_, [](uv_handle_t* handle) {
 		delete (uv_pipe_t*)handle;
 	});
 	debugClientPipe_ = nullptr;
 }
 
-struct DebugMessageReq {
-	uv_write_t req;
+void PipeServer::toggleTracing() {
+	std::wstring traceFile = userDataDir();
+	if (traceFile.empty())
+		return;
+	traceFile = joinPath(traceFile, L"launcher_trace.json");
 	string msg;
-	PipeServer* pipeServer;
-};
+	if (!TraceRecorder::isEnabled()) {
+		if (TraceRecorder::start(traceFile)) {
+			uv_timer_start(&traceFlushTimer_, [](uv_timer_t* timer) {
+				TraceRecorder::flush();
+			}, traceFlushInterval, traceFlushInterval);
+			msg = "\nTracing started: ";
+		}
+		else {
+			msg = "\nFail to write trace file: ";
+		}
+	}
+	else {
+		uv_timer_stop(&traceFlushTimer_);
+		TraceRecorder::stop();
+		msg = "\nTracing stopped: ";
+	}
+	msg += utf8Codec.to_bytes(traceFile) + "\n";
+	outputDebugMessage(msg.c_str(), msg.length());
+}
+
+void PipeServer::outputBackendStatus() {
+	// show the status of every worker process of the backends
+	string msg = "\nBackend status:\n";
+	for (auto backend : backends_) {
+		for (auto worker : backend->workers()) {
+			size_t clientCount = 0;
+			clients_.forEach([worker, &clientCount](ClientInfo* client) {
+				if (client->worker_ == worker)
+					++clientCount;
+			});
+			char line[256];
+			snprintf(line, sizeof(line), "%s worker #%d: %s, clients: %u, queue depth: %u, queued: %u interactive, %u background\n",
+				backend->name_.c_str(),
+				worker->id(),
+				worker->isProcessRunning() ? "running" : (backend->isSuspended() ? "suspended" : "stopped"),
+				unsigned(clientCount),
+				unsigned(worker->queueDepth()),
+				unsigned(worker->queuedMessages(INTERACTIVE_LANE)),
+				unsigned(worker->queuedMessages(BACKGROUND_LANE)));
+			msg += line;
+		}
+	}
+
+	// usage of the read buffer pool
+	auto& stats = readBufferPool_.stats();
+	char line[256];
+	snprintf(line, sizeof(line), "read buffers: %llu allocs, %.1f%% hit rate, %u slabs, %u KB in use, %u KB peak\n",
+		(unsigned long long)stats.allocCount,
+		stats.allocCount > 0 ? 100.0 * stats.hitCount / stats.allocCount : 0.0,
+		unsigned(stats.slabCount),
+		unsigned(stats.inUseBytes / 1024),
+		unsigned(stats.peakInUseBytes / 1024));
+	msg += line;
+	outputDebugMessage(msg.c_str(), msg.length());
+}
+
+static void formatLatency(string& msg, const char* indent, const char* name, const LatencyHistogram& histogram) {
+	char line[256];
+	snprintf(line, sizeof(line), "%s%s: %llu requests, p50: %.2f, p90: %.2f, p99: %.2f, max: %.2f\n",
+		indent,
+		name,
+		(unsigned long long)histogram.count(),
+		histogram.percentile(50) / 1000.0,
+		histogram.percentile(90) / 1000.0,
+		histogram.percentile(99) / 1000.0,
+		histogram.max() / 1000.0);
+	msg += line;
+}
+
+void PipeServer::outputLatencyStats() {
+	// latency of the requests of every backend and every method (in ms)
+	string msg = "\nLatency stats (ms):\n";
+	for (auto backend : backends_) {
+		formatLatency(msg, "", backend->name_.c_str(), backend->latency_);
+		char line[256];
+		snprintf(line, sizeof(line), "  timeouts: %llu, restarts: %llu\n",
+			(unsigned long long)backend->totalTimeouts_,
+			(unsigned long long)backend->totalRestarts_);
+		msg += line;
+		// time spent waiting in the lanes before being sent to the backend
+		formatLatency(msg, "  ", "queue wait (interactive)", backend->laneWaitTime_[INTERACTIVE_LANE]);
+		formatLatency(msg, "  ", "queue wait (background)", backend->laneWaitTime_[BACKGROUND_LANE]);
+		// sort the methods by name
+		map<string, LatencyHistogram*> methods;
+		for (auto& item : backend->methodLatency_) {
+			methods[item.first] = item.second.get();
+		}
+		for (auto& item : methods) {
+			formatLatency(msg, "  ", item.first.empty() ? "(no method)" : item.first.c_str(), *item.second);
+		}
+	}
+	outputDebugMessage(msg.c_str(), msg.length());
+}
 
 void PipeServer::outputDebugMessage(const char * msg, size_t len) {
+	// when no debug console is connected, this is only a memcpy.
+	debugHistory_.write(msg, len);
 	if (debugClientPipe_ != nullptr) {
-		auto req_data = new DebugMessageReq{ {}, string{msg, len }, this};
-		req_data->req.data = req_data;
-		uv_buf_t buf = {req_data->msg.length(), (char*)req_data->msg.c_str()};
-
-		uv_write(&req_data->req, reinterpret_cast<uv_stream_t*>(debugClientPipe_), &buf, 1, [](uv_write_t* req, int status) {
-			DebugMessageReq* req_data = reinterpret_cast<DebugMessageReq*>(req->data);
-			if (status < 0 || status == UV_EOF) {
-				req_data->pipeServer->closeDebugClient();
-			}
-			delete req_data;
-		});
+		flushDebugOutput();
+	}
+}
+
+void PipeServer::flushDebugOutput() {
+	if (debugClientPipe_ == nullptr || debugWriteLen_ != 0)  // wait for the pending write to finish
+		return;
+	// skip the messages which are already overwritten if the console cannot catch up
+	if (debugCursor_ < debugHistory_.tail()) {
+		debugCursor_ = debugHistory_.tail();
+	}
+	if (debugCursor_ == debugHistory_.head())
+		return;
+	// send everything logged since the last write in one batch. the ring might be
+	// overwritten by new messages before the write completes, so copy the data to
+	// a buffer which is reused for every write.
+	debugWriteBuf_.clear();
+	for (uint64_t pos = debugCursor_; pos < debugHistory_.head(); pos = debugCursor_ + debugWriteBuf_.length()) {
+		const char* data;
+		size_t len = debugHistory_.readSlice(pos, &data);
+		debugWriteBuf_.append(data, len);
+	}
+	debugWriteLen_ = debugWriteBuf_.length();
+	uv_buf_t buf = uv_buf_init(&debugWriteBuf_[0], unsigned(debugWriteLen_));
+	int ret = uv_write(&debugWriteReq_, reinterpret_cast<uv_stream_t*>(debugClientPipe_), &buf, 1, [](uv_write_t* req, int status) {
+		reinterpret_cast<PipeServer*>(req->data)->onDebugOutputWritten(req->handle, status);
+	});
+	if (ret < 0) {
+		debugWriteLen_ = 0;
+		closeDebugClient();
+	}
+}
+
+void PipeServer::onDebugOutputWritten(uv_stream_t* stream, int status) {
+	size_t len = debugWriteLen_;
+	debugWriteLen_ = 0;
+	if (stream != reinterpret_cast<uv_stream_t*>(debugClientPipe_)) {
+		// the console was replaced by a new one during the write
+		flushDebugOutput();
+		return;
+	}
+	if (status < 0 || status == UV_EOF) {
+		closeDebugClient();
+		return;
 	}
+	debugCursor_ += len;
+	// send the messages logged during the write
+	flushDebugOutput();
 }
 
 } // namespace PIME
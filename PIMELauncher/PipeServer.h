@@ -20,13 +20,9 @@
 #ifndef _PIME_PIPE_SERVER_H_
 #define _PIME_PIPE_SERVER_H_
 
+#ifdef _WIN32
 #include <Windows.h>
-#include <ShlObj.h>
-#include <Shellapi.h>
-#include <Lmcons.h> // for UNLEN
-#include <Winnt.h> // for security attributes constants
-#include <aclapi.h> // for ACL
-#include <rpc.h> // for UuidCreate
+#endif
 #include <cstring>
 #include <string>
 #include <vector>
@@ -34,7 +30,16 @@
 #include <queue>
 #include <deque>
 #include <memory>
+#include <functional>
 #include "BackendServer.h"
+#include "ClientTable.h"
+#include "WriteRequestPool.h"
+#include "ReadBufferPool.h"
+#include "LatencyHistogram.h"
+#include "ByteRing.h"
+#include "StreamFramer.h"
+#include "JsonFieldScanner.h"
+#include "Transport.h"
 
 #include <uv.h>
 
@@ -43,12 +48,28 @@ namespace PIME {
 
 class PipeServer;
 class BackendServer;
+class BackendWorker;
 
 struct ClientInfo {
 	BackendServer* backend_;
+	BackendWorker* worker_; // the worker process of the backend serving this client
 	std::string textServiceGuid_;
-	std::string clientId_;
+	ClientTable::Handle handle_; // compact handle used to route replies from the backend
+	std::string clientId_; // handle_ formatted as a string, used as the client ID in the backend
+	// the request waiting for a reply from the backend
+	unsigned int pendingSeqNum_;
+	uint64_t requestDeadline_; // 0 if no request is pending
+	unsigned int lateReplies_; // number of replies to timed out requests which should be dropped
+	uint64_t requestStartTime_; // arrival time of the pending request (in ns)
+	LatencyHistogram* requestLatency_; // latency histogram of the method of the pending request
+	// the session of the client, replayed to the backend if its process is restarted
+	std::string initMessage_;
+	std::string activateMessage_; // with "replay":true added, empty if the client is not activated
+	uint64_t lastReplayTime_; // 0 if the session is never replayed
+	bool sessionLost_; // the backend process is suspended, replay the session on the next request
+	bool fusedKeyEvents_; // the backend handles the keys right after filtering them
 	uv_pipe_t pipe_;
+	StreamFramer framer_; // splits the stream into messages if the transport does not keep their boundaries
 	PipeServer* server_;
 
 	ClientInfo(PipeServer* server);
@@ -59,7 +80,8 @@ struct ClientInfo {
 
 	bool isInitialized() const;
 
-	bool init(const Json::Value& params);
+	// method and id are the fields of the first message of the client
+	bool init(const JsonField& method, const JsonField& id);
 };
 
 
@@ -69,7 +91,7 @@ public:
 
 	~PipeServer();
 
-	int exec(LPSTR cmd);
+	int exec();
 
 	static PipeServer* get() { // get the singleton object
 		return singleton_;
@@ -77,15 +99,35 @@ public:
 
 	void quit();
 
-	void handleBackendReply(const char* readBuf, size_t len);
+	// raw output of a backend process, kept in the debug history
+	void handleBackendOutput(const char* readBuf, size_t len);
 
+	// a reply of the backend to the client
+	void handleBackendReply(ClientTable::Handle clientHandle, const char* msg, size_t len);
+
+	// called by the threads of threaded backends when they pass messages to the client loop
+	void wakeUpClientLoop() {
+		uv_async_send(&backendMessageAsync_);
+	}
+
+	// keep the message in the debug history and print it to the debug console if there is any
 	void outputDebugMessage(const char* msg, size_t len);
 
 	BackendServer* backendFromLangProfileGuid(const char* guid);
 
 	BackendServer* backendFromName(const char* name);
 
-	void onBackendClosed(BackendServer* backend);
+	void onBackendClosed(BackendWorker* worker);
+
+	// shared by all writes to the clients and the backend processes
+	WriteRequestPool& writeRequestPool() {
+		return writeRequestPool_;
+	}
+
+	// shared by all reads from the clients and the backend processes
+	ReadBufferPool& readBufferPool() {
+		return readBufferPool_;
+	}
 
 private:
 	// backend server
@@ -93,41 +135,80 @@ private:
 	void finalizeBackendServers();
 	void initInputMethods(const std::wstring& topDirPath);
 
-	static std::string getPipeName(const char* base_name);
-	void initSecurityAttributes();
-	void initPipe(uv_pipe_t* pipe, const char * app_name, SECURITY_ATTRIBUTES* sa = nullptr);
+	// reload the config when backends.json or any ime.json is changed
+	void watchConfigFiles();
+	void watchInputMethodDirs();
+	bool watchInputMethodDir(const std::string& dirPath, unsigned int flags, uv_fs_event_cb callback);
+	void scheduleReload(bool reloadBackends);
+	void reloadBackendServers();
+	void retireBackend(BackendServer* backend);
+
 	void terminateExistingLauncher();
-	void parseCommandLine(LPSTR cmd);
+	void parseCommandLine();
 	// bool launchBackendByName(const char* name);
 
 	void onNewClientConnected(uv_stream_t* server, int status);
 	void onClientDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 	void handleClientMessage(ClientInfo* client, const char* readBuf, size_t len);
 	void closeClient(ClientInfo* client);
+	void disconnectClient(ClientInfo* client);
+	void replayClientSession(ClientInfo* client);
+
+	// stop the backends which are not used for a while, or when the system is low on memory
+	void reapBackends();
 
 	void onNewDebugClientConnected(uv_stream_t* server, int status);
 	void onDebugClientDataReceived(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 	void closeDebugClient();
+	void flushDebugOutput();
+	void onDebugOutputWritten(uv_stream_t* stream, int status);
+	void outputBackendStatus();
+	void outputLatencyStats();
+	void toggleTracing(); // start or stop writing a Chrome trace of the requests
+
+	void writeToClient(ClientInfo* client, const char* msg, size_t len);
+	void sendReplyToClient(ClientTable::Handle clientHandle, const char* msg, size_t len);
+	void sendFailureReply(ClientInfo* client, unsigned int seqNum);
 
-	void sendReplyToClient(const std::string clientId, const char* msg, size_t len);
+	void startRequestDeadline(ClientInfo* client, uint64_t timeout);
+	void onRequestDeadlineTimer();
 
 private:
-	// security attribute stuff for creating the server pipe
-	PSECURITY_DESCRIPTOR securittyDescriptor_;
-	SECURITY_ATTRIBUTES securityAttributes_;
-	PACL acl_;
-	EXPLICIT_ACCESS explicitAccesses_[2];
-	PSID everyoneSID_;
-	PSID allAppsSID_;
-	
+	std::unique_ptr<Transport> transport_; // IPC channel between the launcher and the clients
 	std::wstring topDirPath_;
 	bool quitExistingLauncher_;
 	static PipeServer* singleton_;
-	std::vector<ClientInfo*> clients_;
+	ClientTable clients_;
+	WriteRequestPool writeRequestPool_;
+	ReadBufferPool readBufferPool_;
 	uv_pipe_t serverPipe_; // main server pipe accepting connections from the clients
 	uv_pipe_t debugServerPipe_; // pipe used for communicate with the debug console
 	uv_pipe_t* debugClientPipe_; // connected client pipe of the debug console
-	std::deque<std::string> recentDebugMessages_; // buffer storing recent debug messages
+	ByteRing debugHistory_; // recent debug messages
+	uint64_t debugCursor_; // position in debugHistory_ of the next byte to send to the debug console
+	uv_write_t debugWriteReq_; // only one write to the debug console is in flight at a time
+	size_t debugWriteLen_; // length of the data being written, 0 if no write is in flight
+	std::string debugWriteBuf_; // copy of the data being written, since the ring might be overwritten meanwhile
+
+	// deadlines of the requests waiting for replies, the earliest one on the top.
+	// the entries are not removed when the replies arrive, but are ignored
+	// if they do not match the pending request of the client any more.
+	typedef std::pair<uint64_t, ClientTable::Handle> RequestDeadline;
+	std::priority_queue<RequestDeadline, std::vector<RequestDeadline>, std::greater<RequestDeadline>> requestDeadlines_;
+	uv_timer_t requestDeadlineTimer_;
+
+	uv_async_t backendMessageAsync_; // notified when threaded backends have messages for us
+
+	uv_fs_event_t configWatcher_; // watch backends.json
+	std::vector<uv_fs_event_t*> inputMethodWatchers_; // watch the input method dirs of every backend
+	uv_timer_t reloadTimer_; // reload after the files stop changing for a while
+	bool reloadBackends_; // backends.json is changed, not only the input methods
+
+	uv_timer_t reapTimer_; // check for idle backends periodically
+	uv_timer_t traceFlushTimer_; // write the trace events periodically when tracing
+#ifdef _WIN32
+	HANDLE lowMemoryNotification_;
+#endif
 
 	std::vector<BackendServer*> backends_;
 	std::unordered_map<std::string, BackendServer*> backendMap_;
@@ -0,0 +1,96 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#include "ReadBufferPool.h"
+
+namespace PIME {
+
+// messages of the clients are usually less than 2 KB, while libuv suggests
+// 64 KB when it does not know how much data is available.
+static const size_t smallBufferSize = 4 * 1024;
+static const size_t largeBufferSize = 64 * 1024;
+static const size_t slabSize = 256 * 1024;
+
+ReadBufferPool::ReadBufferPool() :
+	stats_{} {
+	sizeClasses_.push_back(SizeClass{ smallBufferSize, slabSize / smallBufferSize });
+	sizeClasses_.push_back(SizeClass{ largeBufferSize, slabSize / largeBufferSize });
+}
+
+ReadBufferPool::~ReadBufferPool() {
+	// the slabs are freed by their unique_ptrs
+}
+
+ReadBufferPool::SizeClass* ReadBufferPool::sizeClassFor(size_t size) {
+	for (auto& sizeClass : sizeClasses_) {
+		if (size <= sizeClass.bufferSize)
+			return &sizeClass;
+	}
+	return nullptr;
+}
+
+void ReadBufferPool::allocSlab(SizeClass& sizeClass) {
+	char* slab = new char[sizeClass.bufferSize * sizeClass.buffersPerSlab];
+	slabs_.emplace_back(slab);
+	++stats_.slabCount;
+	for (size_t i = 0; i < sizeClass.buffersPerSlab; ++i) {
+		sizeClass.freeList.push_back(slab + i * sizeClass.bufferSize);
+	}
+}
+
+void ReadBufferPool::alloc(size_t suggestedSize, uv_buf_t* buf) {
+	++stats_.allocCount;
+	SizeClass* sizeClass = sizeClassFor(suggestedSize);
+	if (sizeClass == nullptr) {
+		// larger than any size class. this rarely happens.
+		buf->base = new char[suggestedSize];
+		buf->len = suggestedSize;
+	}
+	else {
+		if (sizeClass->freeList.empty()) {
+			allocSlab(*sizeClass);
+		}
+		else {
+			++stats_.hitCount;
+		}
+		buf->base = sizeClass->freeList.back();
+		buf->len = sizeClass->bufferSize;
+		sizeClass->freeList.pop_back();
+	}
+	stats_.inUseBytes += buf->len;
+	if (stats_.inUseBytes > stats_.peakInUseBytes) {
+		stats_.peakInUseBytes = stats_.inUseBytes;
+	}
+}
+
+void ReadBufferPool::release(const uv_buf_t* buf) {
+	if (buf->base == nullptr)
+		return;
+	stats_.inUseBytes -= buf->len;
+	// the length of the buffer is not changed by libuv, so it tells us the size class.
+	SizeClass* sizeClass = sizeClassFor(buf->len);
+	if (sizeClass != nullptr && sizeClass->bufferSize == buf->len) {
+		sizeClass->freeList.push_back(buf->base);
+	}
+	else {
+		delete[]buf->base;
+	}
+}
+
+} // namespace PIME
@@ -0,0 +1,80 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_READ_BUFFER_POOL_H_
+#define _PIME_READ_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+#include <uv.h>
+
+namespace PIME {
+
+// Read buffers for the libuv alloc callbacks of the launcher's event loop.
+// Instead of allocating a buffer for every read and freeing it afterwards,
+// buffers are carved from slabs in a few size classes and recycled.
+// The smallest size class fitting the size suggested by libuv is used, so
+// reads of short client messages take small buffers while the stdout of the
+// backends takes larger ones. Requests larger than the biggest size class
+// fall back to the heap.
+class ReadBufferPool {
+public:
+	struct Stats {
+		uint64_t allocCount; // total number of buffers handed out
+		uint64_t hitCount; // buffers reused from a free list
+		size_t slabCount; // number of slabs allocated
+		size_t inUseBytes; // bytes of the buffers currently handed out
+		size_t peakInUseBytes; // max of inUseBytes
+	};
+
+	ReadBufferPool();
+	~ReadBufferPool();
+
+	// fill buf with a buffer of at least suggestedSize bytes (or the biggest size class)
+	void alloc(size_t suggestedSize, uv_buf_t* buf);
+
+	// return a buffer allocated by alloc(). buf->base can be nullptr.
+	void release(const uv_buf_t* buf);
+
+	const Stats& stats() const {
+		return stats_;
+	}
+
+private:
+	struct SizeClass {
+		size_t bufferSize;
+		size_t buffersPerSlab;
+		std::vector<char*> freeList;
+	};
+
+	SizeClass* sizeClassFor(size_t size);
+	void allocSlab(SizeClass& sizeClass);
+
+private:
+	std::vector<SizeClass> sizeClasses_; // sorted by buffer size
+	std::vector<std::unique_ptr<char[]>> slabs_;
+	Stats stats_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_READ_BUFFER_POOL_H_
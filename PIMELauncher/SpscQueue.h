@@ -0,0 +1,81 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_SPSC_QUEUE_H_
+#define _PIME_SPSC_QUEUE_H_
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+namespace PIME {
+
+// Bounded lock-free queue with a single producer thread and a single consumer thread.
+// The slots are allocated once and filled in place, so objects owning buffers,
+// such as std::string, keep their capacity and are reused without allocating.
+template <typename T>
+class SpscQueue {
+public:
+	// capacity must be a power of 2
+	explicit SpscQueue(size_t capacity) :
+		slots_(capacity),
+		mask_{ capacity - 1 },
+		head_{ 0 },
+		tail_{ 0 } {
+	}
+
+	// producer: get the free slot to fill, or nullptr if the queue is full.
+	// the slot is not visible to the consumer until push() is called.
+	T* back() {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) > mask_)
+			return nullptr;
+		return &slots_[tail & mask_];
+	}
+
+	// producer: publish the slot returned by back()
+	void push() {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// consumer: get the oldest item, or nullptr if the queue is empty
+	T* front() {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots_[head & mask_];
+	}
+
+	// consumer: release the slot returned by front() to the producer
+	void pop() {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	std::vector<T> slots_;
+	size_t mask_;
+	// keep the indices of the two threads in different cache lines
+	std::atomic<size_t> head_; // written by the consumer
+	char padding_[64];
+	std::atomic<size_t> tail_; // written by the producer
+};
+
+} // namespace PIME
+
+#endif // _PIME_SPSC_QUEUE_H_
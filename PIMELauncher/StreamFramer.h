@@ -0,0 +1,188 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_STREAM_FRAMER_H_
+#define _PIME_STREAM_FRAMER_H_
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include "BackendProtocol.h"
+
+namespace PIME {
+
+// Reassembles frames from a byte stream, such as the stdout of a backend
+// server, which libuv hands to us in arbitrary chunks.
+// In text mode, frames are newline-delimited lines. In binary mode, frames
+// are length-prefixed as described in BackendProtocol.h.
+// Complete frames inside a read buffer are passed to the handler directly
+// without copying. Only a trailing partial frame is kept until the next read.
+class StreamFramer {
+public:
+	enum Mode {
+		TEXT_MODE,
+		BINARY_MODE
+	};
+
+	// lines longer than maxFrameSize are discarded
+	explicit StreamFramer(size_t maxFrameSize = maxFramePayloadSize) :
+		maxFrameSize_{ maxFrameSize },
+		mode_{ TEXT_MODE },
+		discarding_{ false },
+		error_{ false } {
+	}
+
+	Mode mode() const {
+		return mode_;
+	}
+
+	// switch the framing mode. this can be called inside the frame handler,
+	// and the remaining data of the current chunk is parsed in the new mode.
+	void setMode(Mode mode) {
+		pending_.clear();
+		discarding_ = false;
+		mode_ = mode;
+	}
+
+	// Feed a chunk of data to the framer.
+	// onFrame(const FrameHeader* header, const char* data, size_t len) is called for
+	// every complete frame. For text lines, header is nullptr and the '\n' is not
+	// included. The data is only valid during the call.
+	// Returns the number of leading bytes of the chunk which were parsed in text mode.
+	template <typename Handler>
+	size_t feed(const char* data, size_t len, Handler onFrame) {
+		const char* begin = data;
+		const char* end = data + len;
+		size_t textLen = (mode_ == TEXT_MODE) ? len : 0;
+		while (data < end && !error_) {
+			if (mode_ == TEXT_MODE) {
+				auto line_end = static_cast<const char*>(memchr(data, '\n', end - data));
+				if (line_end == nullptr) {
+					// keep the partial line until more data arrives
+					appendPending(data, end - data);
+					break;
+				}
+				if (!pending_.empty() || discarding_) {
+					// complete the partial line left by the previous read
+					appendPending(data, line_end - data);
+					if (!discarding_) {
+						onFrame(nullptr, pending_.data(), pending_.length());
+					}
+					pending_.clear();
+					discarding_ = false;
+				}
+				else if (size_t(line_end - data) <= maxFrameSize_) {
+					onFrame(nullptr, data, line_end - data);
+				}
+				data = line_end + 1;
+				if (mode_ != TEXT_MODE) { // the handler switched to binary mode
+					textLen = data - begin;
+				}
+			}
+			else {
+				data = feedBinary(data, end, onFrame);
+			}
+		}
+		return textLen;
+	}
+
+	// drop any buffered partial frame and go back to text mode (e.g. when the stream is closed)
+	void reset() {
+		setMode(TEXT_MODE);
+		error_ = false;
+	}
+
+	size_t pendingSize() const {
+		return pending_.length();
+	}
+
+	// a malformed binary frame is received and the stream cannot be parsed any more
+	bool hasError() const {
+		return error_;
+	}
+
+private:
+	void appendPending(const char* data, size_t len) {
+		if (discarding_)
+			return;
+		if (pending_.length() + len > maxFrameSize_) {
+			// the line is insanely long, skip it until the next '\n'
+			pending_.clear();
+			discarding_ = true;
+			return;
+		}
+		pending_.append(data, len);
+	}
+
+	// parse one binary frame, or a part of it, and returns the position of the unparsed data
+	template <typename Handler>
+	const char* feedBinary(const char* data, const char* end, Handler& onFrame) {
+		FrameHeader header;
+		if (pending_.empty()) {
+			if (size_t(end - data) >= frameHeaderSize) {
+				if (!decodeFrameHeader(data, header)) {
+					error_ = true;
+					return end;
+				}
+				if (size_t(end - data) - frameHeaderSize >= header.length) {
+					// the whole frame is in the read buffer
+					onFrame(&header, data + frameHeaderSize, header.length);
+					return data + frameHeaderSize + header.length;
+				}
+			}
+			// keep the partial frame until more data arrives
+			pending_.assign(data, end - data);
+			return end;
+		}
+
+		// complete the partial frame left by the previous read
+		if (pending_.length() < frameHeaderSize) {
+			size_t n = (std::min)(frameHeaderSize - pending_.length(), size_t(end - data));
+			pending_.append(data, n);
+			data += n;
+			if (pending_.length() < frameHeaderSize)
+				return data;
+		}
+		if (!decodeFrameHeader(pending_.data(), header)) {
+			error_ = true;
+			return end;
+		}
+		size_t n = (std::min)(frameHeaderSize + header.length - pending_.length(), size_t(end - data));
+		pending_.append(data, n);
+		data += n;
+		if (pending_.length() == frameHeaderSize + header.length) {
+			onFrame(&header, pending_.data() + frameHeaderSize, header.length);
+			pending_.clear();
+		}
+		return data;
+	}
+
+private:
+	std::string pending_;  // trailing partial frame of the previous read
+	size_t maxFrameSize_;
+	Mode mode_;
+	bool discarding_;
+	bool error_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_STREAM_FRAMER_H_
@@ -0,0 +1,367 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+// Feeds random streams of text lines and binary frames to StreamFramer split at
+// random points, as libuv would hand them to us, and checks the reassembled frames.
+// Then compares the cost of the text and binary framing of the backend protocol
+// at 10k messages per second.
+//
+// Usage: PIMEStreamFramerBench [--fuzz <iterations>] [--bench <iterations>] [--seed <n>]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#include "StreamFramer.h"
+#include "BackendServer.h"
+
+using namespace std;
+using namespace PIME;
+
+// small enough that the fuzzer produces lines which are too long
+static const size_t fuzzMaxFrameSize = 512;
+
+struct Frame {
+	bool binary;
+	FrameHeader header;
+	string data;
+};
+
+class StreamGenerator {
+public:
+	explicit StreamGenerator(unsigned int seed) :
+		random_{ seed } {
+	}
+
+	// a stream starting with text lines, which might switch to binary frames
+	// after backendFramingAck like a backend does. the frames the framer should
+	// return are added to expected, and textLen is set to the length of the text part.
+	string stream(vector<Frame>& expected, size_t& textLen, bool& corrupted) {
+		string stream;
+		expected.clear();
+		corrupted = false;
+		int lineCount = int(pick(8));
+		for (int i = 0; i < lineCount; ++i) {
+			string line = text(pick(8) == 0 ? fuzzMaxFrameSize * 2 : 64);
+			stream += line;
+			stream += '\n';
+			if (line.length() <= fuzzMaxFrameSize) {
+				expected.push_back(Frame{ false, FrameHeader(), line });
+			}
+		}
+		if (pick(4) != 0) {
+			stream += backendFramingAck;
+			stream += '\n';
+			expected.push_back(Frame{ false, FrameHeader(), backendFramingAck });
+			textLen = stream.length();
+
+			int frameCount = int(pick(10));
+			for (int i = 0; i < frameCount; ++i) {
+				Frame frame{ true, FrameHeader(), binary(pick(4) == 0 ? 4096 : 64) };
+				frame.header.type = uint16_t(pick(2) ? FRAME_REPLY : FRAME_LOG);
+				frame.header.length = uint32_t(frame.data.length());
+				frame.header.clientHandle = uint32_t(random_());
+				frame.header.seqNum = uint32_t(random_());
+				char header[frameHeaderSize];
+				encodeFrameHeader(frame.header, header);
+				if (i > 0 && pick(32) == 0) {
+					// a corrupted header. the framer should stop at it.
+					header[pick(2)] ^= 0x20;
+					stream.append(header, frameHeaderSize);
+					stream += frame.data;
+					corrupted = true;
+					break;
+				}
+				stream.append(header, frameHeaderSize);
+				stream += frame.data;
+				expected.push_back(frame);
+			}
+		}
+		else {
+			// a trailing partial line is kept by the framer, not returned
+			if (pick(2))
+				stream += text(16);
+			textLen = stream.length();
+		}
+		return stream;
+	}
+
+	// split points of a stream, mostly small reads so that frames are cut everywhere
+	vector<size_t> chunks(size_t len) {
+		vector<size_t> sizes;
+		while (len > 0) {
+			size_t n;
+			switch (pick(4)) {
+			case 0:
+				n = 1;
+				break;
+			case 1:
+				n = pick(frameHeaderSize) + 1;
+				break;
+			case 2:
+				n = pick(256) + 1;
+				break;
+			default:
+				n = pick(8192) + 1;
+				break;
+			}
+			n = (std::min)(n, len);
+			sizes.push_back(n);
+			len -= n;
+		}
+		return sizes;
+	}
+
+	size_t pick(size_t n) {
+		return random_() % n;
+	}
+
+private:
+	// a text line without '\n', which might contain '\r', '|', and NUL
+	string text(size_t maxLen) {
+		static const char chars[] = "PIME_MSG|0123456789{}\":,abc \r\t\xe4\xb8\xad";
+		string line;
+		size_t len = pick(maxLen + 1);
+		for (size_t i = 0; i < len; ++i) {
+			line += pick(64) == 0 ? '\0' : chars[pick(sizeof(chars) - 1)];
+		}
+		return line;
+	}
+
+	// any bytes, including '\n' and bytes that look like a frame header
+	string binary(size_t maxLen) {
+		string data;
+		size_t len = pick(maxLen + 1);
+		for (size_t i = 0; i < len; ++i) {
+			switch (pick(8)) {
+			case 0:
+				data += '\n';
+				break;
+			case 1:
+				data += '\0';
+				break;
+			case 2:
+				data += char(frameMagic & 0xff);
+				break;
+			default:
+				data += char(random_() & 0xff);
+				break;
+			}
+		}
+		return data;
+	}
+
+private:
+	mt19937 random_;
+};
+
+static bool sameFrame(const Frame& a, const Frame& b) {
+	if (a.binary != b.binary || a.data != b.data)
+		return false;
+	if (a.binary) {
+		return a.header.type == b.header.type && a.header.length == b.header.length
+			&& a.header.clientHandle == b.header.clientHandle && a.header.seqNum == b.header.seqNum;
+	}
+	return true;
+}
+
+static bool fuzz(unsigned int iterations, unsigned int seed) {
+	StreamGenerator generator{ seed };
+	StreamFramer framer{ fuzzMaxFrameSize };
+	unsigned int failures = 0;
+	vector<Frame> expected;
+	vector<Frame> received;
+	for (unsigned int i = 0; i < iterations && failures < 10; ++i) {
+		size_t expectedTextLen;
+		bool corrupted;
+		string stream = generator.stream(expected, expectedTextLen, corrupted);
+		received.clear();
+		framer.reset();
+		size_t textLen = 0;
+		size_t pos = 0;
+		for (size_t n : generator.chunks(stream.length())) {
+			// copy the chunk to a buffer of the exact size, so reading past the end is caught by sanitizers
+			vector<char> chunk(stream.begin() + pos, stream.begin() + pos + n);
+			pos += n;
+			textLen += framer.feed(chunk.data(), chunk.size(), [&](const FrameHeader* header, const char* data, size_t len) {
+				Frame frame{ header != nullptr, header ? *header : FrameHeader(), string(data, len) };
+				if (!frame.binary && frame.data == backendFramingAck) {
+					framer.setMode(StreamFramer::BINARY_MODE);
+				}
+				received.push_back(frame);
+			});
+			if (framer.hasError())
+				break;
+		}
+
+		const char* error = nullptr;
+		if (framer.hasError() != corrupted)
+			error = corrupted ? "corrupted header is accepted" : "unexpected error";
+		else if (received.size() != expected.size())
+			error = "wrong number of frames";
+		else if (!corrupted && textLen != expectedTextLen)
+			error = "wrong length of the text part";
+		else {
+			for (size_t j = 0; j < expected.size(); ++j) {
+				if (!sameFrame(received[j], expected[j])) {
+					error = "frames are different";
+					break;
+				}
+			}
+		}
+		if (error != nullptr) {
+			fprintf(stderr, "Iteration %u: %s (expected %u frames, got %u)\n", i, error, unsigned(expected.size()), unsigned(received.size()));
+			++failures;
+		}
+	}
+	printf("fuzz: %u iterations, %u failures\n", iterations, failures);
+	return failures == 0;
+}
+
+template <typename Func>
+static double measure(unsigned int iterations, Func func) {
+	auto start = chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i) {
+		func();
+	}
+	auto elapsed = chrono::steady_clock::now() - start;
+	return chrono::duration<double, nano>(elapsed).count() / iterations;
+}
+
+// a typical reply of onKeyDown with a candidate list
+static string replyJson() {
+	string json = "{\"success\":true,\"return\":true,\"seqNum\":12345,\"compositionString\":\"\\u4e2d\",\"candidateList\":[";
+	for (int i = 0; i < 9; ++i) {
+		if (i > 0)
+			json += ',';
+		json += "\"\\u4e2d\\u6587\"";
+	}
+	json += "],\"showCandidates\":true,\"cursorPos\":1}";
+	return json;
+}
+
+// the messages exchanged with a backend in one second at this rate
+static const size_t messagesPerSecond = 10000;
+// size of the reads of the backend output
+static const size_t readSize = 65536;
+
+// encodes the requests and reassembles the replies of one second of traffic in a framing mode,
+// the same way BackendWorker does. returns the number of replies parsed.
+static size_t exchange(StreamFramer::Mode mode, const string& request, const string& replies, string& requestStream) {
+	requestStream.clear();
+	char header[frameHeaderSize];
+	for (size_t i = 0; i < messagesPerSecond; ++i) {
+		ClientTable::Handle clientHandle = ClientTable::Handle(i % 64 + 1);
+		if (mode == StreamFramer::BINARY_MODE) {
+			FrameHeader frameHeader = { FRAME_REQUEST, uint32_t(request.length()), clientHandle, uint32_t(i) };
+			encodeFrameHeader(frameHeader, header);
+			requestStream.append(header, frameHeaderSize);
+			requestStream += request;
+		}
+		else {
+			size_t headerLen = ClientTable::formatHandle(clientHandle, header);
+			header[headerLen++] = '|';
+			requestStream.append(header, headerLen);
+			requestStream += request;
+			requestStream += '\n';
+		}
+	}
+
+	StreamFramer framer;
+	framer.setMode(mode);
+	size_t count = 0;
+	for (size_t pos = 0; pos < replies.length(); pos += readSize) {
+		size_t n = (std::min)(readSize, replies.length() - pos);
+		framer.feed(replies.data() + pos, n, [&](const FrameHeader* header, const char* data, size_t len) {
+			ClientTable::Handle clientHandle;
+			const char* msg;
+			size_t msgLen;
+			if (header != nullptr) {
+				if (header->type == FRAME_REPLY && header->clientHandle != 0)
+					++count;
+			}
+			else if (BackendWorker::parseReplyLine(data, len, clientHandle, msg, msgLen) && msgLen > 0) {
+				++count;
+			}
+		});
+	}
+	return count;
+}
+
+static void bench(unsigned int iterations) {
+	// a key event sent by the text service, and a typical reply with a candidate list
+	string request = "{\"method\":\"onKeyDown\",\"charCode\":97,\"keyCode\":65,\"repeatCount\":0,\"scanCode\":30,\"isExtended\":false,\"keyStates\":[0,16],\"seqNum\":12345}";
+	string reply = replyJson();
+
+	// one second of replies in both modes
+	string textReplies;
+	string binaryReplies;
+	char header[frameHeaderSize];
+	for (size_t i = 0; i < messagesPerSecond; ++i) {
+		ClientTable::Handle clientHandle = ClientTable::Handle(i % 64 + 1);
+		textReplies += "PIME_MSG|" + to_string(clientHandle) + "|" + reply + "\n";
+		FrameHeader frameHeader = { FRAME_REPLY, uint32_t(reply.length()), clientHandle, uint32_t(i) };
+		encodeFrameHeader(frameHeader, header);
+		binaryReplies.append(header, frameHeaderSize);
+		binaryReplies += reply;
+	}
+
+	string requestStream;
+	requestStream.reserve(messagesPerSecond * (request.length() + frameHeaderSize + 1));
+	volatile size_t sink = 0;
+	double textTime = measure(iterations, [&]() {
+		sink = sink + exchange(StreamFramer::TEXT_MODE, request, textReplies, requestStream);
+	});
+	double binaryTime = measure(iterations, [&]() {
+		sink = sink + exchange(StreamFramer::BINARY_MODE, request, binaryReplies, requestStream);
+	});
+	printf("%u requests of %u bytes and %u replies of %u bytes per second\n", unsigned(messagesPerSecond),
+		unsigned(request.length()), unsigned(messagesPerSecond), unsigned(reply.length()));
+	printf("text framing: %.1f ns/message, %.2f%% of a core\n", textTime / messagesPerSecond, textTime / 1e7);
+	printf("binary framing: %.1f ns/message, %.2f%% of a core\n", binaryTime / messagesPerSecond, binaryTime / 1e7);
+}
+
+int main(int argc, char** argv) {
+	unsigned int fuzzIterations = 100000;
+	unsigned int benchIterations = 100;
+	unsigned int seed = 1;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--fuzz" && i + 1 < argc)
+			fuzzIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--bench" && i + 1 < argc)
+			benchIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = unsigned(atoi(argv[++i]));
+		else {
+			fprintf(stderr, "Usage: %s [--fuzz iterations] [--bench iterations] [--seed n]\n", argv[0]);
+			return 1;
+		}
+	}
+	bool ok = fuzz(fuzzIterations, seed);
+	if (benchIterations > 0) {
+		bench(benchIterations);
+	}
+	return ok ? 0 : 1;
+}
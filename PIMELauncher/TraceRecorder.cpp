@@ -0,0 +1,189 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <codecvt>  // for utf8 conversion
+#include <locale>  // for wstring_convert
+
+#include <uv.h>
+
+#include "TraceRecorder.h"
+#include "SpscQueue.h"
+
+using namespace std;
+
+namespace PIME {
+
+// max number of events of a thread waiting to be written. more events are dropped.
+static const size_t threadBufferSize = 8192;
+
+struct TraceEvent {
+	const char* name;
+	TraceRecorder::Phase phase;
+	uint64_t time; // in ns
+	uint32_t clientHandle;
+	uint32_t seqNum;
+	char method[32];
+};
+
+// the events recorded by one thread, written by the thread and read by flush()
+struct TraceThreadBuffer {
+	TraceThreadBuffer(uint32_t id, const string& name) :
+		events{ threadBufferSize },
+		id{ id },
+		name(name),
+		droppedEvents{ 0 },
+		nameWritten{ false } {
+	}
+
+	SpscQueue<TraceEvent> events;
+	uint32_t id;
+	string name;
+	atomic<uint64_t> droppedEvents;
+	bool nameWritten; // only accessed by flush()
+};
+
+atomic<bool> TraceRecorder::enabled_{ false };
+
+// the buffers are created when the threads record their first events, and kept until exit.
+static mutex threadBuffersLock;
+static vector<unique_ptr<TraceThreadBuffer>> threadBuffers;
+static thread_local TraceThreadBuffer* currentThreadBuffer = nullptr;
+static thread_local string currentThreadName;
+
+// only accessed by the client loop
+static FILE* traceFile = nullptr;
+static bool hasWrittenEvents = false;
+static uint64_t traceStartTime = 0;
+
+void TraceRecorder::setThreadName(const string& name) {
+	currentThreadName = name;
+}
+
+void TraceRecorder::recordEvent(const char* name, Phase phase, uint32_t clientHandle, uint32_t seqNum, const char* method, size_t methodLen) {
+	if (currentThreadBuffer == nullptr) {
+		lock_guard<mutex> lock(threadBuffersLock);
+		uint32_t id = uint32_t(threadBuffers.size() + 1);
+		string threadName = !currentThreadName.empty() ? currentThreadName : "thread " + to_string(id);
+		threadBuffers.emplace_back(new TraceThreadBuffer(id, threadName));
+		currentThreadBuffer = threadBuffers.back().get();
+	}
+	TraceEvent* event = currentThreadBuffer->events.back();
+	if (event == nullptr) {  // flush() cannot catch up
+		currentThreadBuffer->droppedEvents.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	event->name = name;
+	event->phase = phase;
+	event->time = uv_hrtime();
+	event->clientHandle = clientHandle;
+	event->seqNum = seqNum;
+	// the method comes from the client, keep only the chars which need no escaping in json
+	size_t len = 0;
+	for (; method != nullptr && len < methodLen && len < sizeof(event->method) - 1; ++len) {
+		char c = method[len];
+		event->method[len] = (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') ? c : '?';
+	}
+	event->method[len] = '\0';
+	currentThreadBuffer->events.push();
+}
+
+bool TraceRecorder::start(const wstring& filename) {
+	if (traceFile != nullptr)
+		return true;
+#ifdef _WIN32
+	traceFile = _wfopen(filename.c_str(), L"wb");
+#else
+	traceFile = fopen(wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(filename).c_str(), "wb");
+#endif
+	if (traceFile == nullptr)
+		return false;
+	// discard the events recorded after the previous trace is stopped
+	{
+		lock_guard<mutex> lock(threadBuffersLock);
+		for (auto& buffer : threadBuffers) {
+			while (buffer->events.front() != nullptr) {
+				buffer->events.pop();
+			}
+			buffer->droppedEvents = 0;
+			buffer->nameWritten = false;
+		}
+	}
+	fputs("[\n", traceFile);
+	hasWrittenEvents = false;
+	traceStartTime = uv_hrtime();
+	enabled_ = true;
+	return true;
+}
+
+void TraceRecorder::stop() {
+	if (traceFile == nullptr)
+		return;
+	enabled_ = false;
+	flush();
+	fputs("\n]\n", traceFile);
+	fclose(traceFile);
+	traceFile = nullptr;
+}
+
+void TraceRecorder::flush() {
+	if (traceFile == nullptr)
+		return;
+#ifdef _WIN32
+	int pid = int(GetCurrentProcessId());  // uv_os_getpid() is not in the bundled libuv
+#else
+	int pid = int(uv_os_getpid());
+#endif
+	lock_guard<mutex> lock(threadBuffersLock);
+	for (auto& buffer : threadBuffers) {
+		// each event is written as a line, after the separator of the previous one
+		if (!buffer->nameWritten) {
+			fprintf(traceFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				hasWrittenEvents ? ",\n" : "", pid, buffer->id, buffer->name.c_str());
+			buffer->nameWritten = true;
+			hasWrittenEvents = true;
+		}
+		while (TraceEvent* event = buffer->events.front()) {
+			// event time in us relative to the start of the trace
+			double time = event->time > traceStartTime ? (event->time - traceStartTime) / 1000.0 : 0.0;
+			fprintf(traceFile, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":\"0x%x\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"client\":%u",
+				event->name, char(event->phase), event->clientHandle, time, pid, buffer->id, event->clientHandle);
+			if (event->seqNum != 0)
+				fprintf(traceFile, ",\"seqNum\":%u", event->seqNum);
+			if (event->method[0] != '\0')
+				fprintf(traceFile, ",\"method\":\"%s\"", event->method);
+			fputs("}}", traceFile);
+			buffer->events.pop();
+		}
+		uint64_t dropped = buffer->droppedEvents.exchange(0, memory_order_relaxed);
+		if (dropped > 0) {
+			// a global instant event marking the gap in the trace
+			fprintf(traceFile, ",\n{\"name\":\"%llu events dropped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+				(unsigned long long)dropped, (uv_hrtime() - traceStartTime) / 1000.0, pid, buffer->id);
+		}
+	}
+	fflush(traceFile);
+}
+
+} // namespace PIME
@@ -0,0 +1,78 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_TRACE_RECORDER_H_
+#define _PIME_TRACE_RECORDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+namespace PIME {
+
+// Records the stages of client requests as they pass through the launcher and
+// the backends, and writes them to a file in the Chrome trace event format,
+// which can be opened in chrome://tracing or https://ui.perfetto.dev.
+//
+// Every request is an async span ("b" ... "e") identified by the client handle,
+// since a client has at most one pending request. The stages in between are
+// async instant events ("n") of the same span.
+//
+// record() can be called from any thread. Each thread has its own lock-free
+// buffer, which is drained by flush() in the client loop. Nothing is allocated
+// and only an atomic flag is read when tracing is off.
+class TraceRecorder {
+public:
+	enum Phase : char {
+		BEGIN = 'b',
+		INSTANT = 'n',
+		END = 'e'
+	};
+
+	static bool isEnabled() {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	// name must be a string literal. method is optional and truncated if it's too long.
+	static void record(const char* name, Phase phase, uint32_t clientHandle, uint32_t seqNum = 0, const char* method = nullptr, size_t methodLen = 0) {
+		if (isEnabled()) {
+			recordEvent(name, phase, clientHandle, seqNum, method, methodLen);
+		}
+	}
+
+	// the name of the current thread shown in the trace viewer
+	static void setThreadName(const std::string& name);
+
+	// called in the client loop
+	static bool start(const std::wstring& filename);
+	static void stop();
+	// write the recorded events to the file
+	static void flush();
+
+private:
+	static void recordEvent(const char* name, Phase phase, uint32_t clientHandle, uint32_t seqNum, const char* method, size_t methodLen);
+
+	static std::atomic<bool> enabled_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_TRACE_RECORDER_H_
@@ -0,0 +1,57 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_TRANSPORT_H_
+#define _PIME_TRANSPORT_H_
+
+#include <uv.h>
+
+namespace PIME {
+
+// The IPC channel between the launcher and its clients (the text service in
+// every app, and the debug console).
+// Connections are always libuv pipe handles, but how they are created and
+// named depends on the platform:
+//   * Windows: named pipes in message mode, see NamedPipeTransport.
+//   * Others: Unix domain sockets, see UnixSocketTransport. Mainly used to
+//     test and benchmark the launcher without a Windows desktop.
+class Transport {
+public:
+	virtual ~Transport() {}
+
+	// initialize the server handle and bind it to the channel with the name, such as "Launcher".
+	// if allowAppContainers is true, apps running in sandboxes can connect to it as well.
+	// returns 0 on success or a libuv error code.
+	virtual int listen(uv_loop_t* loop, uv_pipe_t* server, const char* name, bool allowAppContainers) = 0;
+
+	// initialize the client handle and accept the pending connection of the server into it.
+	virtual int accept(uv_pipe_t* server, uv_pipe_t* client) = 0;
+
+	// if the transport does not keep the boundaries of messages, every client
+	// message and reply is wrapped in a binary frame (see BackendProtocol.h).
+	virtual bool preservesMessageBoundaries() const = 0;
+};
+
+// the default transport of the platform
+Transport* createDefaultTransport();
+
+} // namespace PIME
+
+#endif // _PIME_TRANSPORT_H_
@@ -0,0 +1,59 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#include "UnixSocketTransport.h"
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace PIME {
+
+Transport* createDefaultTransport() {
+	return new UnixSocketTransport();
+}
+
+string UnixSocketTransport::socketDir() {
+	if (const char* dir = getenv("PIME_SOCKET_DIR"))
+		return dir;
+	if (const char* runtimeDir = getenv("XDG_RUNTIME_DIR"))
+		return string(runtimeDir) + "/PIME";
+	// add uid to the path so it will not clash with other users' sockets.
+	return "/tmp/PIME-" + to_string(getuid());
+}
+
+int UnixSocketTransport::listen(uv_loop_t* loop, uv_pipe_t* server, const char* name, bool allowAppContainers) {
+	// only the current user can connect to the sockets
+	string dir = socketDir();
+	mkdir(dir.c_str(), 0700);
+	string path = dir + "/" + name;
+	// remove the stale socket left by a previous launcher which did not quit normally
+	unlink(path.c_str());
+	uv_pipe_init(loop, server, 0);
+	return uv_pipe_bind(server, path.c_str());
+}
+
+int UnixSocketTransport::accept(uv_pipe_t* server, uv_pipe_t* client) {
+	uv_pipe_init(server->loop, client, 0);
+	return uv_accept((uv_stream_t*)server, (uv_stream_t*)client);
+}
+
+} // namespace PIME
@@ -0,0 +1,51 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_UNIX_SOCKET_TRANSPORT_H_
+#define _PIME_UNIX_SOCKET_TRANSPORT_H_
+
+#include <string>
+
+#include "Transport.h"
+
+namespace PIME {
+
+// Unix domain sockets: <socket dir>/<name>
+// The socket dir is $PIME_SOCKET_DIR, or $XDG_RUNTIME_DIR/PIME, or /tmp/PIME-<uid>.
+// Sockets are byte streams, so the messages are framed.
+class UnixSocketTransport : public Transport {
+public:
+	virtual int listen(uv_loop_t* loop, uv_pipe_t* server, const char* name, bool allowAppContainers);
+	virtual int accept(uv_pipe_t* server, uv_pipe_t* client);
+
+	virtual bool preservesMessageBoundaries() const {
+		return false;
+	}
+
+	static std::string socketDir();
+
+	static std::string getSocketPath(const char* name) {
+		return socketDir() + "/" + name;
+	}
+};
+
+} // namespace PIME
+
+#endif // _PIME_UNIX_SOCKET_TRANSPORT_H_
@@ -1,11 +1,24 @@
 #include <fstream>
 #include "Utils.h"
 
+#ifndef _WIN32
+#include <codecvt>  // for utf8 conversion
+#include <locale>  // for wstring_convert
+#endif
+
 bool loadJsonFile(const std::wstring filename, Json::Value& result) {
+#ifdef _WIN32
 	std::ifstream fp(filename, std::ifstream::binary);
+#else
+	// file names are UTF-8 encoded on other platforms
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8Codec;
+	std::ifstream fp(utf8Codec.to_bytes(filename), std::ifstream::binary);
+#endif
 	if (fp) {
-		fp >> result;
-		return true;
+		// NOTE: don't use operator>> which throws on syntax errors. the file might be
+		// in the middle of being edited when we reload it.
+		Json::Reader reader;
+		return reader.parse(fp, result);
 	}
 	return false;
 }
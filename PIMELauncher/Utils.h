@@ -1,8 +1,25 @@
 #ifndef _PIME_LAUNCHER_UTILS_H_
 #define _PIME_LAUNCHER_UTILS_H_
 
+#include <string>
 #include <json/json.h>
 
+#ifndef _WIN32
+#include <strings.h>
+#define _stricmp strcasecmp
+#endif
+
+// separator of the components of file paths
+#ifdef _WIN32
+const wchar_t pathSeparator = L'\\';
+#else
+const wchar_t pathSeparator = L'/';
+#endif
+
+inline std::wstring joinPath(const std::wstring& dir, const std::wstring& name) {
+	return dir + pathSeparator + name;
+}
+
 bool loadJsonFile(const std::wstring filename, Json::Value& result);
 
 #endif // _PIME_LAUNCHER_UTILS_H_
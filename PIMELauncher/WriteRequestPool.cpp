@@ -0,0 +1,123 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#include "WriteRequestPool.h"
+#include "TraceRecorder.h"
+
+namespace PIME {
+
+// don't keep huge buffers in the free list after writing a large message
+static const size_t maxPooledBufferSize = 64 * 1024;
+
+WriteRequestPool::WriteRequestPool(size_t maxFreeRequests) :
+	freeList_{nullptr},
+	freeCount_{0},
+	maxFreeRequests_{maxFreeRequests},
+	allocatedCount_{0} {
+}
+
+WriteRequestPool::~WriteRequestPool() {
+	// NOTE: requests which are still being written are owned by libuv and freed in their callbacks.
+	while (freeList_ != nullptr) {
+		Request* request = freeList_;
+		freeList_ = request->next;
+		delete request;
+	}
+}
+
+WriteRequestPool::Request* WriteRequestPool::allocRequest() {
+	Request* request = freeList_;
+	if (request != nullptr) {
+		freeList_ = request->next;
+		--freeCount_;
+	}
+	else {
+		request = new Request{};
+		request->pool = this;
+		request->req.data = request;
+		++allocatedCount_;
+	}
+	request->next = nullptr;
+	return request;
+}
+
+void WriteRequestPool::freeRequest(Request* request) {
+	if (freeCount_ >= maxFreeRequests_) {
+		delete request;
+		--allocatedCount_;
+		return;
+	}
+	if (request->data.capacity() > maxPooledBufferSize) {
+		std::string().swap(request->data);
+	}
+	request->data.clear();
+	request->next = freeList_;
+	freeList_ = request;
+	++freeCount_;
+}
+
+int WriteRequestPool::write(uv_stream_t* stream, const uv_buf_t* bufs, unsigned int nbufs, const char* traceName, uint32_t traceClient) {
+	size_t total = 0;
+	for (unsigned int i = 0; i < nbufs; ++i) {
+		total += bufs[i].len;
+	}
+
+	// write as much as possible right now if nothing is queued in the stream.
+	// this fails with UV_EAGAIN if the pipe is busy or does not support it.
+	int written = uv_try_write(stream, bufs, nbufs);
+	if (written < 0) {
+		written = 0;
+	}
+	if (size_t(written) == total) {
+		if (traceName != nullptr) {
+			TraceRecorder::record(traceName, TraceRecorder::INSTANT, traceClient);
+		}
+		return 0;
+	}
+
+	// copy the remaining data, which the caller might free after we return, to a pooled request.
+	// NOTE: it's written as a single buffer since multi-buffer writes are not
+	// supported by every libuv version on Windows pipes.
+	Request* request = allocRequest();
+	request->traceName = traceName;
+	request->traceClient = traceClient;
+	size_t skip = size_t(written);
+	for (unsigned int i = 0; i < nbufs; ++i) {
+		if (skip >= bufs[i].len) {
+			skip -= bufs[i].len;
+			continue;
+		}
+		request->data.append(bufs[i].base + skip, bufs[i].len - skip);
+		skip = 0;
+	}
+	uv_buf_t buf = uv_buf_init(&request->data[0], unsigned(request->data.length()));
+	int ret = uv_write(&request->req, stream, &buf, 1, [](uv_write_t* req, int status) {
+		Request* request = reinterpret_cast<Request*>(req->data);
+		if (request->traceName != nullptr) {
+			TraceRecorder::record(request->traceName, TraceRecorder::INSTANT, request->traceClient);
+		}
+		request->pool->freeRequest(request);
+	});
+	if (ret < 0) {
+		freeRequest(request);
+	}
+	return ret;
+}
+
+} // namespace PIME
@@ -0,0 +1,85 @@
+//
+//	Copyright (C) 2015 - 2016 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+#ifndef _PIME_WRITE_REQUEST_POOL_H_
+#define _PIME_WRITE_REQUEST_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <uv.h>
+
+namespace PIME {
+
+// Writes messages to libuv streams without allocating memory per message.
+// The message can be given as several slices (e.g. header, payload, and trailer)
+// borrowed from the caller, such as a read buffer which is freed right after
+// the write call returns. We first try to write the slices synchronously with
+// uv_try_write(). Only the part which cannot be written immediately is copied
+// to a pooled write request and written asynchronously. The requests and their
+// buffers are recycled, so no memory is allocated in steady state.
+class WriteRequestPool {
+public:
+	explicit WriteRequestPool(size_t maxFreeRequests = 64);
+	~WriteRequestPool();
+
+	// write the concatenation of the slices to the stream as one message.
+	// the slices can be released by the caller once this returns.
+	// returns 0 on success, or a libuv error code.
+	// if traceName is given, a trace event is recorded for the client when the write completes.
+	int write(uv_stream_t* stream, const uv_buf_t* bufs, unsigned int nbufs, const char* traceName = nullptr, uint32_t traceClient = 0);
+
+	int write(uv_stream_t* stream, const char* data, size_t len) {
+		uv_buf_t buf = uv_buf_init(const_cast<char*>(data), unsigned(len));
+		return write(stream, &buf, 1);
+	}
+
+	// statistics
+	size_t allocatedCount() const { // number of requests ever allocated
+		return allocatedCount_;
+	}
+
+	size_t freeCount() const { // number of requests in the free list
+		return freeCount_;
+	}
+
+private:
+	struct Request {
+		uv_write_t req;
+		WriteRequestPool* pool;
+		std::string data; // its capacity is kept when the request is recycled
+		const char* traceName;
+		uint32_t traceClient;
+		Request* next; // next request in the free list
+	};
+
+	Request* allocRequest();
+	void freeRequest(Request* request);
+
+private:
+	Request* freeList_;
+	size_t freeCount_;
+	size_t maxFreeRequests_;
+	size_t allocatedCount_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_WRITE_REQUEST_POOL_H_
@@ -0,0 +1,126 @@
+//
+//	Copyright (C) 2014 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_CANDIDATE_CACHE_H_
+#define _PIME_CANDIDATE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "PIMEReplyDecoder.h"
+
+namespace PIME {
+
+// The pages of the current candidate source which the client already received,
+// converted to UTF-16. Only a few pages are kept, and the least recently used one is dropped first.
+class CandidatePageCache {
+public:
+	static const size_t maxPages = 8;
+
+	CandidatePageCache() :
+		source_(),
+		clock_{ 0 } {
+	}
+
+	const CandidateSource& source() const {
+		return source_;
+	}
+
+	// a new candidate list replaces the pages of the old one
+	void reset(const CandidateSource& source) {
+		source_ = source;
+		pages_.clear();
+	}
+
+	void clear() {
+		reset(CandidateSource());
+	}
+
+	bool contains(uint32_t source, uint32_t index) const {
+		return find(source, index) != nullptr;
+	}
+
+	// keep a page of the current source. the candidates are taken by swapping the vector.
+	void put(uint32_t source, uint32_t index, std::vector<std::wstring>& candidates) {
+		if (source != source_.id || index >= source_.pageCount())
+			return;
+		Page* page = const_cast<Page*>(find(source, index));
+		if (page == nullptr) {
+			if (pages_.size() < maxPages) {
+				pages_.emplace_back();
+				page = &pages_.back();
+			}
+			else {  // replace the least recently used page
+				page = &pages_[0];
+				for (auto& p : pages_) {
+					if (p.lastUsed < page->lastUsed)
+						page = &p;
+				}
+			}
+			page->index = index;
+		}
+		page->candidates.swap(candidates);
+		page->lastUsed = ++clock_;
+	}
+
+	// keep the candidates of a page sent by the server, if they are sent. a page of another
+	// source replaces the pages of the current one, in case we missed its candidateSource.
+	void put(CandidatePage& page) {
+		if (page.source != source_.id && page.pageSize != 0)
+			reset(CandidateSource{ page.source, page.count, page.pageSize });
+		if (page.hasCandidates)
+			put(page.source, page.index, page.candidates);
+	}
+
+	// returns null if the page is not in the cache
+	const std::vector<std::wstring>* get(uint32_t source, uint32_t index) {
+		Page* page = const_cast<Page*>(find(source, index));
+		if (page == nullptr)
+			return nullptr;
+		page->lastUsed = ++clock_;
+		return &page->candidates;
+	}
+
+private:
+	struct Page {
+		uint32_t index;
+		uint64_t lastUsed;
+		std::vector<std::wstring> candidates;
+	};
+
+	const Page* find(uint32_t source, uint32_t index) const {
+		if (source != source_.id)
+			return nullptr;
+		for (const auto& page : pages_) {
+			if (page.index == index)
+				return &page;
+		}
+		return nullptr;
+	}
+
+	CandidateSource source_;
+	std::vector<Page> pages_;
+	uint64_t clock_;
+};
+
+} // namespace PIME
+
+#endif // _PIME_CANDIDATE_CACHE_H_
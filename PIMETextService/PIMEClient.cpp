@@ -42,7 +42,12 @@ Client::Client(TextService* service, REFIID langProfileGuid):
 	pipe_(INVALID_HANDLE_VALUE),
 	newSeqNum_(0),
 	isActivated_(false),
-	connectingServerPipe_(false) {
+	connectingServerPipe_(false),
+	compactKeyEvents_(false),
+	keyInterest_(),
+	fusedReply_(),
+	fusedReplyDropped_(false),
+	resyncNeeded_(false) {
 
 	LPOLESTR guidStr = NULL;
 	if (SUCCEEDED(::StringFromCLSID(langProfileGuid, &guidStr))) {
@@ -64,28 +69,121 @@ Client::~Client(void) {
 	LangBarButton::clearIconCache();
 }
 
+// keys whose states are sent as bits of "keyModifiers" in the compact key events.
+// bit i is set if the key is down, and bit (16 + i) is set if it's toggled.
+// NOTE: keep this in sync with COMPACT_STATE_KEYS in python/textService.py.
+static const BYTE compactStateKeys[] = {
+	VK_SHIFT, VK_CONTROL, VK_MENU,
+	VK_LSHIFT, VK_RSHIFT, VK_LCONTROL, VK_RCONTROL, VK_LMENU, VK_RMENU,
+	VK_LWIN, VK_RWIN,
+	VK_CAPITAL, VK_NUMLOCK, VK_SCROLL
+};
+
 // pack a keyEvent object into a json value
-//static
 void Client::keyEventToJson(Ime::KeyEvent& keyEvent, Json::Value& jsonValue) {
 	jsonValue["charCode"] = keyEvent.charCode();
 	jsonValue["keyCode"] = keyEvent.keyCode();
 	jsonValue["repeatCount"] = keyEvent.repeatCount();
 	jsonValue["scanCode"] = keyEvent.scanCode();
 	jsonValue["isExtended"] = keyEvent.isExtended();
-	Json::Value keyStates(Json::arrayValue);
 	const BYTE* states = keyEvent.keyStates();
-	for(int i = 0; i < 256; ++i) {
-		keyStates.append(states[i]);
+	if (compactKeyEvents_) {
+		// the full array is about 1 KB of json, while usually only a few keys are down.
+		// send the states of the modifier and lock keys as a bitmask, and the other keys which are down.
+		bool isStateKey[256] = { false };
+		unsigned int modifiers = 0;
+		for (int i = 0; i < _countof(compactStateKeys); ++i) {
+			BYTE key = compactStateKeys[i];
+			isStateKey[key] = true;
+			if (states[key] & 0x80)
+				modifiers |= (1 << i);
+			if (states[key] & 1)
+				modifiers |= (1 << (16 + i));
+		}
+		Json::Value keysDown(Json::arrayValue);
+		for (int i = 0; i < 256; ++i) {
+			if ((states[i] & 0x80) && !isStateKey[i]) {
+				keysDown.append(i);
+			}
+		}
+		jsonValue["keyModifiers"] = modifiers;
+		jsonValue["keysDown"] = keysDown;
+	}
+	else {
+		Json::Value keyStates(Json::arrayValue);
+		for (int i = 0; i < 256; ++i) {
+			keyStates.append(states[i]);
+		}
+		jsonValue["keyStates"] = keyStates;
+	}
+}
+
+// check if the key should be sent to the server for filtering
+bool Client::isKeyInteresting(Ime::KeyEvent& keyEvent, bool keyDown) {
+	if (!keyInterest_.valid)
+		return true;
+	if (keyInterest_.whileComposing && (textService_->isComposing() || textService_->showingCandidates()))
+		return true;
+	unsigned int modifiers = 0;
+	if (keyEvent.isKeyDown(VK_MENU))
+		modifiers |= TF_MOD_ALT;
+	if (keyEvent.isKeyDown(VK_CONTROL))
+		modifiers |= TF_MOD_CONTROL;
+	if (keyEvent.isKeyDown(VK_SHIFT))
+		modifiers |= TF_MOD_SHIFT;
+	if (modifiers & keyInterest_.modifiers)
+		return true;
+	UINT keyCode = keyEvent.keyCode();
+	const auto& keys = keyDown ? keyInterest_.keyDown : keyInterest_.keyUp;
+	return keyCode >= keys.size() || keys.test(keyCode);
+}
+
+void Client::saveFusedReply(Ime::KeyEvent& keyEvent, bool keyDown, std::string& reply) {
+	fusedReply_.keyDown = keyDown;
+	fusedReply_.keyCode = keyEvent.keyCode();
+	fusedReply_.charCode = keyEvent.charCode();
+	fusedReply_.scanCode = keyEvent.scanCode();
+	fusedReply_.repeatCount = keyEvent.repeatCount();
+	fusedReply_.isExtended = keyEvent.isExtended();
+	fusedReply_.reply.swap(reply);
+}
+
+// check if the server already handled this key event
+bool Client::hasFusedReply(Ime::KeyEvent& keyEvent, bool keyDown) {
+	return !fusedReply_.reply.empty()
+		&& fusedReply_.keyDown == keyDown
+		&& fusedReply_.keyCode == keyEvent.keyCode()
+		&& fusedReply_.charCode == keyEvent.charCode()
+		&& fusedReply_.scanCode == keyEvent.scanCode()
+		&& fusedReply_.repeatCount == keyEvent.repeatCount()
+		&& fusedReply_.isExtended == keyEvent.isExtended();
+}
+
+// get the saved reply of the key event if there's one.
+// otherwise it's dropped by dropFusedReply() when another key comes.
+bool Client::takeFusedReply(Ime::KeyEvent& keyEvent, bool keyDown, Reply& reply) {
+	if (!hasFusedReply(keyEvent, keyDown) || !ReplyDecoder::decode(fusedReply_.reply, reply))
+		return false;
+	fusedReply_.reply.clear();
+	return true;
+}
+
+// TSF does not send the key handled with the previous filter as we expect, e.g. the
+// char code is changed, or it's not sent again at all. drop the saved reply and tell
+// the server with the next request, see sendRequest(). it reuses the reply instead of
+// handling the key twice if it's the same key, or sends us its whole state otherwise.
+void Client::dropFusedReply() {
+	if (!fusedReply_.reply.empty()) {
+		fusedReplyDropped_ = true;
+		fusedReply_.reply.clear();
 	}
-	jsonValue["keyStates"] = keyStates;
 }
 
-bool Client::handleReply(Json::Value& msg, Ime::EditSession* session) {
-	bool success = msg.get("success", false).asBool();
-	if (success) {
-		updateStatus(msg, session);
+bool Client::handleReply(Reply& reply, Ime::EditSession* session) {
+	if (reply.success) {
+		updateStatus(reply, session);
 	}
-	return success;
+	return reply.success;
 }
 
 void Client::updateUI(const Json::Value& data) {
@@ -108,193 +206,200 @@ void Client::updateUI(const Json::Value& data) {
 	}
 }
 
-void Client::updateStatus(Json::Value& msg, Ime::EditSession* session) {
-	// We need to handle ordering of some types of the requests.
-	// For example, setCompositionCursor() should happen after setCompositionCursor().
+class Client::StatusUpdater : public ReplyApplier {
+public:
+	StatusUpdater(Client* client, Ime::EditSession* session) :
+		client_(client),
+		textService_(client->textService_),
+		session_(session),
+		endComposition_(false) {
+	}
+
+	void setKeyInterest(const KeyInterest& keyInterest) override {
+		client_->keyInterest_ = keyInterest;
+	}
 
-	// set sel keys before update candidates
-	const auto& setSelKeysVal = msg["setSelKeys"];
-	if (setSelKeysVal.isString()) {
+	void setSelKeys(const std::wstring& selKeys) override {
 		// keys used to select candidates
-		std::wstring selKeys = utf8ToUtf16(setSelKeysVal.asCString());
 		textService_->setSelKeys(selKeys);
 	}
 
-	// show message
-    bool endComposition = false;
-	const auto& showMessageVal = msg["showMessage"];
-	if (showMessageVal.isObject()) {
-		const Json::Value& message = showMessageVal["message"];
-		const Json::Value& duration = showMessageVal["duration"];
-		if (message.isString() && duration.isInt()) {
+	void showMessage(const std::wstring& message, int duration) override {
+		if (!textService_->isComposing()) {
+			textService_->startComposition(session_->context());
+			endComposition_ = true;
+		}
+		textService_->showMessage(session_, message, duration);
+	}
+
+	// the following changes need an edit session
+
+	void showCandidates(bool show) override {
+		if (session_ == nullptr)
+			return;
+		if (show) {
+			// start composition if we are not composing.
+			// this is required to get correctly position the candidate window
 			if (!textService_->isComposing()) {
-				textService_->startComposition(session->context());
-                endComposition = true;
+				textService_->startComposition(session_->context());
 			}
-			textService_->showMessage(session, utf8ToUtf16(message.asCString()), duration.asInt());
+			textService_->showCandidates(session_);
+		}
+		else {
+			textService_->hideCandidates();
 		}
 	}
 
-	if (session != nullptr) { // if an edit session is available
-		// handle candidate list
-		const auto& showCandidatesVal = msg["showCandidates"];
-		if (showCandidatesVal.isBool()) {
-			if (showCandidatesVal.asBool()) {
-				// start composition if we are not composing.
-				// this is required to get correctly position the candidate window
-				if (!textService_->isComposing()) {
-					textService_->startComposition(session->context());
-				}
-				textService_->showCandidates(session);
-			}
-			else {
-				textService_->hideCandidates();
-			}
+	void setCandidateList(vector<wstring>& candidates, bool showCandidates) override {
+		if (session_ == nullptr)
+			return;
+		// FIXME: directly access private member is dirty!!!
+		textService_->candidates_.swap(candidates);
+		textService_->updateCandidates(session_);
+		if (!showCandidates) {
+			textService_->hideCandidates();
 		}
+	}
 
-		const auto& candidateListVal = msg["candidateList"];
-		if (candidateListVal.isArray()) {
-			// handle candidates
-			// FIXME: directly access private member is dirty!!!
-			vector<wstring>& candidates = textService_->candidates_;
-			candidates.clear();
-			for (auto cand_it = candidateListVal.begin(); cand_it != candidateListVal.end(); ++cand_it) {
-				wstring cand = utf8ToUtf16(cand_it->asCString());
-				candidates.push_back(cand);
-			}
-			textService_->updateCandidates(session);
-			if (!showCandidatesVal.asBool()) {
-				textService_->hideCandidates();
-			}
+	void setCandidateSource(const CandidateSource& source) override {
+		client_->candidatePages_.reset(source);
+	}
+
+	void setCandidatePage(CandidatePage& page, bool showCandidates) override {
+		CandidatePageCache& cache = client_->candidatePages_;
+		cache.put(page);
+		// use the page even if it's not shown, so the cache drops the same pages as the server thinks
+		const vector<wstring>* candidates = cache.get(page.source, page.index);
+		if (candidates == nullptr) {
+			// the server thinks we have the page, but the reply with it is lost. do not ask for it
+			// here in the middle of handling a reply, but let the next reply bring the whole state.
+			client_->resyncNeeded_ = true;
+		}
+		if (session_ == nullptr)
+			return;
+		// FIXME: directly access private member is dirty!!!
+		if (candidates != nullptr)
+			textService_->candidates_ = *candidates;
+		else
+			textService_->candidates_.clear();
+		textService_->updateCandidates(session_);
+		if (!showCandidates) {
+			textService_->hideCandidates();
 		}
+	}
 
-		const auto& candidateCursorVal = msg["candidateCursor"];
-		if (candidateCursorVal.isInt()) {
-			if (textService_->candidateWindow_ != nullptr) {
-				textService_->candidateWindow_->setCurrentSel(candidateCursorVal.asInt());
-				textService_->refreshCandidates();
-			}
+	void setCandidateCursor(int cursor) override {
+		if (session_ == nullptr)
+			return;
+		if (textService_->candidateWindow_ != nullptr) {
+			textService_->candidateWindow_->setCurrentSel(cursor);
+			textService_->refreshCandidates();
 		}
+	}
 
-		// handle comosition and commit strings
-		const auto& commitStringVal = msg["commitString"];
-		if (commitStringVal.isString()) {
-			std::wstring commitString = utf8ToUtf16(commitStringVal.asCString());
-			if (!commitString.empty()) {
-				if (!textService_->isComposing()) {
-					textService_->startComposition(session->context());
-				}
-				textService_->setCompositionString(session, commitString.c_str(), commitString.length());
-                // FIXME: update the position of candidate and message window when the composition string is changed.
-                if (textService_->candidateWindow_ != nullptr) {
-                    textService_->updateCandidatesWindow(session);
-                }
-                if (textService_->messageWindow_ != nullptr) {
-                    textService_->updateMessageWindow(session);
-                }
-				textService_->endComposition(session->context());
-			}
+	void commitString(const std::wstring& commitString) override {
+		if (session_ == nullptr || commitString.empty())
+			return;
+		if (!textService_->isComposing()) {
+			textService_->startComposition(session_->context());
 		}
+		textService_->setCompositionString(session_, commitString.c_str(), commitString.length());
+		// FIXME: update the position of candidate and message window when the composition string is changed.
+		updateWindows();
+		textService_->endComposition(session_->context());
+	}
 
-		const auto& compositionStringVal = msg["compositionString"];
-		bool emptyComposition = false;
-		bool hasCompositionString = false;
-		std::wstring compositionString;
-		if (compositionStringVal.isString()) {
-			// composition buffer
-			compositionString = utf8ToUtf16(compositionStringVal.asCString());
-			hasCompositionString = true;
-			if (compositionString.empty()) {
-				emptyComposition = true;
-				if (textService_->isComposing() && !textService_->showingCandidates()) {
-					// when the composition buffer is empty and we are not showing the candidate list, end composition.
-					textService_->setCompositionString(session, L"", 0);
-					endComposition = true;
-				}
-			}
-			else {
-				if (!textService_->isComposing()) {
-					textService_->startComposition(session->context());
-				}
-				textService_->setCompositionString(session, compositionString.c_str(), compositionString.length());
+	void setCompositionString(const std::wstring& compositionString) override {
+		if (session_ == nullptr)
+			return;
+		// composition buffer
+		if (compositionString.empty()) {
+			if (textService_->isComposing() && !textService_->showingCandidates()) {
+				// when the composition buffer is empty and we are not showing the candidate list, end composition.
+				textService_->setCompositionString(session_, L"", 0);
+				endComposition_ = true;
 			}
-            // FIXME: update the position of candidate and message window when the composition string is changed.
-            if (textService_->candidateWindow_ != nullptr) {
-                textService_->updateCandidatesWindow(session);
-            }
-            if (textService_->messageWindow_ != nullptr) {
-                textService_->updateMessageWindow(session);
-            }
-		}
-
-		const auto& compositionCursorVal = msg["compositionCursor"];
-		if (compositionCursorVal.isInt()) {
-			// composition cursor
-			if (!emptyComposition) {
-				int compositionCursor = compositionCursorVal.asInt();
-				if (!textService_->isComposing()) {
-					textService_->startComposition(session->context());
-				}
-				// NOTE:
-				// This fixes PIME bug #166: incorrect handling of UTF-16 surrogate pairs.
-				// The TSF API unfortunately treat a UTF-16 surrogate pair as two characters while
-				// they actually represent one unicode character only. To workaround this TSF bug,
-				// we get the composition string, and try to move the cursor twice when a UTF-16
-				// surrogate pair is found.
-				if(!hasCompositionString)
-					compositionString = textService_->compositionString(session);
-				int fixedCursorPos = 0;
-				for (int i = 0; i < compositionCursor; ++i) {
-					++fixedCursorPos;
-					if (IS_HIGH_SURROGATE(compositionString[i])) // this is the first part of a UTF16 surrogate pair (Windows uses UTF16-LE)
-						++fixedCursorPos;
-				}
-				textService_->setCompositionCursor(session, fixedCursorPos);
+		}
+		else {
+			if (!textService_->isComposing()) {
+				textService_->startComposition(session_->context());
 			}
+			textService_->setCompositionString(session_, compositionString.c_str(), compositionString.length());
 		}
+		// FIXME: update the position of candidate and message window when the composition string is changed.
+		updateWindows();
+	}
 
-		if (endComposition) {
-			textService_->endComposition(session->context());
+	void setCompositionCursor(int compositionCursor, const std::wstring* compositionString) override {
+		if (session_ == nullptr)
+			return;
+		// composition cursor
+		if (compositionString != nullptr && compositionString->empty())
+			return;
+		if (!textService_->isComposing()) {
+			textService_->startComposition(session_->context());
+		}
+		// NOTE:
+		// This fixes PIME bug #166: incorrect handling of UTF-16 surrogate pairs.
+		// The TSF API unfortunately treat a UTF-16 surrogate pair as two characters while
+		// they actually represent one unicode character only. To workaround this TSF bug,
+		// we get the composition string, and try to move the cursor twice when a UTF-16
+		// surrogate pair is found.
+		std::wstring currentString;
+		if (compositionString == nullptr) {
+			currentString = textService_->compositionString(session_);
+			compositionString = &currentString;
+		}
+		int fixedCursorPos = 0;
+		for (int i = 0; i < compositionCursor; ++i) {
+			++fixedCursorPos;
+			if (IS_HIGH_SURROGATE((*compositionString)[i])) // this is the first part of a UTF16 surrogate pair (Windows uses UTF16-LE)
+				++fixedCursorPos;
+		}
+		textService_->setCompositionCursor(session_, fixedCursorPos);
+	}
+
+	void compositionDone() override {
+		if (session_ != nullptr && endComposition_) {
+			textService_->endComposition(session_->context());
 		}
 	}
 
 	// language buttons
-	const auto& addButtonVal = msg["addButton"];
-	if (addButtonVal.isArray()) {
-		for (auto btn_it = addButtonVal.begin(); btn_it != addButtonVal.end(); ++btn_it) {
+	void addButtons(const Json::Value& buttons) override {
+		for (auto btn_it = buttons.begin(); btn_it != buttons.end(); ++btn_it) {
 			const Json::Value& btn = *btn_it;
 			// FIXME: when to clear the id <=> button map??
 			Ime::ComPtr<PIME::LangBarButton> langBtn{ PIME::LangBarButton::fromJson(textService_, btn), false };
 			if (langBtn != nullptr) {
-				buttons_.emplace(langBtn->id(), langBtn); // insert into the map
+				client_->buttons_.emplace(langBtn->id(), langBtn); // insert into the map
 				textService_->addButton(langBtn);
 			}
 		}
 	}
 
-	const auto& removeButtonVal = msg["removeButton"];
-	if (removeButtonVal.isArray()) {
+	void removeButtons(const Json::Value& ids) override {
 		// FIXME: handle windows-mode-icon
-		for (auto btn_it = removeButtonVal.begin(); btn_it != removeButtonVal.end(); ++btn_it) {
+		for (auto btn_it = ids.begin(); btn_it != ids.end(); ++btn_it) {
 			if (btn_it->isString()) {
 				string id = btn_it->asString();
-				auto map_it = buttons_.find(id);
-				if (map_it != buttons_.end()) {
+				auto map_it = client_->buttons_.find(id);
+				if (map_it != client_->buttons_.end()) {
 					textService_->removeButton(map_it->second);
-					buttons_.erase(map_it); // remove from the map
+					client_->buttons_.erase(map_it); // remove from the map
 				}
 			}
 		}
 	}
-	const auto& changeButtonVal = msg["changeButton"];
-	if (changeButtonVal.isArray()) {
+
+	void changeButtons(const Json::Value& buttons) override {
 		// FIXME: handle windows-mode-icon
-		for (auto btn_it = changeButtonVal.begin(); btn_it != changeButtonVal.end(); ++btn_it) {
+		for (auto btn_it = buttons.begin(); btn_it != buttons.end(); ++btn_it) {
 			const Json::Value& btn = *btn_it;
 			if (btn.isObject()) {
 				string id = btn["id"].asString();
-				auto map_it = buttons_.find(id);
-				if (map_it != buttons_.end()) {
+				auto map_it = client_->buttons_.find(id);
+				if (map_it != client_->buttons_.end()) {
 					map_it->second->updateFromJson(btn);
 				}
 			}
@@ -302,10 +407,8 @@ void Client::updateStatus(Json::Value& msg, Ime::EditSession* session) {
 	}
 
 	// preserved keys
-	const auto& addPreservedKeyVal = msg["addPreservedKey"];
-	if (addPreservedKeyVal.isArray()) {
-		// preserved keys
-		for (auto key_it = addPreservedKeyVal.begin(); key_it != addPreservedKeyVal.end(); ++key_it) {
+	void addPreservedKeys(const Json::Value& keys) override {
+		for (auto key_it = keys.begin(); key_it != keys.end(); ++key_it) {
 			const Json::Value& key = *key_it;
 			if (key.isObject()) {
 				std::wstring guidStr = utf8ToUtf16(key["guid"].asCString());
@@ -317,10 +420,9 @@ void Client::updateStatus(Json::Value& msg, Ime::EditSession* session) {
 			}
 		}
 	}
-	
-	const auto& removePreservedKeyVal = msg["removePreservedKey"];
-	if (removePreservedKeyVal.isArray()) {
-		for (auto key_it = removePreservedKeyVal.begin(); key_it != removePreservedKeyVal.end(); ++key_it) {
+
+	void removePreservedKeys(const Json::Value& guids) override {
+		for (auto key_it = guids.begin(); key_it != guids.end(); ++key_it) {
 			if (key_it->isString()) {
 				std::wstring guidStr = utf8ToUtf16(key_it->asCString());
 				CLSID guid = { 0 };
@@ -331,23 +433,38 @@ void Client::updateStatus(Json::Value& msg, Ime::EditSession* session) {
 	}
 
 	// keyboard status
-	const auto& openKeyboardVal = msg["openKeyboard"];
-	if (openKeyboardVal.isBool()) {
-		textService_->setKeyboardOpen(openKeyboardVal.asBool());
+	void setKeyboardOpen(bool open) override {
+		textService_->setKeyboardOpen(open);
 	}
 
 	// other configurations
-	const auto& customizeUIVal = msg["customizeUI"];
-	if (customizeUIVal.isObject()) {
-		// customize the UI
-		updateUI(customizeUIVal);
+	void customizeUI(const Json::Value& options) override {
+		client_->updateUI(options);
+	}
+
+	void hideMessage() override {
+		textService_->hideMessage();
 	}
 
-	// hide message
-    const auto& hideMessageVal = msg["hideMessage"];
-	if (hideMessageVal.isBool()) {
-        textService_->hideMessage();
+private:
+	void updateWindows() {
+		if (textService_->candidateWindow_ != nullptr) {
+			textService_->updateCandidatesWindow(session_);
+		}
+		if (textService_->messageWindow_ != nullptr) {
+			textService_->updateMessageWindow(session_);
+		}
 	}
+
+	Client* client_;
+	TextService* textService_;
+	Ime::EditSession* session_;
+	bool endComposition_;
+};
+
+void Client::updateStatus(Reply& reply, Ime::EditSession* session) {
+	StatusUpdater updater(this, session);
+	ReplyDecoder::apply(reply, updater);
 }
 
 // handlers for the text service
@@ -356,7 +473,7 @@ void Client::onActivate() {
 	req["method"] = "onActivate";
 	req["isKeyboardOpen"] = textService_->isKeyboardOpened();
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
 	}
@@ -367,7 +484,7 @@ void Client::onDeactivate() {
 	Json::Value req;
 	req["method"] = "onDeactivate";
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
 	}
@@ -376,53 +493,86 @@ void Client::onDeactivate() {
 }
 
 bool Client::filterKeyDown(Ime::KeyEvent& keyEvent) {
+	// TSF might test the same key again before handling it, and the server already took it.
+	if (hasFusedReply(keyEvent, true))
+		return true;
+
+	// skip the round trip to the server if the text service does not want the key
+	if (!isKeyInteresting(keyEvent, true)) {
+		dropFusedReply();
+		return false;
+	}
+
 	Json::Value req;
 	req["method"] = "filterKeyDown";
 	keyEventToJson(keyEvent, req);
+	dropFusedReply();
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
-		return ret["return"].asBool();
+		bool filtered = ret.returnValue;
+		if (filtered && !ret.onKeyDownReply.empty()) {
+			saveFusedReply(keyEvent, true, ret.onKeyDownReply);
+		}
+		return filtered;
 	}
 	return false;
 }
 
 bool Client::onKeyDown(Ime::KeyEvent& keyEvent, Ime::EditSession* session) {
-	Json::Value req;
-	req["method"] = "onKeyDown";
-	keyEventToJson(keyEvent, req);
-
-	Json::Value ret;
-	sendRequest(req, ret);
+	Reply ret;
+	// use the reply sent with filterKeyDown if the server already handled the key
+	if (!takeFusedReply(keyEvent, true, ret)) {
+		Json::Value req;
+		req["method"] = "onKeyDown";
+		keyEventToJson(keyEvent, req);
+		dropFusedReply();
+		sendRequest(req, ret);
+	}
 	if (handleReply(ret, session)) {
-		return ret["return"].asBool();
+		return ret.returnValue;
 	}
 	return false;
 }
 
 bool Client::filterKeyUp(Ime::KeyEvent& keyEvent) {
+	if (hasFusedReply(keyEvent, false))
+		return true;
+
+	if (!isKeyInteresting(keyEvent, false)) {
+		dropFusedReply();
+		return false;
+	}
+
 	Json::Value req;
 	req["method"] = "filterKeyUp";
 	keyEventToJson(keyEvent, req);
+	dropFusedReply();
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
-		return ret["return"].asBool();
+		bool filtered = ret.returnValue;
+		if (filtered && !ret.onKeyUpReply.empty()) {
+			saveFusedReply(keyEvent, false, ret.onKeyUpReply);
+		}
+		return filtered;
 	}
 	return false;
 }
 
 bool Client::onKeyUp(Ime::KeyEvent& keyEvent, Ime::EditSession* session) {
-	Json::Value req;
-	req["method"] = "onKeyUp";
-	keyEventToJson(keyEvent, req);
-
-	Json::Value ret;
-	sendRequest(req, ret);
+	Reply ret;
+	if (!takeFusedReply(keyEvent, false, ret)) {
+		Json::Value req;
+		req["method"] = "onKeyUp";
+		keyEventToJson(keyEvent, req);
+		dropFusedReply();
+		sendRequest(req, ret);
+	}
 	if (handleReply(ret, session)) {
-		return ret["return"].asBool();
+		return ret.returnValue;
 	}
 	return false;
 }
@@ -435,10 +585,10 @@ bool Client::onPreservedKey(const GUID& guid) {
 		req["guid"] = utf16ToUtf8(str);
 		::CoTaskMemFree(str);
 
-		Json::Value ret;
+		Reply ret;
 		sendRequest(req, ret);
 		if (handleReply(ret)) {
-			return ret["return"].asBool();
+			return ret.returnValue;
 		}
 	}
 	return false;
@@ -450,10 +600,10 @@ bool Client::onCommand(UINT id, Ime::TextService::CommandType type) {
 	req["id"] = id;
 	req["type"] = type;
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
-		return ret["return"].asBool();
+		return ret.returnValue;
 	}
 	return false;
 }
@@ -463,9 +613,12 @@ bool Client::sendOnMenu(std::string button_id, Json::Value& result) {
 	req["method"] = "onMenu";
 	req["id"] = button_id;
 
-	sendRequest(req, result);
-	if (handleReply(result)) {
-		return true;
+	Reply ret;
+	sendRequest(req, ret);
+	if (handleReply(ret)) {
+		// the menu is only needed here, so parse it with jsoncpp
+		Json::Reader reader;
+		return reader.parse(ret.returnJson, result);
 	}
 	return false;
 }
@@ -508,8 +661,7 @@ static bool menuFromJson(ITfMenu* pMenu, const Json::Value& menuInfo) {
 bool Client::onMenu(LangBarButton* btn, ITfMenu* pMenu) {
 	Json::Value result;
 	if(sendOnMenu(btn->id(), result)) {
-		Json::Value& menuInfo = result["return"];
-		return menuFromJson(pMenu, menuInfo);
+		return menuFromJson(pMenu, result);
 	}
 	return false;
 }
@@ -550,8 +702,7 @@ static HMENU menuFromJson(const Json::Value& menuInfo) {
 HMENU Client::onMenu(LangBarButton* btn) {
 	Json::Value result;
 	if (sendOnMenu(btn->id(), result)) {
-		Json::Value& menuInfo = result["return"];
-		return menuFromJson(menuInfo);
+		return menuFromJson(result);
 	}
 	return NULL;
 }
@@ -565,7 +716,7 @@ void Client::onCompartmentChanged(const GUID& key) {
 		req["guid"] = utf16ToUtf8(str);
 		::CoTaskMemFree(str);
 
-		Json::Value ret;
+		Reply ret;
 		sendRequest(req, ret);
 		if (handleReply(ret)) {
 		}
@@ -578,7 +729,7 @@ void Client::onKeyboardStatusChanged(bool opened) {
 	req["method"] = "onKeyboardStatusChanged";
 	req["opened"] = opened;
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
 	}
@@ -590,7 +741,7 @@ void Client::onCompositionTerminated(bool forced) {
 	req["method"] = "onCompositionTerminated";
 	req["forced"] = forced;
 
-	Json::Value ret;
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
 	}
@@ -604,11 +755,25 @@ void Client::init() {
 	req["isMetroApp"] = textService_->isMetroApp();
 	req["isUiLess"] = textService_->isUiLess();
 	req["isConsole"] = textService_->isConsole();
-
-	Json::Value ret;
+	// ask the server to handle the keys right after filtering them
+	req["fusedKeyEvents"] = true;
+	// long candidate lists can be sent in pages. tell the server how many of them we keep.
+	req["candidatePaging"] = Json::UInt(CandidatePageCache::maxPages);
+	// the candidate sources of the old connection are gone
+	candidatePages_.clear();
+	// send every key until the new text service tells us what it wants
+	keyInterest_ = KeyInterest();
+	// the new text service has not handled any key for us
+	fusedReply_.reply.clear();
+	fusedReplyDropped_ = false;
+	resyncNeeded_ = false;
+
+	Reply ret;
 	sendRequest(req, ret);
 	if (handleReply(ret)) {
 	}
+	// the text service might be replaced by another backend after reconnecting, so check it every time.
+	compactKeyEvents_ = ret.compactKeyEvents;
 }
 
 bool Client::sendRequestText(HANDLE pipe, const char* data, int len, std::string& reply) {
@@ -642,10 +807,14 @@ bool Client::sendRequestText(HANDLE pipe, const char* data, int len, std::string
 
 // send the request to the server
 // a sequence number will be added to the req object automatically.
-bool Client::sendRequest(Json::Value& req, Json::Value & result) {
+bool Client::sendRequest(Json::Value& req, Reply& result) {
 	bool success = false;
 	unsigned int seqNum = newSeqNum_++;
 	req["seqNum"] = seqNum; // add a sequence number for the request
+	if (fusedReplyDropped_) // the server still thinks we show the reply of a key, see dropFusedReply()
+		req["unusedFusedReply"] = true;
+	if (resyncNeeded_) // we missed some changes, see CandidateSource
+		req["resync"] = true;
 	std::string ret;
 	DWORD rlen = 0;
 	Json::FastWriter writer;
@@ -672,11 +841,16 @@ bool Client::sendRequest(Json::Value& req, Json::Value & result) {
 	}
 
 	if (sendRequestText(pipe_, reqStr.c_str(), reqStr.length(), ret)) {
-		Json::Reader reader;
-		success = reader.parse(ret, result);
+		success = ReplyDecoder::decode(ret, result);
 		if (success) {
-			if (result["seqNum"].asUInt() != seqNum) // sequence number mismatch
+			if (result.seqNum != seqNum) // sequence number mismatch
 				success = false;
+			else if (result.success) {
+				if (req.isMember("unusedFusedReply"))
+					fusedReplyDropped_ = false;
+				if (req.isMember("resync"))
+					resyncNeeded_ = false;
+			}
 		}
 	}
 	else { // fail to send the request to the server
@@ -687,6 +861,9 @@ bool Client::sendRequest(Json::Value& req, Json::Value & result) {
 			closePipe(); // close the pipe connection since it's broken
 		}
 	}
+	// the server might have handled the request without us getting the changes, e.g. it timed out
+	if (!success || !result.success)
+		resyncNeeded_ = true;
 	return success;
 }
 
@@ -24,6 +24,8 @@
 #include <libIME/KeyEvent.h>
 #include <libIME/EditSession.h>
 #include "PIMELangBarButton.h"
+#include "PIMEReplyDecoder.h"
+#include "PIMECandidateCache.h"
 
 #include <unordered_map>
 #include <string>
@@ -78,16 +80,24 @@ private:
 	static HANDLE connectPipe(const wchar_t* pipeName);
 	bool connectServerPipe();
 	bool sendRequestText(HANDLE pipe, const char* data, int len, std::string& reply);
-	bool sendRequest(Json::Value& req, Json::Value& result);
+	bool sendRequest(Json::Value& req, Reply& result);
 	void closePipe();
 	void init();
 
 	void keyEventToJson(Ime::KeyEvent& keyEvent, Json::Value& jsonValue);
-	bool handleReply(Json::Value& msg, Ime::EditSession* session = nullptr);
-	void updateStatus(Json::Value& msg, Ime::EditSession* session = nullptr);
+	bool isKeyInteresting(Ime::KeyEvent& keyEvent, bool keyDown);
+	void saveFusedReply(Ime::KeyEvent& keyEvent, bool keyDown, std::string& reply);
+	bool hasFusedReply(Ime::KeyEvent& keyEvent, bool keyDown);
+	bool takeFusedReply(Ime::KeyEvent& keyEvent, bool keyDown, Reply& reply);
+	void dropFusedReply();
+	bool handleReply(Reply& reply, Ime::EditSession* session = nullptr);
+	void updateStatus(Reply& reply, Ime::EditSession* session = nullptr);
 	void updateUI(const Json::Value& data);
 	bool sendOnMenu(std::string button_id, Json::Value& result);
 
+	// applies the changes of a reply to the text service
+	class StatusUpdater;
+
 	static std::wstring getPipeName(const wchar_t* base_name);
 
 	TextService* textService_;
@@ -97,6 +107,28 @@ private:
 	unsigned int newSeqNum_;
 	bool isActivated_;
 	bool connectingServerPipe_;
+	bool compactKeyEvents_; // the text service accepts key events without the full keyStates array
+
+	KeyInterest keyInterest_; // keys the text service wants to filter
+
+	// the server handles a key right after filtering it, and sends the reply of
+	// onKeyDown or onKeyUp together with the reply of filterKeyDown or filterKeyUp.
+	// it's kept here until the text service handles the same key event.
+	struct FusedKeyReply {
+		bool keyDown;
+		UINT keyCode;
+		UINT charCode;
+		UINT scanCode;
+		UINT repeatCount;
+		bool isExtended;
+		std::string reply; // the json text of the reply, or empty if there's none
+	};
+	FusedKeyReply fusedReply_;
+	bool fusedReplyDropped_; // a saved reply is dropped and the server is not told yet
+	bool resyncNeeded_; // a reply is lost, ask the server for its whole state
+
+	// pages of the long candidate lists sent by the server, see CandidateSource.
+	CandidatePageCache candidatePages_;
 	UINT connectServerTimerId_;
 
 	static std::unordered_map<UINT_PTR, Client*> timerIdToClients_;
@@ -0,0 +1,582 @@
+//
+//	Copyright (C) 2014 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#include "PIMEReplyDecoder.h"
+#include "PIMELauncher/JsonFieldScanner.h"
+#include <cstdlib>
+
+using namespace std;
+
+namespace PIME {
+
+static void clearCandidatePage(CandidatePage& page) {
+	page.source = page.count = page.pageSize = page.index = 0;
+	page.hasCandidates = false;
+	page.candidates.clear();
+}
+
+void Reply::clear() {
+	success = false;
+	seqNum = 0;
+	returnValue = false;
+	returnJson.clear();
+	compactKeyEvents = false;
+	onKeyDownReply.clear();
+	onKeyUpReply.clear();
+	hasKeyInterest = false;
+	keyInterest = KeyInterest();
+	hasSelKeys = false;
+	selKeys.clear();
+	hasMessage = false;
+	message.clear();
+	messageDuration = 0;
+	hasShowCandidates = false;
+	showCandidates = false;
+	hasCandidateList = false;
+	candidateList.clear();
+	hasCandidateSource = false;
+	candidateSource = CandidateSource();
+	hasCandidatePage = false;
+	clearCandidatePage(candidatePage);
+	hasCandidateCursor = false;
+	candidateCursor = 0;
+	hasCommitString = false;
+	commitString.clear();
+	hasCompositionString = false;
+	compositionString.clear();
+	hasCompositionCursor = false;
+	compositionCursor = 0;
+	addButton = Json::Value();
+	removeButton = Json::Value();
+	changeButton = Json::Value();
+	addPreservedKey = Json::Value();
+	removePreservedKey = Json::Value();
+	hasOpenKeyboard = false;
+	openKeyboard = false;
+	customizeUI = Json::Value();
+	hideMessage = false;
+}
+
+// the top-level fields of a reply. keep this in sync with replyFieldNames.
+enum ReplyField {
+	SUCCESS,
+	SEQ_NUM,
+	RETURN,
+	COMPACT_KEY_EVENTS,
+	ON_KEY_DOWN,
+	ON_KEY_UP,
+	KEY_INTEREST,
+	SET_SEL_KEYS,
+	SHOW_MESSAGE,
+	SHOW_CANDIDATES,
+	CANDIDATE_LIST,
+	CANDIDATE_SOURCE,
+	CANDIDATE_PAGE,
+	CANDIDATE_CURSOR,
+	COMMIT_STRING,
+	COMPOSITION_STRING,
+	COMPOSITION_CURSOR,
+	ADD_BUTTON,
+	REMOVE_BUTTON,
+	CHANGE_BUTTON,
+	ADD_PRESERVED_KEY,
+	REMOVE_PRESERVED_KEY,
+	OPEN_KEYBOARD,
+	CUSTOMIZE_UI,
+	HIDE_MESSAGE,
+	REPLY_FIELD_COUNT
+};
+
+static const char* const replyFieldNames[REPLY_FIELD_COUNT] = {
+	"success",
+	"seqNum",
+	"return",
+	"compactKeyEvents",
+	"onKeyDown",
+	"onKeyUp",
+	"keyInterest",
+	"setSelKeys",
+	"showMessage",
+	"showCandidates",
+	"candidateList",
+	"candidateSource",
+	"candidatePage",
+	"candidateCursor",
+	"commitString",
+	"compositionString",
+	"compositionCursor",
+	"addButton",
+	"removeButton",
+	"changeButton",
+	"addPreservedKey",
+	"removePreservedKey",
+	"openKeyboard",
+	"customizeUI",
+	"hideMessage"
+};
+
+static bool isLiteral(const JsonField& field, const char* literal, size_t len) {
+	return field.type == JsonField::OTHER && field.len == len && memcmp(field.value, literal, len) == 0;
+}
+
+static bool isBool(const JsonField& field) {
+	return isLiteral(field, "true", 4) || isLiteral(field, "false", 5);
+}
+
+static bool isContainer(const JsonField& field, char open) {
+	return field.type == JsonField::OTHER && field.len > 0 && field.value[0] == open;
+}
+
+// the same as Json::Value::asBool() for the values it accepts
+static bool asBool(const JsonField& field) {
+	if (field.type == JsonField::NUMBER)
+		return strtod(string(field.value, field.len).c_str(), nullptr) != 0.0;
+	return isLiteral(field, "true", 4);
+}
+
+// an integer which fits in an int
+static bool asInt(const JsonField& field, int& result) {
+	if (field.type != JsonField::NUMBER)
+		return false;
+	const char* p = field.value;
+	const char* end = p + field.len;
+	bool negative = (p < end && *p == '-');
+	if (negative)
+		++p;
+	if (p == end || end - p > 10)
+		return false;
+	int64_t v = 0;
+	for (; p < end; ++p) {
+		if (*p < '0' || *p > '9')
+			return false;
+		v = v * 10 + (*p - '0');
+	}
+	if (negative)
+		v = -v;
+	if (v < INT32_MIN || v > INT32_MAX)
+		return false;
+	result = int(v);
+	return true;
+}
+
+// parse a rarely used field with jsoncpp
+static void parseJson(const JsonField& field, Json::Value& result) {
+	Json::Reader reader;
+	if (!reader.parse(field.value, field.value + field.len, result, false))
+		result = Json::Value();
+}
+
+// convert UTF-8 to UTF-16. lone surrogates decoded from \u escapes are kept as they are.
+static void appendUtf16(const char* p, const char* end, wstring& out) {
+	while (p < end) {
+		unsigned char c = static_cast<unsigned char>(*p);
+		if (c < 0x80) {
+			out.push_back(wchar_t(c));
+			++p;
+			continue;
+		}
+		uint32_t cp;
+		int n; // number of continuation bytes
+		if (c >= 0xc2 && c <= 0xdf) {
+			cp = c & 0x1f;
+			n = 1;
+		}
+		else if (c >= 0xe0 && c <= 0xef) {
+			cp = c & 0x0f;
+			n = 2;
+		}
+		else if (c >= 0xf0 && c <= 0xf4) {
+			cp = c & 0x07;
+			n = 3;
+		}
+		else {
+			out.push_back(wchar_t(0xfffd));
+			++p;
+			continue;
+		}
+		bool valid = (end - p > n);
+		for (int i = 1; valid && i <= n; ++i) {
+			unsigned char next = static_cast<unsigned char>(p[i]);
+			if ((next & 0xc0) != 0x80)
+				valid = false;
+			cp = (cp << 6) | (next & 0x3f);
+		}
+		// overlong sequences and code points out of the unicode range
+		if (valid && ((n == 2 && cp < 0x800) || (n == 3 && (cp < 0x10000 || cp > 0x10ffff))))
+			valid = false;
+		if (!valid) {
+			out.push_back(wchar_t(0xfffd));
+			++p;
+			continue;
+		}
+		p += n + 1;
+		if (cp >= 0x10000) { // a surrogate pair
+			cp -= 0x10000;
+			out.push_back(wchar_t(0xd800 + (cp >> 10)));
+			out.push_back(wchar_t(0xdc00 + (cp & 0x3ff)));
+		}
+		else {
+			out.push_back(wchar_t(cp));
+		}
+	}
+}
+
+// static
+void ReplyDecoder::decodeString(const char* p, const char* end, bool escaped, wstring& out) {
+	out.clear();
+	out.reserve(end - p);
+	if (!escaped) {
+		appendUtf16(p, end, out);
+		return;
+	}
+	// strings with escapes are rare since the server does not escape non-ASCII chars
+	string unescaped;
+	JsonField::decodeString(p, end, unescaped);
+	appendUtf16(unescaped.data(), unescaped.data() + unescaped.length(), out);
+}
+
+static void decodeField(const JsonField& field, wstring& out) {
+	ReplyDecoder::decodeString(field.value, field.value + field.len, field.escaped, out);
+}
+
+static const char* skipSpaces(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		++p;
+	}
+	return p;
+}
+
+// decode an array of strings. the array has been checked by JsonFieldScanner,
+// so the escape sequences of the strings are valid.
+// returns false if it contains other values.
+static bool decodeStringArray(const JsonField& field, vector<wstring>& out) {
+	const char* p = field.value + 1;  // skip '['
+	const char* end = field.value + field.len;
+	out.clear();
+	p = skipSpaces(p, end);
+	if (p < end && *p == ']')
+		return true;
+	for (;;) {
+		if (p == end || *p != '"')
+			return false;
+		const char* str = ++p;
+		bool escaped = false;
+		while (p < end && *p != '"') {
+			if (*p == '\\') {
+				escaped = true;
+				++p;
+			}
+			++p;
+		}
+		if (p >= end)
+			return false;
+		out.emplace_back();
+		ReplyDecoder::decodeString(str, p, escaped, out.back());
+		p = skipSpaces(p + 1, end);
+		if (p == end)
+			return false;
+		if (*p == ']')
+			return true;
+		if (*p != ',')
+			return false;
+		p = skipSpaces(p + 1, end);
+	}
+}
+
+// "candidatePage", see CandidatePage
+static bool decodeCandidatePage(const JsonField& field, CandidatePage& page) {
+	JsonField pageFields[] = { JsonField{ "source" }, JsonField{ "count" }, JsonField{ "pageSize" },
+		JsonField{ "index" }, JsonField{ "candidates" } };
+	bool valid = JsonFieldScanner::scan(field.value, field.len, pageFields, 5)
+		&& pageFields[0].asUInt(page.source) && pageFields[3].asUInt(page.index);
+	if (!valid || !pageFields[1].asUInt(page.count) || !pageFields[2].asUInt(page.pageSize))
+		page.count = page.pageSize = 0;
+	if (valid && isContainer(pageFields[4], '['))
+		page.hasCandidates = decodeStringArray(pageFields[4], page.candidates);
+	if (!page.hasCandidates)
+		page.candidates.clear();
+	if (!valid)
+		page.source = page.index = 0;
+	return valid;
+}
+
+// Format of "keyInterest" (version 1):
+// {
+//   "version": 1,
+//   "keyDown": [<virtual key codes to filter on key down>],
+//   "keyUp": [<virtual key codes to filter on key up>],
+//   "modifiers": <TF_MOD_ALT | TF_MOD_CONTROL | TF_MOD_SHIFT, filter every key while any of them is down>,
+//   "whileComposing": <filter every key while composing>
+// }
+// null or unknown versions mean that every key should be filtered by the server.
+// static
+void ReplyDecoder::keyInterestFromJson(const Json::Value& value, KeyInterest& result) {
+	result = KeyInterest();
+	if (!value.isObject() || value.get("version", 0).asInt() != 1)
+		return;
+	result.valid = true;
+	result.whileComposing = value.get("whileComposing", true).asBool();
+	result.modifiers = value.get("modifiers", 0).asUInt();
+	auto readKeys = [](const Json::Value& keys, std::bitset<256>& keySet) {
+		if (keys.isArray()) {
+			for (auto& key : keys) {
+				if (key.isUInt() && key.asUInt() < keySet.size())
+					keySet.set(key.asUInt());
+			}
+		}
+	};
+	readKeys(value["keyDown"], result.keyDown);
+	readKeys(value["keyUp"], result.keyUp);
+}
+
+// read an array of key codes. returns false if it contains something other than integers.
+static bool decodeKeyArray(const JsonField& field, bitset<256>& keySet) {
+	const char* p = field.value + 1;  // skip '['
+	const char* end = field.value + field.len;
+	p = skipSpaces(p, end);
+	if (p < end && *p == ']')
+		return true;
+	for (;;) {
+		uint32_t key = 0;
+		const char* begin = p;
+		while (p < end && *p >= '0' && *p <= '9' && key < keySet.size()) {
+			key = key * 10 + (*p++ - '0');
+		}
+		if (p == begin || p == end || (*p != ',' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'))
+			return false;
+		if (key < keySet.size())
+			keySet.set(key);
+		p = skipSpaces(p, end);
+		if (p == end)
+			return false;
+		if (*p == ']')
+			return true;
+		if (*p != ',')
+			return false;
+		p = skipSpaces(p + 1, end);
+	}
+}
+
+static void decodeKeyInterest(const JsonField& field, KeyInterest& result) {
+	result = KeyInterest();
+	if (!isContainer(field, '{'))
+		return;
+	JsonField fields[] = { JsonField{ "version" }, JsonField{ "whileComposing" }, JsonField{ "modifiers" }, JsonField{ "keyDown" }, JsonField{ "keyUp" } };
+	uint32_t version = 0;
+	if (!JsonFieldScanner::scan(field.value, field.len, fields, 5))
+		return;
+	bool simple = fields[0].asUInt(version)
+		&& (fields[1].type == JsonField::MISSING || isBool(fields[1]))
+		&& (fields[2].type == JsonField::MISSING || fields[2].asUInt(result.modifiers))
+		&& (fields[3].type == JsonField::MISSING || (isContainer(fields[3], '[') && decodeKeyArray(fields[3], result.keyDown)))
+		&& (fields[4].type == JsonField::MISSING || (isContainer(fields[4], '[') && decodeKeyArray(fields[4], result.keyUp)));
+	if (!simple) {
+		// leave the unusual ones to jsoncpp
+		Json::Value value;
+		parseJson(field, value);
+		ReplyDecoder::keyInterestFromJson(value, result);
+		return;
+	}
+	if (version != 1) {
+		result = KeyInterest();
+		return;
+	}
+	result.valid = true;
+	result.whileComposing = (fields[1].type == JsonField::MISSING) || asBool(fields[1]);
+}
+
+// static
+bool ReplyDecoder::decode(const char* data, size_t len, Reply& reply) {
+	reply.clear();
+	JsonField fields[REPLY_FIELD_COUNT] = {
+		JsonField{ replyFieldNames[SUCCESS] },
+		JsonField{ replyFieldNames[SEQ_NUM] },
+		JsonField{ replyFieldNames[RETURN] },
+		JsonField{ replyFieldNames[COMPACT_KEY_EVENTS] },
+		JsonField{ replyFieldNames[ON_KEY_DOWN] },
+		JsonField{ replyFieldNames[ON_KEY_UP] },
+		JsonField{ replyFieldNames[KEY_INTEREST] },
+		JsonField{ replyFieldNames[SET_SEL_KEYS] },
+		JsonField{ replyFieldNames[SHOW_MESSAGE] },
+		JsonField{ replyFieldNames[SHOW_CANDIDATES] },
+		JsonField{ replyFieldNames[CANDIDATE_LIST] },
+		JsonField{ replyFieldNames[CANDIDATE_SOURCE] },
+		JsonField{ replyFieldNames[CANDIDATE_PAGE] },
+		JsonField{ replyFieldNames[CANDIDATE_CURSOR] },
+		JsonField{ replyFieldNames[COMMIT_STRING] },
+		JsonField{ replyFieldNames[COMPOSITION_STRING] },
+		JsonField{ replyFieldNames[COMPOSITION_CURSOR] },
+		JsonField{ replyFieldNames[ADD_BUTTON] },
+		JsonField{ replyFieldNames[REMOVE_BUTTON] },
+		JsonField{ replyFieldNames[CHANGE_BUTTON] },
+		JsonField{ replyFieldNames[ADD_PRESERVED_KEY] },
+		JsonField{ replyFieldNames[REMOVE_PRESERVED_KEY] },
+		JsonField{ replyFieldNames[OPEN_KEYBOARD] },
+		JsonField{ replyFieldNames[CUSTOMIZE_UI] },
+		JsonField{ replyFieldNames[HIDE_MESSAGE] }
+	};
+	if (!JsonFieldScanner::scan(data, len, fields, REPLY_FIELD_COUNT))
+		return false;
+
+	reply.success = asBool(fields[SUCCESS]);
+	fields[SEQ_NUM].asUInt(reply.seqNum);
+	const JsonField& ret = fields[RETURN];
+	reply.returnValue = asBool(ret);
+	if (ret.type != JsonField::MISSING) {
+		if (ret.type == JsonField::STRING)  // the scanner excludes the quotes
+			reply.returnJson.assign(ret.value - 1, ret.len + 2);
+		else
+			reply.returnJson.assign(ret.value, ret.len);
+	}
+	reply.compactKeyEvents = asBool(fields[COMPACT_KEY_EVENTS]);
+	if (isContainer(fields[ON_KEY_DOWN], '{'))
+		reply.onKeyDownReply.assign(fields[ON_KEY_DOWN].value, fields[ON_KEY_DOWN].len);
+	if (isContainer(fields[ON_KEY_UP], '{'))
+		reply.onKeyUpReply.assign(fields[ON_KEY_UP].value, fields[ON_KEY_UP].len);
+
+	// the server only sends the keys it's interested in when they're changed, and null means every key.
+	if (fields[KEY_INTEREST].type != JsonField::MISSING) {
+		reply.hasKeyInterest = true;
+		decodeKeyInterest(fields[KEY_INTEREST], reply.keyInterest);
+	}
+	if (fields[SET_SEL_KEYS].isString()) {
+		reply.hasSelKeys = true;
+		decodeField(fields[SET_SEL_KEYS], reply.selKeys);
+	}
+	if (isContainer(fields[SHOW_MESSAGE], '{')) {
+		JsonField messageFields[] = { JsonField{ "message" }, JsonField{ "duration" } };
+		if (JsonFieldScanner::scan(fields[SHOW_MESSAGE].value, fields[SHOW_MESSAGE].len, messageFields, 2)
+			&& messageFields[0].isString() && asInt(messageFields[1], reply.messageDuration)) {
+			reply.hasMessage = true;
+			decodeField(messageFields[0], reply.message);
+		}
+	}
+	if (isBool(fields[SHOW_CANDIDATES])) {
+		reply.hasShowCandidates = true;
+		reply.showCandidates = asBool(fields[SHOW_CANDIDATES]);
+	}
+	if (isContainer(fields[CANDIDATE_LIST], '[')) {
+		reply.hasCandidateList = decodeStringArray(fields[CANDIDATE_LIST], reply.candidateList);
+		if (!reply.hasCandidateList)
+			reply.candidateList.clear();
+	}
+	if (isContainer(fields[CANDIDATE_SOURCE], '{')) {
+		JsonField sourceFields[] = { JsonField{ "id" }, JsonField{ "count" }, JsonField{ "pageSize" } };
+		CandidateSource& source = reply.candidateSource;
+		reply.hasCandidateSource = JsonFieldScanner::scan(fields[CANDIDATE_SOURCE].value, fields[CANDIDATE_SOURCE].len, sourceFields, 3)
+			&& sourceFields[0].asUInt(source.id) && sourceFields[1].asUInt(source.count) && sourceFields[2].asUInt(source.pageSize);
+		if (!reply.hasCandidateSource)
+			source = CandidateSource();
+	}
+	if (isContainer(fields[CANDIDATE_PAGE], '{'))
+		reply.hasCandidatePage = decodeCandidatePage(fields[CANDIDATE_PAGE], reply.candidatePage);
+	reply.hasCandidateCursor = asInt(fields[CANDIDATE_CURSOR], reply.candidateCursor);
+	if (fields[COMMIT_STRING].isString()) {
+		reply.hasCommitString = true;
+		decodeField(fields[COMMIT_STRING], reply.commitString);
+	}
+	if (fields[COMPOSITION_STRING].isString()) {
+		reply.hasCompositionString = true;
+		decodeField(fields[COMPOSITION_STRING], reply.compositionString);
+	}
+	reply.hasCompositionCursor = asInt(fields[COMPOSITION_CURSOR], reply.compositionCursor);
+
+	if (isContainer(fields[ADD_BUTTON], '['))
+		parseJson(fields[ADD_BUTTON], reply.addButton);
+	if (isContainer(fields[REMOVE_BUTTON], '['))
+		parseJson(fields[REMOVE_BUTTON], reply.removeButton);
+	if (isContainer(fields[CHANGE_BUTTON], '['))
+		parseJson(fields[CHANGE_BUTTON], reply.changeButton);
+	if (isContainer(fields[ADD_PRESERVED_KEY], '['))
+		parseJson(fields[ADD_PRESERVED_KEY], reply.addPreservedKey);
+	if (isContainer(fields[REMOVE_PRESERVED_KEY], '['))
+		parseJson(fields[REMOVE_PRESERVED_KEY], reply.removePreservedKey);
+	if (isBool(fields[OPEN_KEYBOARD])) {
+		reply.hasOpenKeyboard = true;
+		reply.openKeyboard = asBool(fields[OPEN_KEYBOARD]);
+	}
+	if (isContainer(fields[CUSTOMIZE_UI], '{'))
+		parseJson(fields[CUSTOMIZE_UI], reply.customizeUI);
+	reply.hideMessage = isBool(fields[HIDE_MESSAGE]);
+	return true;
+}
+
+// static
+void ReplyDecoder::apply(Reply& reply, ReplyApplier& applier) {
+	// We need to handle ordering of some types of the requests.
+	// For example, setCompositionCursor() should happen after setCompositionString().
+	if (reply.hasKeyInterest)
+		applier.setKeyInterest(reply.keyInterest);
+
+	// set sel keys before update candidates
+	if (reply.hasSelKeys)
+		applier.setSelKeys(reply.selKeys);
+
+	if (reply.hasMessage)
+		applier.showMessage(reply.message, reply.messageDuration);
+
+	// candidate list
+	if (reply.hasShowCandidates)
+		applier.showCandidates(reply.showCandidates);
+	if (reply.hasCandidateList)
+		applier.setCandidateList(reply.candidateList, reply.hasShowCandidates && reply.showCandidates);
+	if (reply.hasCandidateSource)
+		applier.setCandidateSource(reply.candidateSource);
+	if (reply.hasCandidatePage)
+		applier.setCandidatePage(reply.candidatePage, reply.hasShowCandidates && reply.showCandidates);
+	if (reply.hasCandidateCursor)
+		applier.setCandidateCursor(reply.candidateCursor);
+
+	// composition and commit strings
+	if (reply.hasCommitString)
+		applier.commitString(reply.commitString);
+	if (reply.hasCompositionString)
+		applier.setCompositionString(reply.compositionString);
+	if (reply.hasCompositionCursor)
+		applier.setCompositionCursor(reply.compositionCursor, reply.hasCompositionString ? &reply.compositionString : nullptr);
+	applier.compositionDone();
+
+	// language buttons
+	if (reply.addButton.isArray())
+		applier.addButtons(reply.addButton);
+	if (reply.removeButton.isArray())
+		applier.removeButtons(reply.removeButton);
+	if (reply.changeButton.isArray())
+		applier.changeButtons(reply.changeButton);
+
+	// preserved keys
+	if (reply.addPreservedKey.isArray())
+		applier.addPreservedKeys(reply.addPreservedKey);
+	if (reply.removePreservedKey.isArray())
+		applier.removePreservedKeys(reply.removePreservedKey);
+
+	// keyboard status
+	if (reply.hasOpenKeyboard)
+		applier.setKeyboardOpen(reply.openKeyboard);
+
+	// other configurations
+	if (reply.customizeUI.isObject())
+		applier.customizeUI(reply.customizeUI);
+
+	if (reply.hideMessage)
+		applier.hideMessage();
+}
+
+} // namespace PIME
@@ -0,0 +1,192 @@
+//
+//	Copyright (C) 2014 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+#ifndef _PIME_REPLY_DECODER_H_
+#define _PIME_REPLY_DECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <bitset>
+#include <json/json.h>
+
+namespace PIME {
+
+// keys the text service wants to filter in its current state, published in the "keyInterest"
+// field of the replies. other keys are not sent to the server, and filterKeyDown()
+// and filterKeyUp() return false for them. if it's not valid, every key is sent.
+struct KeyInterest {
+	KeyInterest() :
+		valid{ false },
+		whileComposing{ false },
+		modifiers{ 0 } {
+	}
+
+	bool valid;
+	bool whileComposing; // send every key while composing or showing candidates
+	unsigned int modifiers; // send every key while any of these TF_MOD_* modifiers is down
+	std::bitset<256> keyDown;
+	std::bitset<256> keyUp;
+};
+
+// A long candidate list kept by the server, which is sent in pages if the client
+// tells the server how many pages it keeps in the "candidatePaging" field of init.
+// "candidateSource": {"id": <a new id for every list>, "count": <number of candidates>, "pageSize": <candidates per page>}
+// "candidatePage": {"source": <id>, "index": <page to show>,
+//                   "count": <count>, "pageSize": <page size>, "candidates": [<only sent if the client does not have them>]}
+// The server keeps track of the pages the client has with the same LRU rule. If a reply is lost,
+// or a page is missing anyway, the client sends "resync": true with its next request, and the
+// server forgets the pages of the client and sends its whole state with the reply of the next key.
+// A page with candidates also carries the count and page size of its source, so the client can use
+// it if it missed the candidateSource.
+struct CandidateSource {
+	uint32_t id;
+	uint32_t count; // number of candidates
+	uint32_t pageSize;
+
+	uint32_t pageCount() const {
+		return pageSize != 0 ? (count + pageSize - 1) / pageSize : 0;
+	}
+};
+
+// A page of a candidate source to show. The server only sends the candidates of a page
+// the first time, and the client should keep them, see CandidateSource.
+struct CandidatePage {
+	uint32_t source;
+	uint32_t count; // count and pageSize of the source, 0 if they are not sent
+	uint32_t pageSize;
+	uint32_t index;
+	bool hasCandidates;
+	std::vector<std::wstring> candidates;
+};
+
+// The fields of a reply from the server which are used by the text service.
+// Strings shown to the user are already converted to UTF-16. Rarely sent fields,
+// such as the language bar buttons, are still parsed by jsoncpp and are null if missing.
+struct Reply {
+	Reply() {
+		clear();
+	}
+
+	void clear();
+
+	bool success;
+	uint32_t seqNum;
+	bool returnValue; // "return" converted to bool
+	std::string returnJson; // the raw json of "return", used by the menus
+	bool compactKeyEvents;
+	// the raw json of the nested replies sent with filterKeyDown and filterKeyUp, or empty if there's none
+	std::string onKeyDownReply;
+	std::string onKeyUpReply;
+
+	bool hasKeyInterest;
+	KeyInterest keyInterest;
+	bool hasSelKeys;
+	std::wstring selKeys;
+	bool hasMessage;
+	std::wstring message;
+	int messageDuration;
+	bool hasShowCandidates;
+	bool showCandidates;
+	bool hasCandidateList;
+	std::vector<std::wstring> candidateList;
+	bool hasCandidateSource;
+	CandidateSource candidateSource;
+	bool hasCandidatePage;
+	CandidatePage candidatePage;
+	bool hasCandidateCursor;
+	int candidateCursor;
+	bool hasCommitString;
+	std::wstring commitString;
+	bool hasCompositionString;
+	std::wstring compositionString;
+	bool hasCompositionCursor;
+	int compositionCursor;
+	Json::Value addButton;
+	Json::Value removeButton;
+	Json::Value changeButton;
+	Json::Value addPreservedKey;
+	Json::Value removePreservedKey;
+	bool hasOpenKeyboard;
+	bool openKeyboard;
+	Json::Value customizeUI;
+	bool hideMessage;
+};
+
+// Receives the changes requested by a reply, in the order they should be applied.
+// The text service implements it with TSF, and the benchmark with a mock.
+class ReplyApplier {
+public:
+	virtual ~ReplyApplier() {}
+
+	virtual void setKeyInterest(const KeyInterest& keyInterest) = 0;
+	virtual void setSelKeys(const std::wstring& selKeys) = 0;
+	virtual void showMessage(const std::wstring& message, int duration) = 0;
+	virtual void showCandidates(bool show) = 0;
+	// the applier may take the strings by swapping the vector
+	virtual void setCandidateList(std::vector<std::wstring>& candidates, bool showCandidates) = 0;
+	virtual void setCandidateSource(const CandidateSource& source) = 0;
+	// the applier may take the candidates of the page by swapping the vector
+	virtual void setCandidatePage(CandidatePage& page, bool showCandidates) = 0;
+	virtual void setCandidateCursor(int cursor) = 0;
+	virtual void commitString(const std::wstring& str) = 0;
+	virtual void setCompositionString(const std::wstring& str) = 0;
+	// compositionString is null if the reply does not change the composition string
+	virtual void setCompositionCursor(int cursor, const std::wstring* compositionString) = 0;
+	// all changes to the composition are done
+	virtual void compositionDone() = 0;
+	virtual void addButtons(const Json::Value& buttons) = 0;
+	virtual void removeButtons(const Json::Value& ids) = 0;
+	virtual void changeButtons(const Json::Value& buttons) = 0;
+	virtual void addPreservedKeys(const Json::Value& keys) = 0;
+	virtual void removePreservedKeys(const Json::Value& guids) = 0;
+	virtual void setKeyboardOpen(bool open) = 0;
+	virtual void customizeUI(const Json::Value& options) = 0;
+	virtual void hideMessage() = 0;
+};
+
+// Decodes the replies of the server in a single pass over the text, instead of building
+// a Json::Value tree and looking up every field in it. Strings are converted from the
+// escaped UTF-8 of json to UTF-16 directly.
+class ReplyDecoder {
+public:
+	// returns false if the data is not a json object.
+	// the reply is cleared first, so it can be reused to keep its buffers.
+	static bool decode(const char* data, size_t len, Reply& reply);
+
+	static bool decode(const std::string& text, Reply& reply) {
+		return decode(text.data(), text.length(), reply);
+	}
+
+	// pass the fields of the reply to the applier in the order the text service expects,
+	// regardless of their order in the json text.
+	static void apply(Reply& reply, ReplyApplier& applier);
+
+	// the same as decoding "keyInterest" from the json text, for the values parsed by jsoncpp
+	static void keyInterestFromJson(const Json::Value& value, KeyInterest& result);
+
+	// convert a json string without the quotes to UTF-16. invalid UTF-8 sequences are replaced by U+FFFD.
+	static void decodeString(const char* p, const char* end, bool escaped, std::wstring& out);
+};
+
+} // namespace PIME
+
+#endif // _PIME_REPLY_DECODER_H_
@@ -0,0 +1,932 @@
+//
+//	Copyright (C) 2014 Hong Jen Yee (PCMan) <pcman.tw@gmail.com>
+//
+//	This library is free software; you can redistribute it and/or
+//	modify it under the terms of the GNU Library General Public
+//	License as published by the Free Software Foundation; either
+//	version 2 of the License, or (at your option) any later version.
+//
+//	This library is distributed in the hope that it will be useful,
+//	but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//	Library General Public License for more details.
+//
+//	You should have received a copy of the GNU Library General Public
+//	License along with this library; if not, write to the
+//	Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+//	Boston, MA  02110-1301, USA.
+//
+
+
+
+// Checks PIMEReplyDecoder against the old way of handling the replies (a Json::Value tree
+// and a lookup for every field) with random replies, and measures both of them with a mock
+// text service which takes the changes like the TSF one does.
+//
+// Usage: PIMEReplyDecoderBench [--fuzz <iterations>] [--bench <iterations>] [--seed <n>]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <locale>
+#include <codecvt>
+#include <algorithm>
+
+#include <json/json.h>
+
+#include "PIMEReplyDecoder.h"
+#include "PIMECandidateCache.h"
+
+using namespace std;
+using namespace PIME;
+
+// plays the role of utf8ToUtf16() of libIME in the old code path
+static wstring utf8ToUtf16(const char* str) {
+	static wstring_convert<codecvt_utf8_utf16<wchar_t>> converter;
+	return converter.from_bytes(str);
+}
+
+// a text service which only keeps its state, or also records every change if log is set
+class MockTextService : public ReplyApplier {
+public:
+	explicit MockTextService(bool log = false) :
+		logging_{ log },
+		cursor_{ 0 },
+		candidateCursor_{ 0 },
+		showingCandidates_{ false },
+		changes_{ 0 },
+		missingPages_{ 0 } {
+	}
+
+	const wstring& log() const {
+		return log_;
+	}
+
+	unsigned int changes() const {
+		return changes_;
+	}
+
+	void setKeyInterest(const KeyInterest& keyInterest) override {
+		keyInterest_ = keyInterest;
+		if (logging_) {
+			string keys = keyInterest.keyDown.to_string() + "," + keyInterest.keyUp.to_string();
+			record(L"setKeyInterest", to_wstring(keyInterest.valid) + L"," + to_wstring(keyInterest.whileComposing) + L","
+				+ to_wstring(keyInterest.modifiers) + L"," + wstring(keys.begin(), keys.end()));
+		}
+	}
+
+	void setSelKeys(const wstring& selKeys) override {
+		selKeys_ = selKeys;
+		record(L"setSelKeys", selKeys);
+	}
+
+	void showMessage(const wstring& message, int duration) override {
+		message_ = message;
+		record(L"showMessage", message + L"," + to_wstring(duration));
+	}
+
+	void showCandidates(bool show) override {
+		showingCandidates_ = show;
+		record(L"showCandidates", to_wstring(show));
+	}
+
+	void setCandidateList(vector<wstring>& candidates, bool showCandidates) override {
+		candidates_.swap(candidates);
+		if (!showCandidates)
+			showingCandidates_ = false;
+		if (logging_) {
+			wstring value;
+			for (const auto& cand : candidates_) {
+				value += cand;
+				value += L'|';
+			}
+			record(L"setCandidateList", value + to_wstring(showCandidates));
+		}
+	}
+
+	void setCandidateSource(const CandidateSource& source) override {
+		candidatePages_.reset(source);
+		record(L"setCandidateSource", to_wstring(source.id) + L"," + to_wstring(source.count) + L"," + to_wstring(source.pageSize));
+	}
+
+	void setCandidatePage(CandidatePage& page, bool showCandidates) override {
+		if (logging_) {
+			record(L"setCandidatePage", pageToString(page) + to_wstring(showCandidates));
+		}
+		else {
+			++changes_;
+		}
+		candidatePages_.put(page);
+		// the text service keeps a copy of the page, while the cache keeps the original
+		const vector<wstring>* candidates = candidatePages_.get(page.source, page.index);
+		if (candidates != nullptr)
+			candidates_ = *candidates;
+		else
+			++missingPages_;
+	}
+
+
+	unsigned int missingPages() const {
+		return missingPages_;
+	}
+
+	void setCandidateCursor(int cursor) override {
+		candidateCursor_ = cursor;
+		record(L"setCandidateCursor", to_wstring(cursor));
+	}
+
+	void commitString(const wstring& str) override {
+		committed_ += str;
+		record(L"commitString", str);
+	}
+
+	void setCompositionString(const wstring& str) override {
+		composition_ = str;
+		record(L"setCompositionString", str);
+	}
+
+	void setCompositionCursor(int cursor, const wstring* compositionString) override {
+		cursor_ = cursor;
+		record(L"setCompositionCursor", to_wstring(cursor) + (compositionString != nullptr ? L"," + *compositionString : L""));
+	}
+
+	void compositionDone() override {
+		record(L"compositionDone", L"");
+	}
+
+	void addButtons(const Json::Value& buttons) override {
+		record(L"addButtons", json(buttons));
+	}
+
+	void removeButtons(const Json::Value& ids) override {
+		record(L"removeButtons", json(ids));
+	}
+
+	void changeButtons(const Json::Value& buttons) override {
+		record(L"changeButtons", json(buttons));
+	}
+
+	void addPreservedKeys(const Json::Value& keys) override {
+		record(L"addPreservedKeys", json(keys));
+	}
+
+	void removePreservedKeys(const Json::Value& guids) override {
+		record(L"removePreservedKeys", json(guids));
+	}
+
+	void setKeyboardOpen(bool open) override {
+		record(L"setKeyboardOpen", to_wstring(open));
+	}
+
+	void customizeUI(const Json::Value& options) override {
+		record(L"customizeUI", json(options));
+	}
+
+	void hideMessage() override {
+		message_.clear();
+		record(L"hideMessage", L"");
+	}
+
+private:
+	void record(const wchar_t* name, const wstring& value) {
+		++changes_;
+		if (logging_) {
+			log_ += name;
+			log_ += L'(';
+			log_ += value;
+			log_ += L")\n";
+		}
+	}
+
+	static wstring pageToString(const CandidatePage& page) {
+		wstring value = to_wstring(page.source) + L"," + to_wstring(page.count) + L"," + to_wstring(page.pageSize)
+			+ L"," + to_wstring(page.index) + L",";
+		if (page.hasCandidates) {
+			for (const auto& cand : page.candidates) {
+				value += cand;
+				value += L'|';
+			}
+		}
+		return value;
+	}
+
+	wstring json(const Json::Value& value) {
+		if (!logging_)
+			return wstring();
+		string text = Json::FastWriter().write(value);
+		return wstring(text.begin(), text.end());
+	}
+
+	bool logging_;
+	wstring log_;
+	KeyInterest keyInterest_;
+	wstring selKeys_;
+	wstring message_;
+	vector<wstring> candidates_;
+	wstring composition_;
+	wstring committed_;
+	int cursor_;
+	int candidateCursor_;
+	bool showingCandidates_;
+	CandidatePageCache candidatePages_;
+	unsigned int changes_;
+	unsigned int missingPages_;
+};
+
+// a candidate page decoded with jsoncpp, see legacyApply()
+static bool legacyCandidatePage(const Json::Value& pageVal, CandidatePage& page) {
+	if (!pageVal.isObject() || !pageVal["source"].isUInt() || !pageVal["index"].isUInt())
+		return false;
+	page = CandidatePage{ pageVal["source"].asUInt(), 0, 0, pageVal["index"].asUInt(), false };
+	if (pageVal["count"].isUInt() && pageVal["pageSize"].isUInt()) {
+		page.count = pageVal["count"].asUInt();
+		page.pageSize = pageVal["pageSize"].asUInt();
+	}
+	const auto& candidatesVal = pageVal["candidates"];
+	if (candidatesVal.isArray()) {
+		page.hasCandidates = true;
+		for (const auto& cand : candidatesVal) {
+			page.candidates.push_back(utf8ToUtf16(cand.asCString()));
+		}
+	}
+	return true;
+}
+
+// the old Client::updateStatus(), which looks up every field in a Json::Value tree
+static void legacyApply(Json::Value& msg, ReplyApplier& applier) {
+	if (msg.isMember("keyInterest")) {
+		KeyInterest keyInterest;
+		ReplyDecoder::keyInterestFromJson(msg["keyInterest"], keyInterest);
+		applier.setKeyInterest(keyInterest);
+	}
+
+	const auto& setSelKeysVal = msg["setSelKeys"];
+	if (setSelKeysVal.isString()) {
+		applier.setSelKeys(utf8ToUtf16(setSelKeysVal.asCString()));
+	}
+
+	const auto& showMessageVal = msg["showMessage"];
+	if (showMessageVal.isObject()) {
+		const Json::Value& message = showMessageVal["message"];
+		const Json::Value& duration = showMessageVal["duration"];
+		if (message.isString() && duration.isInt()) {
+			applier.showMessage(utf8ToUtf16(message.asCString()), duration.asInt());
+		}
+	}
+
+	const auto& showCandidatesVal = msg["showCandidates"];
+	if (showCandidatesVal.isBool()) {
+		applier.showCandidates(showCandidatesVal.asBool());
+	}
+
+	const auto& candidateListVal = msg["candidateList"];
+	if (candidateListVal.isArray()) {
+		vector<wstring> candidates;
+		for (auto cand_it = candidateListVal.begin(); cand_it != candidateListVal.end(); ++cand_it) {
+			wstring cand = utf8ToUtf16(cand_it->asCString());
+			candidates.push_back(cand);
+		}
+		applier.setCandidateList(candidates, showCandidatesVal.asBool());
+	}
+
+	// candidate paging did not exist in the old code, so this is what it would look like with jsoncpp
+	const auto& candidateSourceVal = msg["candidateSource"];
+	if (candidateSourceVal.isObject() && candidateSourceVal["id"].isUInt()
+		&& candidateSourceVal["count"].isUInt() && candidateSourceVal["pageSize"].isUInt()) {
+		CandidateSource source{ candidateSourceVal["id"].asUInt(), candidateSourceVal["count"].asUInt(), candidateSourceVal["pageSize"].asUInt() };
+		applier.setCandidateSource(source);
+	}
+
+	CandidatePage page;
+	if (legacyCandidatePage(msg["candidatePage"], page)) {
+		applier.setCandidatePage(page, showCandidatesVal.asBool());
+	}
+
+	const auto& candidateCursorVal = msg["candidateCursor"];
+	if (candidateCursorVal.isInt()) {
+		applier.setCandidateCursor(candidateCursorVal.asInt());
+	}
+
+	const auto& commitStringVal = msg["commitString"];
+	if (commitStringVal.isString()) {
+		applier.commitString(utf8ToUtf16(commitStringVal.asCString()));
+	}
+
+	const auto& compositionStringVal = msg["compositionString"];
+	bool hasCompositionString = false;
+	wstring compositionString;
+	if (compositionStringVal.isString()) {
+		compositionString = utf8ToUtf16(compositionStringVal.asCString());
+		hasCompositionString = true;
+		applier.setCompositionString(compositionString);
+	}
+
+	const auto& compositionCursorVal = msg["compositionCursor"];
+	if (compositionCursorVal.isInt()) {
+		applier.setCompositionCursor(compositionCursorVal.asInt(), hasCompositionString ? &compositionString : nullptr);
+	}
+	applier.compositionDone();
+
+	const char* arrays[] = { "addButton", "removeButton", "changeButton", "addPreservedKey", "removePreservedKey" };
+	for (const char* name : arrays) {
+		const auto& value = msg[name];
+		if (!value.isArray())
+			continue;
+		if (strcmp(name, "addButton") == 0)
+			applier.addButtons(value);
+		else if (strcmp(name, "removeButton") == 0)
+			applier.removeButtons(value);
+		else if (strcmp(name, "changeButton") == 0)
+			applier.changeButtons(value);
+		else if (strcmp(name, "addPreservedKey") == 0)
+			applier.addPreservedKeys(value);
+		else
+			applier.removePreservedKeys(value);
+	}
+
+	const auto& openKeyboardVal = msg["openKeyboard"];
+	if (openKeyboardVal.isBool()) {
+		applier.setKeyboardOpen(openKeyboardVal.asBool());
+	}
+
+	const auto& customizeUIVal = msg["customizeUI"];
+	if (customizeUIVal.isObject()) {
+		applier.customizeUI(customizeUIVal);
+	}
+
+	const auto& hideMessageVal = msg["hideMessage"];
+	if (hideMessageVal.isBool()) {
+		applier.hideMessage();
+	}
+}
+
+class ReplyGenerator {
+public:
+	explicit ReplyGenerator(unsigned int seed) :
+		random_{ seed } {
+	}
+
+	// a random reply, written like the python server does with json.dumps(ensure_ascii=False),
+	// but with random whitespace, member order, and escapes.
+	string reply() {
+		Json::Value msg(Json::objectValue);
+		msg["success"] = pick(8) != 0;
+		msg["seqNum"] = Json::UInt(random_());
+		if (pick(2))
+			msg["return"] = randomReturn();
+		if (pick(4) == 0)
+			msg["compactKeyEvents"] = pick(2) != 0;
+		if (pick(4) == 0) {
+			Json::Value nested(Json::objectValue);
+			nested["success"] = true;
+			nested["compositionString"] = text();
+			msg[pick(2) ? "onKeyDown" : "onKeyUp"] = nested;
+		}
+		if (pick(4) == 0)
+			msg["keyInterest"] = keyInterest();
+		if (pick(4) == 0)
+			msg["setSelKeys"] = "1234567890";
+		if (pick(6) == 0) {
+			Json::Value message(Json::objectValue);
+			message["message"] = text();
+			if (pick(4))
+				message["duration"] = int(pick(5));
+			msg["showMessage"] = message;
+		}
+		if (pick(2))
+			msg["showCandidates"] = pick(2) != 0;
+		if (pick(2)) {
+			Json::Value candidates(Json::arrayValue);
+			int n = int(pick(12));
+			for (int i = 0; i < n; ++i) {
+				candidates.append(text());
+			}
+			msg["candidateList"] = candidates;
+		}
+		if (pick(6) == 0) {
+			Json::Value source(Json::objectValue);
+			source["id"] = int(pick(3));
+			source["count"] = int(pick(300));
+			source["pageSize"] = int(pick(10));
+			msg["candidateSource"] = source;
+		}
+		if (pick(4) == 0)
+			msg["candidatePage"] = candidatePage();
+		if (pick(2))
+			msg["candidateCursor"] = randomInt();
+		if (pick(3) == 0)
+			msg["commitString"] = text();
+		if (pick(2))
+			msg["compositionString"] = pick(4) ? text() : string();
+		if (pick(2))
+			msg["compositionCursor"] = randomInt();
+		if (pick(8) == 0) {
+			Json::Value button(Json::objectValue);
+			button["id"] = "switch-lang";
+			button["tooltip"] = text();
+			button["commandId"] = 1;
+			msg[pick(2) ? "addButton" : "changeButton"].append(button);
+		}
+		if (pick(8) == 0)
+			msg["removeButton"].append("switch-lang");
+		if (pick(8) == 0) {
+			Json::Value key(Json::objectValue);
+			key["guid"] = "{f4d1d56b-ab6b-4345-85a3-d4cd4bbd1e7f}";
+			key["keyCode"] = 32;
+			key["modifiers"] = 2;
+			msg["addPreservedKey"].append(key);
+		}
+		if (pick(8) == 0)
+			msg["removePreservedKey"].append("{f4d1d56b-ab6b-4345-85a3-d4cd4bbd1e7f}");
+		if (pick(4) == 0)
+			msg["openKeyboard"] = pick(2) != 0;
+		if (pick(8) == 0) {
+			Json::Value options(Json::objectValue);
+			options["candFontSize"] = 16;
+			options["candPerRow"] = 1;
+			msg["customizeUI"] = options;
+		}
+		if (pick(8) == 0)
+			msg["hideMessage"] = true;
+		// a few values of the wrong types, which should be ignored
+		if (pick(8) == 0)
+			msg["compositionString"] = 1;
+		if (pick(8) == 0)
+			msg["candidateList"] = "candidates";
+		if (pick(8) == 0)
+			msg["showCandidates"] = Json::Value();
+
+		string json;
+		write(msg, json);
+		return json;
+	}
+
+	size_t pick(size_t n) {
+		return random_() % n;
+	}
+
+private:
+	Json::Value candidatePage() {
+		Json::Value page(Json::objectValue);
+		page["source"] = int(pick(3));
+		if (pick(2)) {
+			page["count"] = int(pick(300));
+			page["pageSize"] = int(pick(10));
+		}
+		page["index"] = pick(8) ? Json::Value(int(pick(30))) : Json::Value(-1);
+		if (pick(2)) {
+			Json::Value candidates(Json::arrayValue);
+			int n = int(pick(10));
+			for (int i = 0; i < n; ++i) {
+				candidates.append(text());
+			}
+			page["candidates"] = candidates;
+		}
+		return page;
+	}
+
+	Json::Value keyInterest() {
+		if (pick(4) == 0)
+			return Json::Value();
+		Json::Value keyInterest(Json::objectValue);
+		if (pick(8))
+			keyInterest["version"] = pick(8) ? 1 : 2;
+		const char* lists[] = { "keyDown", "keyUp" };
+		for (const char* list : lists) {
+			if (pick(4) == 0)
+				continue;
+			Json::Value keys(Json::arrayValue);
+			int n = int(pick(6));
+			for (int i = 0; i < n; ++i) {
+				switch (pick(16)) {
+				case 0:
+					keys.append(-1);
+					break;
+				case 1:
+					keys.append(256 + int(pick(1000)));
+					break;
+				case 2:
+					keys.append("a");
+					break;
+				default:
+					keys.append(int(pick(256)));
+					break;
+				}
+			}
+			keyInterest[list] = keys;
+		}
+		if (pick(2))
+			keyInterest["modifiers"] = int(pick(8));
+		if (pick(2))
+			keyInterest["whileComposing"] = pick(2) != 0;
+		return keyInterest;
+	}
+
+	Json::Value randomReturn() {
+		switch (pick(3)) {
+		case 0:
+			return pick(2) != 0;
+		case 1:
+			return int(pick(3));
+		default: {  // a menu
+			Json::Value item(Json::objectValue);
+			item["id"] = 1;
+			item["text"] = text();
+			Json::Value menu(Json::arrayValue);
+			menu.append(item);
+			return menu;
+		}
+		}
+	}
+
+	Json::Value randomInt() {
+		switch (pick(4)) {
+		case 0:
+			return -int(pick(10));
+		case 1:
+			return Json::Int64(0x100000000LL + pick(10));  // does not fit in an int
+		default:
+			return int(pick(20));
+		}
+	}
+
+	// random text with ASCII, CJK, and non-BMP chars, and chars which need escaping
+	string text() {
+		static const char* const pieces[] = {
+			"a", "Z", "1", " ", "\"", "\\", "/", "\n", "\t", "\x01",
+			u8"中", u8"ㄓ", u8"ˋ", u8"é", u8"\U0001f600", u8"\U00020000"
+		};
+		string result;
+		int n = int(pick(8));
+		for (int i = 0; i < n; ++i) {
+			result += pieces[pick(sizeof(pieces) / sizeof(pieces[0]))];
+		}
+		return result;
+	}
+
+	void spaces(string& json) {
+		if (pick(4) == 0)
+			json += " \n\t"[pick(3)];
+	}
+
+	void writeString(const string& str, string& json) {
+		json += '"';
+		for (size_t i = 0; i < str.length(); ++i) {
+			unsigned char c = static_cast<unsigned char>(str[i]);
+			if (c == '"' || c == '\\') {
+				json += '\\';
+				json += char(c);
+			}
+			else if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				json += buf;
+			}
+			else if (c >= 0x80) {
+				size_t len = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : 2;
+				if (pick(8) == 0) {
+					// escape a non-ASCII char like json.dumps(ensure_ascii=True)
+					wstring utf16 = utf8ToUtf16(str.substr(i, len).c_str());
+					for (wchar_t ch : utf16) {
+						char buf[8];
+						snprintf(buf, sizeof(buf), "\\u%04X", unsigned(ch));
+						json += buf;
+					}
+				}
+				else {
+					json += str.substr(i, len);
+				}
+				i += len - 1;
+			}
+			else if (c == '/' && pick(2) == 0) {
+				json += "\\/";
+			}
+			else {
+				json += char(c);
+			}
+		}
+		json += '"';
+	}
+
+	void write(const Json::Value& value, string& json) {
+		switch (value.type()) {
+		case Json::objectValue: {
+			vector<string> names = value.getMemberNames();
+			shuffle(names.begin(), names.end(), random_);
+			json += '{';
+			for (size_t i = 0; i < names.size(); ++i) {
+				if (i > 0)
+					json += pick(2) ? ", " : ",";
+				spaces(json);
+				writeString(names[i], json);
+				json += pick(2) ? ": " : ":";
+				write(value[names[i]], json);
+				spaces(json);
+			}
+			json += '}';
+			break;
+		}
+		case Json::arrayValue:
+			json += '[';
+			for (Json::ArrayIndex i = 0; i < value.size(); ++i) {
+				if (i > 0)
+					json += pick(2) ? ", " : ",";
+				write(value[i], json);
+			}
+			json += ']';
+			break;
+		case Json::stringValue:
+			writeString(value.asString(), json);
+			break;
+		default:
+			json += Json::FastWriter().write(value);
+			json.pop_back();  // the newline added by FastWriter
+			break;
+		}
+	}
+
+	mt19937 random_;
+};
+
+// returns an error message if the decoder gives a different result from the old code path
+static string compareReply(const string& json) {
+	Json::Value msg;
+	Json::Reader reader;
+	if (!reader.parse(json, msg))
+		return "jsoncpp fails to parse the reply";
+	Reply reply;
+	if (!ReplyDecoder::decode(json, reply))
+		return "the decoder fails to parse the reply";
+
+	if (reply.success != msg.get("success", false).asBool())
+		return "success is different";
+	if (reply.seqNum != msg["seqNum"].asUInt())
+		return "seqNum is different";
+	// jsoncpp throws for menus
+	if (msg["return"].isConvertibleTo(Json::booleanValue) && reply.returnValue != msg["return"].asBool())
+		return "return is different";
+	Json::Value returnValue;
+	if (!reply.returnJson.empty() && !reader.parse(reply.returnJson, returnValue))
+		return "the raw json of return is invalid";
+	if (returnValue != msg["return"])
+		return "the raw json of return is different";
+	if (reply.compactKeyEvents != msg.get("compactKeyEvents", false).asBool())
+		return "compactKeyEvents is different";
+	Json::Value nested;
+	if (!reply.onKeyDownReply.empty() && !reader.parse(reply.onKeyDownReply, nested))
+		return "the nested reply of onKeyDown is invalid";
+	if (nested != msg["onKeyDown"])
+		return "the nested reply of onKeyDown is different";
+
+	MockTextService expected{ true };
+	legacyApply(msg, expected);
+	MockTextService actual{ true };
+	ReplyDecoder::apply(reply, actual);
+	if (actual.log() != expected.log()) {
+		string error = "different changes:\n";
+		for (wchar_t ch : expected.log())
+			error += ch < 0x80 ? char(ch) : '?';
+		error += "---\n";
+		for (wchar_t ch : actual.log())
+			error += ch < 0x80 ? char(ch) : '?';
+		return error;
+	}
+	return string();
+}
+
+static bool fuzz(unsigned int iterations, unsigned int seed) {
+	ReplyGenerator generator{ seed };
+	unsigned int failures = 0;
+	for (unsigned int i = 0; i < iterations && failures < 10; ++i) {
+		string json = generator.reply();
+		string error = compareReply(json);
+		if (!error.empty()) {
+			fprintf(stderr, "Mismatch: %s\n  reply: %s\n", error.c_str(), json.c_str());
+			++failures;
+		}
+
+		// a truncated copy should be rejected without crashing
+		vector<char> truncated(json.begin(), json.begin() + generator.pick(json.length()));
+		Reply reply;
+		if (ReplyDecoder::decode(truncated.data(), truncated.size(), reply)) {
+			fprintf(stderr, "A truncated reply is accepted: %s\n", string(truncated.begin(), truncated.end()).c_str());
+			++failures;
+		}
+	}
+	printf("fuzz: %u iterations, %u failures\n", iterations, failures);
+	return failures == 0;
+}
+
+template <typename Func>
+static double measure(unsigned int iterations, Func func) {
+	auto start = chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i) {
+		func();
+	}
+	auto elapsed = chrono::steady_clock::now() - start;
+	return chrono::duration<double, nano>(elapsed).count() / iterations;
+}
+
+static void benchReply(const char* name, const string& json, unsigned int iterations) {
+	MockTextService textService;
+	double legacyTime = measure(iterations, [&]() {
+		Json::Value msg;
+		Json::Reader reader;
+		reader.parse(json, msg);
+		if (msg.get("success", false).asBool())
+			legacyApply(msg, textService);
+	});
+	Reply reply;
+	double decoderTime = measure(iterations, [&]() {
+		if (ReplyDecoder::decode(json, reply) && reply.success)
+			ReplyDecoder::apply(reply, textService);
+	});
+	printf("%s: %u bytes\n", name, unsigned(json.length()));
+	printf("  Json::Reader + lookups: %.1f ns/reply\n", legacyTime);
+	printf("  ReplyDecoder: %.1f ns/reply\n", decoderTime);
+}
+
+static string quote(const string& str) {
+	return "\"" + str + "\"";
+}
+
+// the replies of the server while the user goes through the first pages of a long candidate list
+// and back, moving the cursor on every page, with the whole page in every reply, or with candidate paging.
+// the candidateSource is left out if lostSource is set, like when the client drops the reply with it.
+// if the client loses the reply lostReply, it asks for a resync, so the next reply has the whole state.
+static vector<string> pagingReplies(bool paging, uint32_t pagesVisited, bool lostSource = false, size_t lostReply = SIZE_MAX) {
+	const uint32_t count = 300;
+	const uint32_t pageSize = 9;
+	const uint32_t pageCount = (count + pageSize - 1) / pageSize;
+	static const char* const chars[] = { u8"中", u8"種", u8"重", u8"眾", u8"仲", u8"忠", u8"鍾", u8"衷" };
+	vector<string> candidates;
+	for (uint32_t i = 0; i < count; ++i) {
+		// wildcard queries return phrases of a few chars
+		candidates.push_back(string(chars[i % 8]) + chars[(i / 8) % 8] + chars[(i / 64) % 8]);
+	}
+
+	pagesVisited = min(pagesVisited, pageCount);
+	vector<uint32_t> shownPages;
+	for (uint32_t page = 0; page < pagesVisited; ++page) {
+		shownPages.insert(shownPages.end(), 3, page);
+	}
+	for (uint32_t page = pagesVisited; page-- > 0;) {
+		shownPages.insert(shownPages.end(), 3, page);
+	}
+
+	auto pageList = [&](uint32_t page) {
+		string list = "[";
+		for (uint32_t j = page * pageSize; j < min(count, (page + 1) * pageSize); ++j) {
+			if (list.length() > 1)
+				list += ", ";
+			list += quote(candidates[j]);
+		}
+		return list + "]";
+	};
+
+	vector<string> replies;
+	// the server knows which pages the client keeps, like textService.py
+	vector<uint32_t> cachedPages;  // the least recently used first
+	auto pageReply = [&](uint32_t page, bool withCandidates) {
+		string json = "{\"source\": 1, \"index\": " + to_string(page);
+		if (withCandidates)
+			json += ", \"count\": " + to_string(count) + ", \"pageSize\": " + to_string(pageSize) + ", \"candidates\": " + pageList(page);
+		auto it = find(cachedPages.begin(), cachedPages.end(), page);
+		if (it != cachedPages.end())
+			cachedPages.erase(it);
+		else if (cachedPages.size() == CandidatePageCache::maxPages)
+			cachedPages.erase(cachedPages.begin());
+		cachedPages.push_back(page);
+		return json + "}";
+	};
+	auto isCached = [&](uint32_t page) {
+		return find(cachedPages.begin(), cachedPages.end(), page) != cachedPages.end();
+	};
+	for (size_t i = 0; i < shownPages.size(); ++i) {
+		uint32_t page = shownPages[i];
+		string json = "{\"compositionString\": \"?\", \"compositionCursor\": 1, \"showCandidates\": true, ";
+		if (!paging) {
+			json += "\"candidateList\": " + pageList(page);
+		}
+		else {
+			bool resync = (i > 0 && i - 1 == lostReply);
+			if (resync)  // the server forgets the pages of the client
+				cachedPages.clear();
+			if ((i == 0 && !lostSource) || resync)
+				json += "\"candidateSource\": {\"id\": 1, \"count\": " + to_string(count) + ", \"pageSize\": " + to_string(pageSize) + "}, ";
+			json += "\"candidatePage\": " + pageReply(page, !isCached(page));
+		}
+		json += ", \"candidateCursor\": " + to_string(i % 3) + ", \"return\": true, \"success\": true, \"seqNum\": " + to_string(i) + "}";
+		replies.push_back(json);
+	}
+	return replies;
+}
+
+static void benchPaging(unsigned int iterations) {
+	const char* names[] = { "whole pages", "candidate paging" };
+	for (int i = 0; i < 4; ++i) {
+		int paging = i % 2;
+		uint32_t pagesVisited = (i < 2) ? 6 : 34;
+		vector<string> replies = pagingReplies(paging != 0, pagesVisited);
+		size_t bytes = 0;
+		for (const auto& json : replies) {
+			bytes += json.length();
+		}
+		unsigned int rounds = iterations / unsigned(replies.size()) + 1;
+		MockTextService textService;
+		Reply reply;
+		double time = measure(rounds, [&]() {
+			for (const auto& json : replies) {
+				if (ReplyDecoder::decode(json, reply) && reply.success)
+					ReplyDecoder::apply(reply, textService);
+			}
+		});
+		printf("%u pages of 300 candidates and back with %s: %u replies, %u bytes, %.1f ns/reply",
+			pagesVisited, names[paging], unsigned(replies.size()), unsigned(bytes), time / replies.size());
+		printf("\n");
+		if (textService.missingPages() > 0)
+			fprintf(stderr, "The client does not have %u pages\n", textService.missingPages());
+	}
+}
+
+// the pages must be usable without the candidateSource, since they carry the size of the source
+static bool checkLostCandidateSource() {
+	MockTextService textService;
+	Reply reply;
+	for (const auto& json : pagingReplies(true, 34, true)) {
+		if (ReplyDecoder::decode(json, reply) && reply.success)
+			ReplyDecoder::apply(reply, textService);
+	}
+	if (textService.missingPages() > 0) {
+		fprintf(stderr, "Without the candidateSource, the client does not have %u pages\n", textService.missingPages());
+		return false;
+	}
+	return true;
+}
+
+// the server thinks the client has the pages of a lost reply until the client asks for a resync
+static bool checkLostReply() {
+	for (size_t lostReply = 0; lostReply < 34 * 6; lostReply += 5) {
+		MockTextService textService;
+		Reply reply;
+		vector<string> replies = pagingReplies(true, 34, false, lostReply);
+		for (size_t i = 0; i < replies.size(); ++i) {
+			if (i != lostReply && ReplyDecoder::decode(replies[i], reply) && reply.success)
+				ReplyDecoder::apply(reply, textService);
+		}
+		if (textService.missingPages() > 0) {
+			fprintf(stderr, "After losing reply %u, the client does not have %u pages\n", unsigned(lostReply), textService.missingPages());
+			return false;
+		}
+	}
+	return true;
+}
+
+static void bench(unsigned int iterations) {
+	// typical replies of the python server for a Bopomofo input method
+	string composing = u8"{\"success\": true, \"seqNum\": 12345, \"return\": true, "
+		u8"\"compositionString\": \"ㄓㄨㄥˋ\", \"compositionCursor\": 4, "
+		u8"\"showCandidates\": true, \"setSelKeys\": \"1234567890\", "
+		u8"\"candidateList\": [\"中\", \"種\", \"重\", \"眾\", \"仲\", "
+		u8"\"忠誠\", \"鍾\", \"衆\", \"衷\", \"媑\"], \"candidateCursor\": 0}";
+	string committed = u8"{\"success\": true, \"seqNum\": 12346, \"return\": true, "
+		u8"\"commitString\": \"中\", \"compositionString\": \"\", \"compositionCursor\": 0, "
+		u8"\"showCandidates\": false, \"candidateList\": [], "
+		u8"\"keyInterest\": {\"version\": 1, \"keyDown\": [16, 20], \"keyUp\": [16], \"modifiers\": 4, \"whileComposing\": true}}";
+	string ignored = "{\"success\": true, \"seqNum\": 12347, \"return\": false}";
+	benchReply("composing with candidates", composing, iterations);
+	benchReply("commit", committed, iterations);
+	benchReply("key not handled", ignored, iterations);
+	benchPaging(iterations);
+}
+
+int main(int argc, char** argv) {
+	unsigned int fuzzIterations = 100000;
+	unsigned int benchIterations = 200000;
+	unsigned int seed = 1;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--fuzz" && i + 1 < argc)
+			fuzzIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--bench" && i + 1 < argc)
+			benchIterations = unsigned(atoi(argv[++i]));
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = unsigned(atoi(argv[++i]));
+		else {
+			fprintf(stderr, "Usage: %s [--fuzz iterations] [--bench iterations] [--seed n]\n", argv[0]);
+			return 1;
+		}
+	}
+	bool ok = fuzz(fuzzIterations, seed);
+	ok = checkLostCandidateSource() && ok;
+	ok = checkLostReply() && ok;
+	if (benchIterations > 0) {
+		bench(benchIterations);
+	}
+	return ok ? 0 : 1;
+}
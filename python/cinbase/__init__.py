@@ -14,6 +14,7 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 from keycodes import *  # for VK_XXX constants
+from textService import TF_MOD_SHIFT
 import os.path
 import time
 import opencc  # OpenCC 繁體簡體中文轉換
@@ -737,7 +738,7 @@ class CinBase:
 
                 # 候選清單分頁
                 pagecandidates = list(self.chunks(candidates, cbTS.candPerPage))
-                cbTS.setCandidateList(pagecandidates[currentCandPage])
+                cbTS.setCandidatePages(pagecandidates, currentCandPage)
                 if not cbTS.isSelKeysChanged:
                     cbTS.setShowCandidates(True)
                 cbTS.resetMenuCand = False
@@ -975,7 +976,7 @@ class CinBase:
                 # 更新選字視窗游標位置
                 cbTS.setCandidateCursor(candCursor)
                 cbTS.setCandidatePage(currentCandPage)
-                cbTS.setCandidateList(pagecandidates[currentCandPage])
+                cbTS.setCandidatePages(pagecandidates, currentCandPage)
 
         # 按鍵處理 ----------------------------------------------------------------
         # 某些狀況須要特別處理或忽略
@@ -1811,7 +1812,7 @@ class CinBase:
                             pagecandidates = cbTS.wildcardpagecandidates
                     else:
                         pagecandidates = list(self.chunks(candidates, cbTS.candPerPage))
-                    cbTS.setCandidateList(pagecandidates[currentCandPage])
+                    cbTS.setCandidatePages(pagecandidates, currentCandPage)
 
                     if not cbTS.isSelKeysChanged:
                         cbTS.setShowCandidates(True)
@@ -1859,7 +1860,7 @@ class CinBase:
                             cbTS.isHomophoneChardefs = True
                             cbTS.homophonecandidates = HCinTable.cin.getCharDef(HCinTable.cin.getKeyList(cbTS.homophoneStr)[i])
                             pagecandidates = list(self.chunks(cbTS.homophonecandidates, cbTS.candPerPage))
-                            cbTS.setCandidateList(pagecandidates[currentCandPage])
+                            cbTS.setCandidatePages(pagecandidates, currentCandPage)
                     elif keyCode == VK_UP:  # 游標上移
                         if (candCursor - cbTS.candPerRow) < 0:
                             if currentCandPage > 0:
@@ -1915,14 +1916,14 @@ class CinBase:
                                     cbTS.homophoneStr = commitStr
                                     cbTS.homophonecandidates = HCinTable.cin.getKeyNameList(HCinTable.cin.getKeyList(commitStr))
                                     pagecandidates = list(self.chunks(cbTS.homophonecandidates, cbTS.candPerPage))
-                                    cbTS.setCandidateList(pagecandidates[currentCandPage])
+                                    cbTS.setCandidatePages(pagecandidates, currentCandPage)
                                 else:
                                     cbTS.homophonemode = True
                                     cbTS.homophoneChar = cbTS.compositionChar
                                     cbTS.isHomophoneChardefs = True
                                     cbTS.homophonecandidates = HCinTable.cin.getCharDef(HCinTable.cin.getKey(commitStr))
                                     pagecandidates = list(self.chunks(cbTS.homophonecandidates, cbTS.candPerPage))
-                                    cbTS.setCandidateList(pagecandidates[currentCandPage])
+                                    cbTS.setCandidatePages(pagecandidates, currentCandPage)
                     elif (keyCode == VK_RETURN or (keyCode == VK_SPACE and not cbTS.switchPageWithSpace)) and cbTS.canSetCommitString:  # 按下 Enter 鍵或空白鍵
                         if not cbTS.homophoneselpinyinmode:
                             # 找出目前游標位置的選字鍵 (1234..., asdf...等等)
@@ -1948,7 +1949,7 @@ class CinBase:
                             candCursor = 0
                             currentCandPage = 0
                             pagecandidates = list(self.chunks(cbTS.homophonecandidates, cbTS.candPerPage))
-                            cbTS.setCandidateList(pagecandidates[currentCandPage])
+                            cbTS.setCandidatePages(pagecandidates, currentCandPage)
                     elif keyCode == VK_SPACE and cbTS.switchPageWithSpace: # 按下空白鍵
                         if cbTS.canUseSpaceAsPageKey:
                             if (currentCandPage + 1) < currentCandPageCount:
@@ -1964,7 +1965,7 @@ class CinBase:
                     # 更新選字視窗游標位置及頁數
                     cbTS.setCandidateCursor(candCursor)
                     cbTS.setCandidatePage(currentCandPage)
-                    cbTS.setCandidateList(pagecandidates[currentCandPage])
+                    cbTS.setCandidatePages(pagecandidates, currentCandPage)
             else: # 沒有候選字
                 # 按下空白鍵或 Enter 鍵
                 if (keyCode == VK_SPACE or keyCode == VK_RETURN) and not cbTS.tempEnglishMode:
@@ -2068,7 +2069,7 @@ class CinBase:
 
                 # 候選清單分頁
                 pagecandidates = list(self.chunks(phrasecandidates, cbTS.candPerPage))
-                cbTS.setCandidateList(pagecandidates[currentCandPage])
+                cbTS.setCandidatePages(pagecandidates, currentCandPage)
                 cbTS.setShowCandidates(True)
 
                 # 使用選字鍵執行項目或輸出候選字
@@ -2194,7 +2195,7 @@ class CinBase:
                                         candidates = self.sortByPhrase(cbTS, copy.deepcopy(candidates))
                                 if candidates:
                                     pagecandidates = list(self.chunks(candidates, cbTS.candPerPage))
-                                    cbTS.setCandidateList(pagecandidates[currentCandPage])
+                                    cbTS.setCandidatePages(pagecandidates, currentCandPage)
                                     cbTS.setShowCandidates(True)
                         elif len(cbTS.compositionChar) == 0 and charStr == '`':
                             cbTS.compositionChar += charStr
@@ -2210,7 +2211,7 @@ class CinBase:
                 # 更新選字視窗游標位置及頁數
                 cbTS.setCandidateCursor(candCursor)
                 cbTS.setCandidatePage(currentCandPage)
-                cbTS.setCandidateList(pagecandidates[currentCandPage])
+                cbTS.setCandidatePages(pagecandidates, currentCandPage)
 
                 if cbTS.showPhrase and cbTS.phrasemode:
                     cbTS.isShowPhraseCandidates = True
@@ -2256,6 +2257,26 @@ class CinBase:
 
         return True
 
+    # 回報目前狀態下輸入法需要過濾的按鍵，其餘按鍵用戶端不必再詢問輸入法
+    # 只有在英數半形模式且沒有正在輸入時，filterKeyDown() 一律 return False，
+    # filterKeyUp() 也只需要處理 Shift 和 CapsLock，其餘狀況一律詢問輸入法
+    def keyInterest(self, cbTS, CinTable):
+        if CinTable.loading or cbTS.langMode != ENGLISH_MODE or cbTS.shapeMode != HALFSHAPE_MODE:
+            return None
+
+        if cbTS.isComposing() or cbTS.showCandidates or cbTS.isShowMessage:
+            return None
+
+        if cbTS.showPhrase and cbTS.phrasemode and cbTS.isShowPhraseCandidates:
+            return None
+
+        if cbTS.isLangModeChanged or cbTS.isShapeModeChanged or cbTS.isSelKeysChanged or cbTS.showMessageOnKeyUp or cbTS.hideMessageOnKeyUp:
+            return None
+
+        # 按住 Shift 時的按鍵也要詢問，filterKeyUp() 才能分辨是否只按了 Shift 鍵
+        keys = [VK_SHIFT, VK_CAPITAL]
+        return {"version": 1, "keyDown": keys, "keyUp": keys, "modifiers": TF_MOD_SHIFT, "whileComposing": True}
+
     # 使用者放開按鍵，在 app 收到前先過濾那些鍵是輸入法需要的。
     # return True，系統會呼叫 onKeyUp() 進一步處理這個按鍵
     # return False，表示我們不需要這個鍵，系統會原封不動把按鍵傳給應用程式
@@ -117,6 +117,11 @@ class CheArrayTextService(TextService):
         return KeyState
 
 
+    # 回報目前狀態下輸入法需要過濾的按鍵
+    def keyInterest(self):
+        return self.cinbase.keyInterest(self, CinTable)
+
+
     def onKeyUp(self, keyEvent):
         self.cinbase.onKeyUp(self, keyEvent)
 
@@ -104,6 +104,11 @@ class CheLiuTextService(TextService):
         return KeyState
 
 
+    # 回報目前狀態下輸入法需要過濾的按鍵
+    def keyInterest(self):
+        return self.cinbase.keyInterest(self, CinTable)
+
+
     def onKeyUp(self, keyEvent):
         self.cinbase.onKeyUp(self, keyEvent)
 
@@ -15,24 +15,72 @@
 # License along with this library; if not, write to the Free Software
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+import io
 import json
+import os
+import struct
 import sys
 import traceback
 
 if __name__ == "__main__":
     sys.path.append('python3')
 
-# redirect stdout to stderr so we can see all of the error messages in
-# PIMEDebugConsole since it only reads stdout.
-sys.stderr = sys.stdout
+# PIMELauncher reads our stderr as a separate log channel if it sets PIME_LOG=stderr,
+# so debug output never gets mixed with the replies on stdout.
+# Otherwise, redirect stderr to stdout so we can see all of the error messages in
+# PIMEDebugConsole since the launcher only reads stdout.
+LOG_ACK = "PIME_LOG|stderr"
+logOnStderr = (os.environ.get("PIME_LOG") == "stderr")
+if logOnStderr:
+    # print() is only used for debug output, the replies are written to sys.__stdout__.
+    sys.stderr = io.TextIOWrapper(sys.stderr.buffer, encoding="utf-8", errors="ignore", line_buffering=True)
+    sys.stdout = sys.stderr
+else:
+    sys.stderr = sys.stdout
 
 from serviceManager import textServiceMgr
 
 
+# Optional binary framing offered by PIMELauncher via the environment variable
+# PIME_FRAMING=binary. See PIMELauncher/BackendProtocol.h for the details.
+FRAMING_ACK = "PIME_FRAMING|binary"
+FRAME_HEADER = struct.Struct("<HHIII")  # magic, type, length, client handle, seqNum
+FRAME_MAGIC = 0x4d50
+FRAME_REQUEST = 1
+FRAME_REPLY = 2
+FRAME_LOG = 3
+
+
+class FrameLogWriter(io.TextIOBase):
+    # send everything printed by the backend to PIMELauncher in log frames
+    # so debug messages never get mixed with the replies.
+    def __init__(self, server):
+        self.server = server
+        self.pending = []
+
+    def writable(self):
+        return True
+
+    def write(self, s):
+        # line buffered, print() writes its arguments piece by piece
+        self.pending.append(s)
+        if "\n" in s:
+            self.flush()
+        return len(s)
+
+    def flush(self):
+        if self.pending:
+            text = "".join(self.pending)
+            self.pending = []
+            self.server.writeFrame(FRAME_LOG, 0, 0, text.encode("utf-8", "ignore"))
+
+
 class Client(object):
     def __init__(self, server):
         self.server = server
         self.service = None
+        self.fusedKeyEvents = False
+        self.candidatePaging = 0
 
     def init(self, msg):
         self.guid = msg["id"]
@@ -40,6 +88,10 @@ class Client(object):
         self.isMetroApp = msg["isMetroApp"]
         self.isUiLess = msg["isUiLess"]
         self.isUiLess = msg["isConsole"]
+        # the client accepts the result of onKeyDown/onKeyUp in the reply of filterKeyDown/filterKeyUp
+        self.fusedKeyEvents = msg.get("fusedKeyEvents", False)
+        # the number of candidate pages the client keeps, or 0 if it only accepts the whole candidateList
+        self.candidatePaging = msg.get("candidatePaging", 0)
         # create the text service
         self.service = textServiceMgr.createService(self, self.guid)
         return (self.service is not None)
@@ -57,6 +109,8 @@ class Client(object):
             success = False
             if method == "init": # initialize the text service
                 success = self.init(msg)
+                if success and not self.service.fullKeyStates:
+                    reply["compactKeyEvents"] = True
             reply["success"] = success
         # print(reply)
         return reply
@@ -65,17 +119,78 @@ class Client(object):
 class Server(object):
     def __init__(self):
         self.clients = {}
+        self.binaryFraming = False
+        self.stdin = sys.stdin.buffer
+        self.stdout = sys.__stdout__.buffer
+
+    def enableBinaryFraming(self):
+        # tell PIMELauncher that we support binary frames. this is the last
+        # line we write in text mode and all of the following output is framed.
+        self.writeLine(FRAMING_ACK)
+        self.binaryFraming = True
+        if not logOnStderr:
+            sys.stdout = sys.stderr = FrameLogWriter(self)
+
+    def writeLine(self, line):
+        # write a text line to PIMELauncher
+        sys.__stdout__.write(line + "\n")
+        sys.__stdout__.flush()
+
+    def writeFrame(self, frameType, clientHandle, seqNum, data):
+        self.stdout.write(FRAME_HEADER.pack(FRAME_MAGIC, frameType, len(data), clientHandle, seqNum))
+        self.stdout.write(data)
+        self.stdout.flush()
+
+    # read the next message from PIMELauncher.
+    # returns a tuple (client_id, seqNum, msg_text). seqNum is 0 for text messages.
+    def readMessage(self):
+        if self.binaryFraming:
+            # PIMELauncher might still send a few text lines before it gets our ack.
+            # a binary frame always starts with 'P' while a text line starts with a digit.
+            head = self.stdin.peek(1)[:1]
+            if not head:
+                raise EOFError
+            if head == b"P":
+                header = self.stdin.read(FRAME_HEADER.size)
+                if len(header) < FRAME_HEADER.size:
+                    raise EOFError
+                magic, frameType, length, clientHandle, seqNum = FRAME_HEADER.unpack(header)
+                payload = self.stdin.read(length)
+                if magic != FRAME_MAGIC or len(payload) < length:
+                    raise EOFError
+                return str(clientHandle), seqNum, payload.decode("utf-8", "ignore")
+            line = self.stdin.readline()
+            if not line:
+                raise EOFError
+            line = line.decode("utf-8", "ignore")
+        else:
+            line = input()
+        line = line.strip()
+        if not line:
+            return None
+        client_id, msg_text = line.split('|', maxsplit=1)
+        return client_id, 0, msg_text
+
+    def sendReply(self, client_id, seqNum, reply_text):
+        if self.binaryFraming:
+            clientHandle = int(client_id) if client_id.isdigit() else 0
+            self.writeFrame(FRAME_REPLY, clientHandle, seqNum, reply_text.encode("utf-8", "ignore"))
+        else:
+            # one response per line in the format "PIME_MSG|<client_id>|<json reply>"
+            reply_line = '|'.join(["PIME_MSG", client_id, reply_text])
+            self.writeLine(reply_line)
 
     def run(self):
         while True:
             line = ""
             client_id = ""
+            seqNum = 0
             try:
-                line = input().strip()
-                if not line:
+                message = self.readMessage()
+                if not message:
                     continue
-                client_id, msg_text = line.split('|', maxsplit=1)
-                msg = json.loads(msg_text)
+                client_id, seqNum, line = message
+                msg = json.loads(line)
                 client = self.clients.get(client_id)
                 if not client:
                     # create a Client instance for the client
@@ -87,9 +202,7 @@ class Server(object):
                 else:
                     ret = client.handleRequest(msg)
                     # Send the response to the client via stdout
-                    # one response per line in the format "PIME_MSG|<client_id>|<json reply>"
-                    reply_line = '|'.join(["PIME_MSG", client_id, json.dumps(ret, ensure_ascii=False)])
-                    print(reply_line)
+                    self.sendReply(client_id, seqNum, json.dumps(ret, ensure_ascii=False))
             except EOFError:
                 # stop the server
                 break
@@ -98,8 +211,7 @@ class Server(object):
                 # print the exception traceback for ease of debugging
                 traceback.print_exc()
                 # generate an empty output containing {success: False} to prevent the client from being blocked
-                reply_line = '|'.join(["PIME_MSG", client_id, '{"success":false}'])
-                print(reply_line)
+                self.sendReply(client_id, seqNum, '{"success":false}')
                 # Just terminate the python server process if any unknown error happens.
                 # The python server will be restarted later by PIMELauncher.
                 sys.exit(1)
@@ -114,6 +226,13 @@ class Server(object):
 
 def main():
     server = Server()
+    if logOnStderr:
+        server.writeLine(LOG_ACK)  # all of our debug output goes to stderr
+    # all modules are imported, tell PIMELauncher that we're ready to serve clients.
+    if os.environ.get("PIME_FRAMING") == "binary":
+        server.enableBinaryFraming()  # the ack of binary framing also means we're ready
+    else:
+        server.writeLine("PIME_READY")
     server.run()
 
 
@@ -15,6 +15,8 @@
 # License along with this library; if not, write to the Free Software
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+from collections import OrderedDict
+
 # keyboard modifiers used by TSF (from msctf.h of Windows SDK)
 TF_MOD_ALT                       = 0x0001
 TF_MOD_CONTROL                   = 0x0002
@@ -33,6 +35,18 @@ COMMAND_LEFT_CLICK  = 0
 COMMAND_RIGHT_CLICK = 1
 COMMAND_MENU        = 2
 
+# keys whose states are sent as bits of "keyModifiers" in the compact key events.
+# bit i is set if the key is down, and bit (16 + i) is set if it's toggled.
+# NOTE: keep this in sync with compactStateKeys in PIMETextService/PIMEClient.cpp.
+COMPACT_STATE_KEYS = [
+    0x10, 0x11, 0x12,  # VK_SHIFT, VK_CONTROL, VK_MENU
+    0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5,  # VK_LSHIFT, VK_RSHIFT, VK_LCONTROL, VK_RCONTROL, VK_LMENU, VK_RMENU
+    0x5B, 0x5C,  # VK_LWIN, VK_RWIN
+    0x14, 0x90, 0x91  # VK_CAPITAL, VK_NUMLOCK, VK_SCROLL
+]
+COMPACT_STATE_BITS = {code: i for i, code in enumerate(COMPACT_STATE_KEYS)}
+
+
 class KeyEvent:
     def __init__(self, msg):
         self.charCode = msg["charCode"]
@@ -40,12 +54,36 @@ class KeyEvent:
         self.repeatCount = msg["repeatCount"]
         self.scanCode = msg["scanCode"]
         self.isExtended = msg["isExtended"]
-        self.keyStates = msg["keyStates"]
+        self._keyStates = msg.get("keyStates")
+        # compact key events only carry the modifier and lock keys and the other keys which are down
+        self.keyModifiers = msg.get("keyModifiers", 0)
+        self.keysDown = msg.get("keysDown", ())
+
+    @property
+    def keyStates(self):
+        # expand the compact key event to the full array of 256 key states
+        if self._keyStates is None:
+            keyStates = [0] * 256
+            for code in self.keysDown:
+                keyStates[code] = 0x80
+            for code, i in COMPACT_STATE_BITS.items():
+                if self.keyModifiers & (1 << i):
+                    keyStates[code] |= 0x80
+                if self.keyModifiers & (1 << (16 + i)):
+                    keyStates[code] |= 1
+            self._keyStates = keyStates
+        return self._keyStates
 
     def isKeyDown(self, code):
-        return (self.keyStates[code] & (1 << 7)) != 0
+        if self._keyStates is None:
+            i = COMPACT_STATE_BITS.get(code)
+            if i is not None:
+                return (self.keyModifiers & (1 << i)) != 0
+            return code in self.keysDown
+        return (self._keyStates[code] & (1 << 7)) != 0
 
     def isKeyToggled(self, code):
+        # NOTE: compact key events only have the toggle states of COMPACT_STATE_KEYS
         return (self.keyStates[code] & 1) != 0
 
     def isChar(self):
@@ -58,7 +96,22 @@ class KeyEvent:
         return self.charCode in [0x3d, 0x5b, 0x5c, 0x5d, 0x27]
 
 
+# the client assumes that every key is wanted until we tell it otherwise
+KEY_INTEREST_UNKNOWN = object()
+
+
 class TextService:
+    # if the client supports it, a key is handled right after it's filtered, and the reply
+    # of onKeyDown() or onKeyUp() is sent together with filterKeyDown() or filterKeyUp()
+    # to save a round trip. set this to False in the derived class if the key should
+    # not be handled before the client asks for it.
+    fusedKeyEvents = True
+
+    # the key events are sent with a compact encoding of the key states, in which only
+    # the toggle states of the modifier and lock keys are available. set this to True
+    # in the derived class if the toggle states of the other keys are needed.
+    fullKeyStates = False
+
     def __init__(self, client):
         self.client = client
         self.isActivated = False
@@ -73,6 +126,21 @@ class TextService:
         self.compositionCursor = 0
         self.candidateCursor = 0
 
+        # the keys we told the client that we want to filter, see keyInterest()
+        self.publishedKeyInterest = KEY_INTEREST_UNKNOWN
+        # (method, keyCode, reply) of the key handled right after the previous filter
+        self.fusedKeyEvent = None
+        # the client dropped the reply of a fused key, send it the whole state, see addResyncState()
+        self.resyncPending = False
+
+        # the long candidate list shown page by page, see setCandidatePages()
+        self.candidatePages = None
+        self.candidateSourceId = 0
+        self.candidateCount = 0
+        self.candidatePageIndex = None  # the page shown, None if the list is not paged
+        # the pages the client keeps, the least recently used first
+        self.cachedCandidatePages = OrderedDict()
+
     def updateStatus(self, msg):
         pass
 
@@ -90,18 +158,40 @@ class TextService:
             self.checkConfigChange()  # check if configurations are changed
 
         self.updateStatus(msg)
+        fusedReply = None  # reply of onKeyDown or onKeyUp handled together with the filter
+        # the client tells us if it dropped the reply of a key handled with its filter
+        unusedFusedReply = msg.get("unusedFusedReply", False)
+        reusedReply = self.reusableFusedReply(self.fusedKeyEvent, method, msg) if unusedFusedReply else None
+        self.fusedKeyEvent = None
+        if (unusedFusedReply and reusedReply is None) or msg.get("resync", False):
+            # the key is not sent again, or the client lost a reply, so it still shows an old state
+            self.resyncPending = True
+            # the pages in the lost reply are not kept by the client
+            self.cachedCandidatePages.clear()
         if method == "filterKeyDown":
             keyEvent = KeyEvent(msg)
-            ret = self.filterKeyDown(keyEvent)
+            if reusedReply is not None:  # TSF tests the same key again
+                ret = True
+                fusedReply = reusedReply
+            else:
+                ret = self.filterKeyDown(keyEvent)
+                if ret and self.isKeyEventFused():
+                    fusedReply = ("onKeyDown", self.handleFusedKeyEvent(self.onKeyDown, keyEvent))
         elif method == "onKeyDown":
             keyEvent = KeyEvent(msg)
-            ret = self.onKeyDown(keyEvent)
+            ret = self.handleKeyEvent(reusedReply, self.onKeyDown, keyEvent)
         elif method == "filterKeyUp":
             keyEvent = KeyEvent(msg)
-            ret = self.filterKeyUp(keyEvent)
+            if reusedReply is not None:
+                ret = True
+                fusedReply = reusedReply
+            else:
+                ret = self.filterKeyUp(keyEvent)
+                if ret and self.isKeyEventFused():
+                    fusedReply = ("onKeyUp", self.handleFusedKeyEvent(self.onKeyUp, keyEvent))
         elif method == "onKeyUp":
             keyEvent = KeyEvent(msg)
-            ret = self.onKeyUp(keyEvent)
+            ret = self.handleKeyEvent(reusedReply, self.onKeyUp, keyEvent)
         elif method == "onPreservedKey":
             guid = msg["guid"].lower()
             ret = self.onPreservedKey(guid)
@@ -134,12 +224,79 @@ class TextService:
         # fetch the current reply of the method
         reply = self.currentReply
         self.currentReply = {}
+        # tell the client if the keys we want to filter are changed
+        keyInterest = self.keyInterest()
+        if keyInterest != self.publishedKeyInterest:
+            reply["keyInterest"] = keyInterest
+            self.publishedKeyInterest = keyInterest
+        if msg.get("replay", False):
+            # the launcher restarted the process and replays the session. the client
+            # won't get this reply and still has the keys of the old process.
+            self.publishedKeyInterest = KEY_INTEREST_UNKNOWN
         if ret is not None:
             reply["return"] = ret
+        if fusedReply is not None:
+            reply[fusedReply[0]] = fusedReply[1]
+            self.fusedKeyEvent = (fusedReply[0], keyEvent.keyCode, fusedReply[1])
         reply["success"] = success
         reply["seqNum"] = seqNum  # reply with sequence number added
         return reply
 
+    def isKeyEventFused(self):
+        return self.fusedKeyEvents and getattr(self.client, "fusedKeyEvents", False)
+
+    # handle a key which is just filtered, and return the reply of the handler
+    def handleFusedKeyEvent(self, handler, keyEvent):
+        filterReply = self.currentReply
+        self.currentReply = {}
+        ret = handler(keyEvent)
+        self.addResyncState()
+        reply = self.currentReply
+        self.currentReply = filterReply
+        if ret is not None:
+            reply["return"] = ret
+        reply["success"] = True
+        return reply
+
+    # the key is already handled with the previous filter if the client asks for the
+    # same key again right after dropping the reply. return the reply again instead of
+    # handling the key twice.
+    def reusableFusedReply(self, fusedKeyEvent, method, msg):
+        handlerMethod = {"filterKeyDown": "onKeyDown", "onKeyDown": "onKeyDown",
+                         "filterKeyUp": "onKeyUp", "onKeyUp": "onKeyUp"}.get(method)
+        if fusedKeyEvent is not None and fusedKeyEvent[0] == handlerMethod and fusedKeyEvent[1] == msg.get("keyCode"):
+            return (handlerMethod, fusedKeyEvent[2])
+        return None
+
+    def handleKeyEvent(self, reusedReply, handler, keyEvent):
+        if reusedReply is None:
+            ret = handler(keyEvent)
+        else:
+            self.currentReply.update(reusedReply[1])
+            ret = self.currentReply.pop("return", None)
+        self.addResyncState()
+        return ret
+
+    # The client dropped the reply of a key handled with its filter, which TSF did not send
+    # again, or it lost a reply, so it still shows an old state. The key cannot be undone here,
+    # so send the whole state with the reply of the next key, which the client handles in an
+    # edit session, instead of only the changes. The commit string of the key is lost.
+    def addResyncState(self):
+        if not self.resyncPending:
+            return
+        self.resyncPending = False
+        reply = self.currentReply
+        reply.setdefault("compositionString", self.compositionString)
+        reply.setdefault("compositionCursor", self.compositionCursor)
+        reply.setdefault("showCandidates", self.showCandidates)
+        if "candidateList" not in reply and "candidatePage" not in reply:
+            if self.candidatePageIndex is not None:
+                reply["candidateSource"] = self.candidateSourceReply()
+                reply["candidatePage"] = self.candidatePageReply(self.candidatePageIndex, True)
+            else:
+                reply["candidateList"] = self.candidateList
+        reply.setdefault("candidateCursor", self.candidateCursor)
+
     # methods that should be implemented by derived classes
     def onActivate(self):
         pass
@@ -159,6 +316,22 @@ class TextService:
     def onKeyUp(self, keyEvent):
         return False
 
+    # Return the keys we want to filter in the current state, so the client can
+    # skip the round trip of filterKeyDown() and filterKeyUp() for the other keys.
+    # This is called after every request. Return None to filter every key, or
+    # a dict in this format:
+    # {
+    #     "version": 1,
+    #     "keyDown": [virtual key codes to filter on key down],
+    #     "keyUp": [virtual key codes to filter on key up],
+    #     "modifiers": TF_MOD_* flags, filter every key while any of these modifiers is down,
+    #     "whileComposing": True to filter every key while composing or showing candidates
+    # }
+    # NOTE: filterKeyDown() and filterKeyUp() are not called for the other keys,
+    # so they must return False for them without relying on any side effects.
+    def keyInterest(self):
+        return None
+
     def onPreservedKey(self, guid):
         # print("onPreservedKey", guid)
         return False
@@ -239,8 +412,53 @@ class TextService:
 
     def setCandidateList(self, cand):
         self.candidateList = cand
+        self.candidatePageIndex = None
         self.currentReply["candidateList"] = cand
 
+    # Show a page of a long candidate list, which is split into pages of the same size.
+    # If the client supports candidate paging, the list is published as a candidate source
+    # and the candidates of a page are only sent when the client does not have them.
+    def setCandidatePages(self, pages, index):
+        cand = pages[index]
+        maxCachedPages = getattr(self.client, "candidatePaging", 0)
+        if not maxCachedPages:
+            self.setCandidateList(cand)
+            return
+        self.candidateList = cand
+        self.candidatePageIndex = index
+        if pages != self.candidatePages:
+            self.candidatePages = pages
+            self.candidateSourceId += 1
+            self.candidateCount = sum(len(page) for page in pages)
+            self.cachedCandidatePages.clear()
+            self.currentReply["candidateSource"] = self.candidateSourceReply()
+        self.currentReply["candidatePage"] = self.candidatePageReply(index, index not in self.cachedCandidatePages)
+
+    def candidateSourceReply(self):
+        return {
+            "id": self.candidateSourceId,
+            "count": self.candidateCount,
+            "pageSize": len(self.candidatePages[0])
+        }
+
+    def candidatePageReply(self, index, withCandidates):
+        reply = {
+            "source": self.candidateSourceId,
+            "index": index
+        }
+        if withCandidates:
+            # the size of the source is sent with the candidates in case the client missed the candidateSource
+            reply["count"] = self.candidateCount
+            reply["pageSize"] = len(self.candidatePages[0])
+            reply["candidates"] = self.candidatePages[index]
+        # the client keeps the pages like this
+        self.cachedCandidatePages[index] = True
+        self.cachedCandidatePages.move_to_end(index)
+        maxCachedPages = getattr(self.client, "candidatePaging", 0)
+        while len(self.cachedCandidatePages) > maxCachedPages:
+            self.cachedCandidatePages.popitem(last=False)
+        return reply
+
     def setCandidateCursor(self, pos):
         self.candidateCursor = pos
         self.currentReply["candidateCursor"] = pos